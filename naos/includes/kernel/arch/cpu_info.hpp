@@ -7,6 +7,7 @@ enum class feature
 {
     system_call_ret,
     pcid,
+    invpcid,
     fpu,
     huge_page_1gb,
     apic,
@@ -15,6 +16,7 @@ enum class feature
     msr,
     tsc,
     contant_tsc,
+    tsc_deadline,
     sse,
     sse2,
     sse3,
@@ -26,7 +28,24 @@ enum class feature
     max_virt_addr
 };
 
+/// position of a logical cpu, ids are unique inside their parent level
+struct topology_t
+{
+    u32 apic_id;
+    /// hardware thread in the core
+    u32 smt_id;
+    /// core in the package
+    u32 core_id;
+    u32 package_id;
+    /// cpus with the same llc_id share the last level cache
+    u32 llc_id;
+};
+
 void init();
+
+/// enumerate the topology of the executing cpu by CPUID leaf 0xB, or leaf 1 and 4 if 0xB isn't supported
+topology_t get_topology();
+
 /// check if has the feature
 bool has_feature(feature f);
 
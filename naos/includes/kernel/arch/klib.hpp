@@ -31,7 +31,7 @@ ExportC void _reload_segment(u64 cs, u64 ss);
 
 ExportC void _cpu_id(u64 param, u32 *out_eax, u32 *out_ebx, u32 *out_ecx, u32 *out_edx);
 #define cpu_id_ex(eax, ecx, o_eax, o_ebx, o_ecx, o_edx)                                                                \
-    _cpu_id((ecx) << 32 & (u32)(eax), (o_eax), (o_ebx), (o_ecx), (o_edx))
+    _cpu_id((u64)(ecx) << 32 | (u32)(eax), (o_eax), (o_ebx), (o_ecx), (o_edx))
 #define cpu_id(eax, o_eax, o_ebx, o_ecx, o_edx) _cpu_id((u32)(eax), (o_eax), (o_ebx), (o_ecx), (o_edx))
 
 ExportC NoReturn void _kernel_thread(regs_t *regs);
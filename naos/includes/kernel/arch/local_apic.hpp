@@ -44,6 +44,9 @@ class clock_event : public ::clock::clock_event
     friend irq::request_result on_event(const void *regs, u64 extra_data, u64 user_data);
     friend class clock_source;
     volatile bool is_suspend;
+    volatile bool is_oneshot;
+    /// one-shot events are programmed as an absolute TSC deadline
+    bool use_tsc_deadline;
     volatile u64 tick_count;
     volatile u32 init_counter;
     volatile u32 divide;
@@ -66,6 +69,9 @@ class clock_event : public ::clock::clock_event
     void wait_next_tick() override;
 
     bool is_valid() override { return true; }
+
+    bool support_oneshot() override { return true; }
+    void set_next_event(time::microsecond_t delta) override;
 };
 
 class clock_source : public ::clock::clock_source
@@ -1,5 +1,6 @@
 #pragma once
 #include "common.hpp"
+#include <atomic>
 #include <type_traits>
 /*
 kernel map
@@ -166,19 +167,59 @@ using base_paging_t = pml4t;
 
 bool map(base_paging_t *base_paging_addr, void *virt_start_addr, void *phy_start_addr, u64 frame_size, u64 frame_count,
          u32 page_ext_flags);
+/// map non-contiguous 4kb frames to a contiguous virtual range in one page table walk
+bool map_frames(base_paging_t *base_paging_addr, void *virt_start_addr, void *const *phy_frames, u64 frame_count,
+                u32 page_ext_flags);
 bool unmap(base_paging_t *base_paging_addr, void *virt_start_addr, u64 frame_size, u64 frame_count);
 
+/// PCIDs handed to address spaces on each cpu
+inline constexpr u32 pcid_slot_count = 6;
+inline constexpr u64 cr3_pcid_mask = 0xFFF;
+/// CR3 bit 63, keep the TLB entries of the loaded PCID
+inline constexpr u64 cr3_no_flush = 1ul << 63;
+
 void load(base_paging_t *base_paging_addr);
+/// flush the TLB entries of the current PCID
 void reload();
 
+/// load the page table of an address space, context_id is unique to the address space.
+///
+/// The TLB entries it left on this cpu are kept if it still owns a PCID here and tlb_generation hasn't changed
+/// since. A shootdown bumps tlb_generation instead of flushing the cpus which don't have the context loaded.
+void load_context(base_paging_t *base_paging_addr, u64 context_id, const std::atomic_uint64_t &tlb_generation);
+/// get the context last loaded by a cpu
+u64 get_loaded_context(u32 cpuid);
+/// flush the TLB entries of every address space on this cpu
+void flush_all_context();
+/// flush the TLB entry of a page of the current PCID
+void invalidate_page(void *virt_addr);
+
 void init();
 void temp_init(bool is_bsp);
 
-void copy_page_table(base_paging_t *to, base_paging_t *source, u64 start, u64 end, bool override);
+/// copy the 4kb mappings of [start, end) from source to to, the frames are shared by both tables.
+///
+/// Clears the writable bit in both tables if write_protect is set. frame_func is called with each frame copied.
+/// 2mb frames must be split before.
+///
+/// \return count of frames copied
+u64 copy_page_table(base_paging_t *to, base_paging_t *source, u64 start, u64 end, bool write_protect,
+                    void (*frame_func)(void *phy_addr));
 void sync_kernel_page_table(base_paging_t *to, base_paging_t *kernel);
 
 /// get phy addr
 bool get_map_address(base_paging_t *base_paging_addr, void *virt_addr, void **phy_addr);
+/// get the frame size mapping virt_addr, 0 if it is not mapped
+u64 get_map_frame_size(base_paging_t *base_paging_addr, void *virt_addr);
+/// get the entry mapping virt_addr, nullptr if it isn't mapped by a 4kb frame
+pt_entry *get_pte(base_paging_t *base_paging_addr, void *virt_addr);
+/// get the count of present 4kb entries in the page table covering the 2mb window of virt_addr.
+/// 0 if the window has no page table
+u64 get_page_table_entries(base_paging_t *base_paging_addr, void *virt_addr);
+/// replace the 2mb mapping at virt_addr with a page table of 512 4kb entries with the same flags
+///
+/// \return false if virt_addr isn't mapped by a 2mb frame
+bool split_big_page(base_paging_t *base_paging_addr, void *virt_addr);
 
 base_paging_t *current();
 
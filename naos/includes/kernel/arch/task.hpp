@@ -25,6 +25,8 @@ void init(::task::thread_t *thd, register_info_t *first_task_reg_info);
 
 u64 create_thread(::task::thread_t *thd, void *function, u64 arg0, u64 arg1, u64 arg2, u64 arg3);
 u64 enter_userland(::task::thread_t *thd, void *entry, u64 arg);
+/// make thd return to user mode from the syscall of the current thread with return value 0
+u64 create_fork_thread(::task::thread_t *thd);
 
 void *copy_to_return_signal(void *stack, void *ptr, u64 size);
 
@@ -36,6 +36,8 @@ class clock_source : public ::clock::clock_source
     void calibrate(::clock::clock_source *cs) override;
     u64 calibrate_tsc(::clock::clock_source *cs);
     u64 current() override;
+
+    u64 get_tick_per_microsecond() const { return tsc_tick_per_microsecond; }
 };
 
 clock_source *make_clock();
@@ -26,6 +26,11 @@ class clock_event
 
     virtual bool is_valid() = 0;
 
+    /// can the event be programmed to fire once, \see set_next_event
+    virtual bool support_oneshot() { return false; }
+    /// switch to one-shot mode and fire once after delta microseconds
+    virtual void set_next_event(time::microsecond_t delta) {}
+
     clock_source *get_source() const { return source; }
 
     void set_source(clock_source *cs) { source = cs; }
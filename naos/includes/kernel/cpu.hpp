@@ -1,6 +1,7 @@
 #pragma once
 #include "common.hpp"
 #include "lock.hpp"
+#include "timer.hpp"
 #include "wait.hpp"
 
 namespace task
@@ -23,12 +24,21 @@ struct load_data_t
     u64 last_tick_time = 0;
     u64 running_task_time = 0;
     u64 schedule_times = 0;
+    /// expiry of the armed scheduler tick, 0 if the tick is stopped
+    u64 next_tick = 0;
+    u64 tick_interval = 0;
+    timer::watcher_handle_t tick_watcher;
 
-    u64 load_calc_times = 0;
+    /// time spent in threads other than the idle thread
+    u64 busy_time = 0;
     u64 last_load_time = 0;
-    u64 calcing_load_fac = 0;
-
-    u64 recent_load_fac = 0;
+    u64 last_busy_time = 0;
+    /// runnable threads including the running one, sampled at the last load update
+    u64 runnable_count = 0;
+    /// decayed fraction of busy time, 1024 means always busy
+    u64 util_avg = 0;
+    /// decayed count of runnable threads including the running one, scaled by 1024
+    u64 runnable_avg = 0;
 };
 
 class cpu_data_t
@@ -51,6 +61,11 @@ class cpu_data_t
 
     task::wait_queue *soft_irq_wait_queue;
 
+    void *slab_cpu_cache = nullptr;
+    void *page_cpu_cache = nullptr;
+    void *migrate_queue = nullptr;
+    void *sched_domain = nullptr;
+
   public:
     friend void init();
     cpu_data_t() = default;
@@ -102,6 +117,16 @@ class cpu_data_t
     lock::spinlock_t &cpu_call_lock() { return call_lock; }
 
     task::wait_queue *get_soft_irq_wait_queue() { return soft_irq_wait_queue; }
+
+    void *get_slab_cpu_cache() { return slab_cpu_cache; }
+
+    void *get_page_cpu_cache() { return page_cpu_cache; }
+
+    void *get_migrate_queue() { return migrate_queue; }
+    void set_migrate_queue(void *queue) { migrate_queue = queue; }
+
+    void *get_sched_domain() { return sched_domain; }
+    void set_sched_domain(void *domain) { sched_domain = domain; }
 };
 cpu_data_t &current();
 void init();
@@ -30,6 +30,10 @@ class inode : public vfs::inode
   public:
     bool create_symbolink(vfs::dentry *entry, const char *target) override;
     const char *symbolink() override;
+
+    bool has_data_pages() override { return true; }
+    bool read_page(u64 index, byte *buffer) override;
+    bool write_page(u64 index, const byte *buffer, u64 size) override;
 };
 
 class file : public vfs::file
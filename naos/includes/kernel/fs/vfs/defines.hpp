@@ -101,6 +101,7 @@ class file;
 class file_system;
 struct nameidata;
 class super_block;
+class page_cache;
 } // namespace vfs
 
 struct dirstream
@@ -14,9 +14,13 @@ class file
     u64 ref_count;
 
   public:
+    /// state of an open pseudo file, owned by its pseudo_t
+    void *pseudo_state;
+
     file()
         : pointer_offset(0)
-        , ref_count(0){};
+        , ref_count(0)
+        , pseudo_state(nullptr){};
 
     file(const file &f) = delete;
     file &operator=(const file &f) = delete;
@@ -1,6 +1,7 @@
 #pragma once
 #include "common.hpp"
 #include "defines.hpp"
+#include <atomic>
 namespace fs::vfs
 {
 class pseudo_t;
@@ -25,10 +26,11 @@ class inode
     group_id group;
     u64 permission;
     pseudo_t *pseudo_data;
+    std::atomic<page_cache *> cache = nullptr;
 
   public:
     inode() = default;
-    virtual ~inode() = default;
+    virtual ~inode();
     // create file in disk
     virtual void create(dentry *entry);
 
@@ -45,6 +47,17 @@ class inode
 
     bool create_pseudo(dentry *entry, inode_type_t t, u64 size);
 
+    /// the file system keeps the data of regular files in pages, they are read through a page cache
+    virtual bool has_data_pages() { return false; }
+    /// read the data page at index into buffer, bytes after the end of file are zeroed
+    virtual bool read_page(u64 index, byte *buffer) { return false; }
+    /// write size bytes of the data page at index back, the file size doesn't change
+    virtual bool write_page(u64 index, const byte *buffer, u64 size) { return false; }
+    /// get the page cache of a regular file, created at the first call
+    ///
+    /// \return nullptr if the file system has no data pages
+    page_cache *get_page_cache();
+
     virtual u64 hash();
 
     void set_type(inode_type_t t) { info = (info & 0xFFFFFFFFFFFFFFF0) | (u64)t; }
@@ -0,0 +1,88 @@
+#pragma once
+#include "../../lock.hpp"
+#include "common.hpp"
+#include "defines.hpp"
+
+namespace fs::vfs
+{
+/// index bits resolved by one level of the radix tree
+inline constexpr u64 page_cache_node_shift = 6;
+inline constexpr u64 page_cache_node_slots = 1ul << page_cache_node_shift;
+
+/// Inner node of the radix tree of a page cache. A slot of a leaf node holds a page entry.
+struct page_cache_node
+{
+    void *slots[page_cache_node_slots];
+    u32 count;
+};
+
+/// Cached data pages of a regular file, indexed by page index in a radix tree.
+///
+/// file::read and the faults of file vm go through it, so every mapping of a page shares one frame. The
+/// share_count of a cached frame counts its mappings and pins. A page is only evicted when it's clean and
+/// neither mapped nor pinned. Writes of shared file mappings are tracked by the dirty bit of the entry.
+class page_cache
+{
+  private:
+    inode *owner;
+    page_cache_node *root;
+    /// levels of the tree, 0 if it's empty
+    u32 height;
+    u64 page_count;
+    u64 dirty_count;
+    /// bumped by each update, a page read from the inode meanwhile is stale
+    u64 write_seq;
+    lock::spinlock_t lock;
+    /// link of the list walked by the shrinker
+    page_cache *prev, *next;
+
+    friend u64 page_cache_shrink_count(u64 user_data);
+    friend u64 page_cache_shrink_scan(u64 nr_pages, u64 user_data);
+
+    /// \return slot of the entry at index, nullptr if the leaf node doesn't exist
+    void **lookup_slot(u64 index);
+    bool insert(u64 index, void *entry);
+    void remove(u64 index);
+    /// collect up to max entries at index >= start whose tag is set, all entries if tag is 0
+    u64 gang_lookup(u64 start, u64 tag, u64 *indexes, void **entries, u64 max);
+
+  public:
+    explicit page_cache(inode *owner);
+    ~page_cache();
+    page_cache(const page_cache &) = delete;
+    page_cache &operator=(const page_cache &) = delete;
+
+    /// get the page at index and pin it, the page is read from the inode if it isn't cached
+    ///
+    /// \param io set if the page has been read from the inode
+    /// \return kernel address of the page, nullptr if no page is free or the inode can't read it
+    byte *get_page(u64 index, bool *io = nullptr);
+    /// unpin a page returned by get_page, a pin given to a mapping is dropped by unmapping it instead
+    void put_page(byte *page);
+
+    /// mark the page at index dirty if it's still the cached page
+    void set_dirty(u64 index, byte *page);
+    /// write the dirty pages in [start, end) back to the inode
+    ///
+    /// \return count of pages written
+    u64 writeback(u64 start, u64 end);
+    /// drop up to nr_pages clean pages which are neither mapped nor pinned
+    ///
+    /// \return count of pages freed
+    u64 evict(u64 nr_pages);
+
+    /// read the file data at offset through the cache
+    ///
+    /// \return bytes read
+    i64 read(u64 offset, byte *buffer, u64 size);
+    /// copy data just written to the inode at offset into the cached pages
+    void update(u64 offset, const byte *buffer, u64 size);
+
+    u64 get_page_count() const { return page_count; }
+    u64 get_dirty_count() const { return dirty_count; }
+};
+
+/// register the page cache shrinker
+void init_page_cache();
+
+} // namespace fs::vfs
@@ -1,7 +1,10 @@
 #pragma once
+#include "../../lock.hpp"
+#include "../../mm/mm.hpp"
 #include "../../util/circular_buffer.hpp"
 #include "../../wait.hpp"
 #include "common.hpp"
+#include "defines.hpp"
 namespace fs::vfs
 {
 /// pseudo device interface
@@ -11,6 +14,11 @@ class pseudo_t
     virtual i64 write(const byte *data, u64 size, flag_t flags) = 0;
     virtual i64 read(byte *data, u64 max_size, flag_t flags) = 0;
     virtual void close() = 0;
+
+    /// read through an open file, a device keeping state per open file overrides it
+    virtual i64 read_file(file *f, byte *data, u64 max_size, flag_t flags) { return read(data, max_size, flags); }
+    /// the last reference of an open file is gone, free its state
+    virtual void release_file(file *f) {}
 };
 
 class pseudo_pipe_t : public pseudo_t
@@ -33,4 +41,31 @@ class pseudo_pipe_t : public pseudo_t
     }
 };
 
+/// generate the text of a pseudo_text_t, return the text length
+typedef u64 (*pseudo_text_func)(char *buffer, u64 size);
+
+/// Read-only text file like /proc. The text is generated by the first read and after the end was read,
+/// so a reader polling it always sees a fresh snapshot.
+///
+/// Each open file has its own snapshot and offset, kept in file::pseudo_state.
+class pseudo_text_t : public pseudo_t
+{
+    pseudo_text_func func;
+    u64 buffer_size;
+    /// serializes func
+    lock::spinlock_t spinlock;
+
+  public:
+    i64 write(const byte *data, u64 size, flag_t flags) override;
+    i64 read(byte *data, u64 max_size, flag_t flags) override;
+    void close() override;
+    i64 read_file(file *f, byte *data, u64 max_size, flag_t flags) override;
+    void release_file(file *f) override;
+    pseudo_text_t(pseudo_text_func func, u64 size = memory::page_size * 4)
+        : func(func)
+        , buffer_size(size)
+    {
+    }
+};
+
 } // namespace fs::vfs
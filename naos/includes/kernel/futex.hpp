@@ -0,0 +1,48 @@
+#pragma once
+#include "common.hpp"
+
+namespace task
+{
+struct thread_t;
+
+enum class futex_wait_result : u8
+{
+    ok,
+    /// the value at the address wasn't the expected value
+    again,
+    timeout,
+    interrupted,
+};
+
+///
+/// \brief block the current thread while *addr == val
+///
+/// The futex is keyed by the vm info of the current process and the user virtual address,
+/// waiters are kept in a hashed wait queue table.
+///
+/// \param timeout microseconds to wait at most, 0 waits forever
+futex_wait_result futex_wait(u32 *addr, u32 val, u64 timeout);
+
+///
+/// \brief wake up waiters of addr
+///
+/// \param count maximum number of waiters to wake up
+/// \return count of waiters woken up
+u64 futex_wake(u32 *addr, u64 count);
+
+///
+/// \brief wake up waiters of addr and move the rest to addr2 without waking them up
+///
+/// \param count maximum number of waiters to wake up
+/// \param requeue_count maximum number of waiters to move to addr2
+/// \param addr2 must differ from addr
+/// \return count of waiters woken up and moved
+u64 futex_requeue(u32 *addr, u64 count, u64 requeue_count, u32 *addr2);
+
+///
+/// \brief unlink the waiter of a thread torn down while it waits and cancel its timeout
+///
+/// The waiter is found through the bucket the thread is queued in, it may be called while the thread runs.
+void futex_cancel(thread_t *thd);
+
+} // namespace task
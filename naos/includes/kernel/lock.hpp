@@ -5,122 +5,174 @@
 
 namespace lock
 {
-/// Not nestable, unfair spinlock
+/// Contention statistics of a class of locks, reported by /proc/lockstat.
+///
+/// The counters are only updated in a kernel built with LOCK_STAT. A lock reports to it after set_stat.
+struct lock_stat_t
+{
+    const char *name;
+    std::atomic_uint64_t acquire_count;
+    std::atomic_uint64_t contended_count;
+    std::atomic_uint64_t max_wait_cycles;
+    lock_stat_t *next;
+
+    /// register the statistics, the object must never be destroyed
+    explicit lock_stat_t(const char *name);
+    lock_stat_t(const lock_stat_t &) = delete;
+    lock_stat_t &operator=(const lock_stat_t &) = delete;
+
+    void record_contended(u64 wait_cycles);
+};
+
+///
+/// \brief write a text report of every lock_stat_t
+///
+/// \return length of the report, truncated to size
+u64 lock_stat_info(char *buffer, u64 size);
+
+inline constexpr u32 spinlock_locked = 1;
+inline constexpr u32 spinlock_locked_mask = 0xFF;
+
+/// Not nestable, fair queued spinlock.
+///
+/// The lock word holds a locked byte and the tail of a queue of waiting CPUs (MCS). Each waiter spins on its own
+/// per-CPU node instead of the lock word, and the lock is passed in arrival order.
 struct spinlock_t
 {
   private:
-    std::atomic_flag lock_m = ATOMIC_FLAG_INIT;
+    /// bit 0-7: locked. bit 16-31: tail of the queue, (cpu + 1) << 2 | node index
+    std::atomic_uint32_t lock_m;
+#ifdef _LOCK_STAT
+    lock_stat_t *stat = nullptr;
+#endif
 #ifdef _DEBUG
-    u64 last_stack_pointer;
-    std::atomic_uint64_t wait_times;
+    u64 last_stack_pointer = 0;
 #endif
+    void lock_slow();
+
   public:
-    spinlock_t() = default;
+    constexpr spinlock_t()
+        : lock_m(0)
+    {
+    }
     spinlock_t(const spinlock_t &) = delete;
     spinlock_t &operator=(const spinlock_t &) = delete;
     void lock()
     {
-        do
+        u32 exp = 0;
+        if (likely(lock_m.compare_exchange_strong(exp, spinlock_locked, std::memory_order_acquire)))
         {
-            while (lock_m._M_i)
-                cpu_pause();
-#ifdef _DEBUG
-            wait_times++;
+#ifdef _LOCK_STAT
+            if (stat != nullptr)
+                stat->acquire_count++;
 #endif
-        } while (lock_m.test_and_set(std::memory_order_acquire));
+        }
+        else
+        {
+            lock_slow();
+        }
 #ifdef _DEBUG
         last_stack_pointer = get_stack();
-        wait_times = 0;
 #endif
     }
 
-    bool try_lock() { return !lock_m.test_and_set(std::memory_order_acquire); }
+    bool try_lock()
+    {
+        u32 exp = 0;
+        return lock_m.compare_exchange_strong(exp, spinlock_locked, std::memory_order_acquire);
+    }
+
+    void unlock() { lock_m.fetch_sub(spinlock_locked, std::memory_order_release); }
+
+    bool is_locked() const { return lock_m.load(std::memory_order_relaxed) & spinlock_locked_mask; }
 
-    void unlock() { lock_m.clear(std::memory_order_release); }
+    void set_stat(lock_stat_t *stat)
+    {
+#ifdef _LOCK_STAT
+        this->stat = stat;
+#endif
+    }
 };
 
-/// read write lock
+inline constexpr u64 rw_lock_writer = 1ul << 63;
+inline constexpr u64 rw_lock_waiting_writer = 1ul << 32;
+inline constexpr u64 rw_lock_reader_mask = 0xFFFFFFFFul;
+
+/// Writer preferring read write lock.
+///
+/// A reader waits while a writer holds the lock or waits for it, so writers don't starve behind a stream of
+/// readers. A reader in interrupt context only waits for the writer holding the lock, like the reader it
+/// interrupted. Don't take the read lock recursively in task context.
 struct rw_lock_t
 {
   private:
-    std::atomic_uint64_t lock_m = ATOMIC_FLAG_INIT;
+    /// bit 0-31: readers. bit 32-62: waiting writers. bit 63: writer
+    std::atomic_uint64_t lock_m;
     static_assert(sizeof(lock_m) == 8);
+#ifdef _LOCK_STAT
+    lock_stat_t *stat = nullptr;
+#endif
+    void lock_read_slow();
+    void lock_write_slow();
 
   public:
-    rw_lock_t() = default;
+    constexpr rw_lock_t()
+        : lock_m(0)
+    {
+    }
     rw_lock_t(const rw_lock_t &) = delete;
     rw_lock_t &operator=(const rw_lock_t &) = delete;
 
     void lock_read()
     {
-        u64 exp;
-        do
+        if (likely(try_lock_read()))
         {
-            while (lock_m == 0x8000000000000000UL)
-                cpu_pause();
-
-            exp = lock_m & 0x7FFFFFFFFFFFFFFFUL;
-        } while (!lock_m.compare_exchange_strong(exp, exp + 1, std::memory_order_acquire));
+#ifdef _LOCK_STAT
+            if (stat != nullptr)
+                stat->acquire_count++;
+#endif
+            return;
+        }
+        lock_read_slow();
     }
 
     void lock_write()
     {
-        u64 exp;
-        do
+        if (likely(try_lock_write()))
         {
-            while (lock_m != 0)
-                cpu_pause();
-            exp = 0;
-        } while (!lock_m.compare_exchange_strong(exp, 0x8000000000000000UL, std::memory_order_acquire));
+#ifdef _LOCK_STAT
+            if (stat != nullptr)
+                stat->acquire_count++;
+#endif
+            return;
+        }
+        lock_write_slow();
     }
 
     bool try_lock_read()
     {
-        u64 exp;
-        if (lock_m == 0x8000000000000000UL)
+        u64 exp = lock_m.load(std::memory_order_relaxed);
+        if (exp & ~rw_lock_reader_mask)
             return false;
-        exp = lock_m & 0x7FFFFFFFFFFFFFFFUL;
         return lock_m.compare_exchange_strong(exp, exp + 1, std::memory_order_acquire);
     }
 
     bool try_lock_write()
     {
-        u64 exp;
-        if (lock_m != 0)
-            return false;
-        exp = 0;
-        return lock_m.compare_exchange_strong(exp, 0x8000000000000000UL, std::memory_order_acquire);
+        u64 exp = 0;
+        return lock_m.compare_exchange_strong(exp, rw_lock_writer, std::memory_order_acquire);
     }
 
-    void unlock_read()
-    {
-        u64 exp;
-        do
-        {
-#ifdef _DEBUG
-            if (lock_m & 0x8000000000000000UL)
-            {
-                /// TODO: state is invalid.
-            }
-#endif
-            exp = lock_m & 0x7FFFFFFFFFFFFFFFUL;
-        } while (!lock_m.compare_exchange_strong(exp, exp - 1, std::memory_order_release));
-    }
+    void unlock_read() { lock_m.fetch_sub(1, std::memory_order_release); }
 
-    void unlock_write()
+    void unlock_write() { lock_m.fetch_and(~rw_lock_writer, std::memory_order_release); }
+
+    void set_stat(lock_stat_t *stat)
     {
-        u64 exp;
-        do
-        {
-#ifdef _DEBUG
-            if (lock_m == 0)
-            {
-                /// TODO: state is invalid.
-            }
+#ifdef _LOCK_STAT
+        this->stat = stat;
 #endif
-            exp = 0x8000000000000000UL;
-        } while (!lock_m.compare_exchange_strong(exp, 0, std::memory_order_release));
     }
-}; // namespace lock
+};
 
-}; // namespace lock
\ No newline at end of file
+}; // namespace lock
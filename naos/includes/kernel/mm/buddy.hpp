@@ -1,58 +1,139 @@
 #pragma once
+#include "../lock.hpp"
 #include "allocator.hpp"
 #include "common.hpp"
+#include "page.hpp"
 
 namespace memory
 {
 
-///< For debugging
-struct buddy_tree
+/// Number of free lists per zone. The largest block is 2^(buddy_max_order - 1) pages (8MiB).
+inline constexpr u32 buddy_max_order = 12;
+
+/// Physical memory below 16MB belongs to the DMA zone
+inline constexpr u64 dma_zone_limit = 0x1000000;
+
+enum class zone_type_t : u8
 {
-    buddy_tree *left;
-    buddy_tree *right;
-    u64 val;
+    dma,
+    normal,
 };
 
-extern const int buddy_max_page;
+/// Maximum pages kept in the hot list of a per-CPU page cache
+inline constexpr u32 page_cpu_cache_high = 128;
+/// Pages moved between a per-CPU page cache and the buddy at once
+inline constexpr u32 page_cpu_cache_batch = 32;
+
+/// Per-CPU cache of single pages in front of the buddy system.
+///
+/// Pages freed by this CPU are pushed to the hot list and reused first (LIFO), they are likely still in cache.
+/// Pages refilled from the buddy land in the cold list. Only accessed by the owner CPU with interrupts disabled.
+struct page_cpu_cache
+{
+    void *hot[page_cpu_cache_high];
+    void *cold[page_cpu_cache_batch];
+    u32 hot_count = 0;
+    u32 cold_count = 0;
+
+    u64 alloc_times = 0;
+    u64 free_times = 0;
+    u64 refill_times = 0;
+    u64 refill_pages = 0;
+    u64 drain_times = 0;
+    u64 drain_pages = 0;
+};
+
+struct buddy_free_area_t
+{
+    page_t *head;
+    u64 count;
+};
 
+/// Per-zone buddy system.
+///
+/// Free blocks are linked through the descriptor of their first page, one list per order.
+/// Blocks are naturally aligned by physical frame number, so a block of order n is always aligned to 2^n pages.
 class buddy
 {
   private:
-    const int size;
-    /// The 0th to last element comes from the output of the binary tree traversal. Element 0 is root.
-    u16 *array;
-    u64 fit_size(u64 size);
+    page_t *pages;
+    u64 start_pfn;
+    u64 end_pfn;
+    u64 free_pages;
+    u64 watermark_min;
+    u64 watermark_low;
+    u64 watermark_high;
+    buddy_free_area_t free_area[buddy_max_order];
+    lock::spinlock_t spinlock;
+
+    page_t *pfn_to_page(u64 pfn) { return &pages[pfn - start_pfn]; }
+    u64 page_to_pfn(page_t *page) { return start_pfn + (page - pages); }
+
+    void list_add(u64 pfn, u32 order);
+    void list_del(u64 pfn, u32 order);
+    void free_block(u64 pfn, u32 order);
+    i64 alloc_block(u32 order, u32 align_order);
 
   public:
-    buddy(int max_level);
+    buddy(page_t *pages, u64 start_pfn, u64 page_count);
     ~buddy() = default;
     buddy(const buddy &) = delete;
     buddy &operator=(const buddy &) = delete;
 
-    int alloc(u64 size);
-    void free(int offset);
+    /// Allocate 2^order pages aligned to 2^align_order pages
+    ///
+    /// \return first PFN of the block, -1 if no block is large enough
+    i64 alloc(u32 order, u32 align_order);
+    /// Allocate up to count single pages under one lock
+    ///
+    /// \return count of pages written to pfns
+    u32 alloc_bulk(u64 *pfns, u32 count);
+    /// Free a block returned by alloc
+    void free(u64 pfn);
+    /// Free single pages of this zone under one lock
+    void free_bulk(const u64 *pfns, u32 count);
+    /// Turn an allocated block into single pages that can be freed one by one
+    void split(u64 pfn);
+    /// Remove pages [pfn_start, pfn_end) from free lists. Used to reserve memory at boot.
+    void tag_alloc(u64 pfn_start, u64 pfn_end);
 
-    bool tag_alloc(int start_offset, int len);
-    // for debug
-    buddy_tree *gen_tree();
-    // also for debug
-    void cat_tree(buddy_tree *tree, int index);
-};
+    u64 get_free_pages() const { return free_pages; }
+    u64 get_free_blocks(u32 order) const { return free_area[order].count; }
 
-struct buddy_contanier
-{
-    int count;
-    buddy *buddies;
+    /// allocations dip under the min watermark only if every zone is there
+    u64 get_watermark_min() const { return watermark_min; }
+    /// the reclaim thread is woken under the low watermark
+    u64 get_watermark_low() const { return watermark_low; }
+    /// the reclaim thread stops at the high watermark
+    u64 get_watermark_high() const { return watermark_high; }
 };
 
+/// Get the minimum order whose block can hold size bytes
+u32 size_to_order(u64 size);
+
 class BuddyAllocator : public IAllocator
 {
+  private:
+    zone_type_t zone_type;
+
   public:
-    BuddyAllocator();
+    /// Allocations from a normal allocator fall back to the DMA zones,
+    /// a DMA allocator never leaves the DMA zones
+    BuddyAllocator(zone_type_t zone_type);
     ~BuddyAllocator();
     void *allocate(u64 size, u64 align) override;
     void deallocate(void *ptr) override;
+
+    /// Allocate up to count single pages, used to refill per-CPU page caches
+    ///
+    /// \return count of pages written to pages
+    u32 allocate_pages(void **pages, u32 count);
+    /// Free single pages allocated by allocate_pages
+    void deallocate_pages(void *const *pages, u32 count);
+    /// Turn a block returned by allocate into single pages, each page is then freed by deallocate_pages
+    void split(void *ptr);
 };
 extern BuddyAllocator *KernelBuddyAllocatorV;
+extern BuddyAllocator *KernelDMABuddyAllocatorV;
 
 } // namespace memory
@@ -18,9 +18,10 @@ template <typename ListType> class list_node_cache_allocator : public IAllocator
     struct KList
     {
         KList *prev;
+        KList *next;
         Node *available;
         u32 counter;
-        char data[memory::page_size - sizeof(void *) * 2 - sizeof(counter)];
+        char data[memory::page_size - sizeof(void *) * 3 - sizeof(counter)];
         void add_counter() { counter++; }
         void remove_counter() { counter--; }
         u32 get_counter() { return counter; }
@@ -44,6 +45,7 @@ template <typename ListType> class list_node_cache_allocator : public IAllocator
         KList *list = memory::New<KList>(memory::KernelBuddyAllocatorV);
 
         list->prev = nullptr;
+        list->next = nullptr;
         Node *start = next_node((Node *)(&list->data));
         list->available = start;
         while (1)
@@ -78,6 +80,8 @@ template <typename ListType> class list_node_cache_allocator : public IAllocator
         {
             current = alloc_page();
             current->prev = last;
+            if (last != nullptr)
+                last->next = current;
             last = current;
         }
         current->add_counter();
@@ -88,31 +92,22 @@ template <typename ListType> class list_node_cache_allocator : public IAllocator
     }
     void delete_node(Node *node)
     {
-        KList *current = last, *next = nullptr;
-        while (current != nullptr)
+        // pages come from the buddy allocator, so the page header is found by alignment
+        KList *current = (KList *)((u64)node & ~(memory::page_size - 1));
+        node->next = current->available;
+        current->available = node;
+        current->remove_counter();
+        if (unlikely(current->get_counter() == 0))
         {
-            if ((char *)current < (char *)node && (char *)current + memory::page_size > (char *)node)
-            {
-                node->next = current->available;
-                current->available = node;
-                current->remove_counter();
-                if (unlikely(current->get_counter() == 0))
-                {
-                    if (next != nullptr)
-                    {
-                        next->prev = current->prev;
-                    }
-                    else
-                        last = nullptr;
-
-                    free_page(current);
-                }
-                return;
-            }
-            next = current;
-            current = current->prev;
+            if (current->next != nullptr)
+                current->next->prev = current->prev;
+            else
+                last = current->prev;
+            if (current->prev != nullptr)
+                current->prev->next = current->next;
+
+            free_page(current);
         }
-        // kassert(false, "Can't free list node ", (void *)node);
     }
 
     void *allocate(u64 size, u64 align) override { return new_node(); }
@@ -1,8 +1,10 @@
 #pragma once
 #include "../kernel.hpp"
 #include "allocator.hpp"
+#include "buddy.hpp"
 #include "common.hpp"
 #include "mm.hpp"
+#include "page.hpp"
 #include <utility>
 
 namespace memory
@@ -26,8 +28,11 @@ struct zone_t
     void *start;
     void *end;
     u64 page_count;
+    zone_type_t type;
     /// buddy pointer
     void *buddy_impl;
+    /// page descriptors, one per page
+    page_t *pages;
     /// tell buddy system memory needs to be reserved
     void tag_used(u64 offset_start, u64 offset_end);
 };
@@ -1,6 +1,7 @@
 #pragma once
 #include "allocator.hpp"
 #include <new>
+#include <utility>
 namespace memory
 {
 
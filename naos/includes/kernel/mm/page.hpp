@@ -0,0 +1,59 @@
+#pragma once
+#include "common.hpp"
+#include <atomic>
+
+namespace memory
+{
+class slab_group;
+struct slab;
+
+namespace page_flags
+{
+enum flags : u64
+{
+    /// page belongs to a slab
+    slab = 1ul << 0,
+    /// page is the first page of a free buddy block
+    buddy_free = 1ul << 1,
+    /// page is the first page of a multi-page kmalloc block, block size is 2^order pages
+    large_kmalloc = 1ul << 2,
+};
+} // namespace page_flags
+
+/// Physical page descriptor.
+///
+/// Every page frame of each zone owns one, indexed by PFN relative to the zone start.
+struct page_t
+{
+    u64 flags;
+    /// Block order of a buddy block head, valid for free and allocated blocks
+    u32 order;
+    /// Links of the buddy free list if page_flags::buddy_free is set
+    page_t *free_prev;
+    page_t *free_next;
+    /// Owner slab group if page_flags::slab is set
+    slab_group *slab_group_owner;
+    /// Slab header of the slab containing this page
+    slab *slab_owner;
+    /// Other address spaces mapping this frame copy-on-write, the last one to unmap it frees it
+    std::atomic_uint32_t share_count;
+
+    page_t()
+        : flags(0)
+        , order(0)
+        , free_prev(nullptr)
+        , free_next(nullptr)
+        , slab_group_owner(nullptr)
+        , slab_owner(nullptr)
+        , share_count(0)
+    {
+    }
+};
+
+/// get page descriptor of a physical address, nullptr if the address is not in any zone
+page_t *phy_addr_to_page(void *phy_addr);
+
+/// get page descriptor of a kernel linear address
+page_t *virt_addr_to_page(void *virt_addr);
+
+} // namespace memory
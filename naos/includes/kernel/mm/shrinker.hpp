@@ -0,0 +1,54 @@
+#pragma once
+#include "common.hpp"
+
+namespace memory
+{
+/// count pages the cache could give back
+typedef u64 (*shrinker_count_func)(u64 user_data);
+/// free up to nr_pages pages, return the count of pages freed
+typedef u64 (*shrinker_scan_func)(u64 nr_pages, u64 user_data);
+
+/// A cache which can give memory back under pressure.
+///
+/// Shrinkers are called from the reclaim thread when a zone falls below its low watermark or an allocation fails.
+struct shrinker_t
+{
+    const char *name;
+    shrinker_count_func count;
+    shrinker_scan_func scan;
+    u64 user_data;
+    shrinker_t *next;
+
+    shrinker_t(const char *name, shrinker_count_func count, shrinker_scan_func scan, u64 user_data)
+        : name(name)
+        , count(count)
+        , scan(scan)
+        , user_data(user_data)
+        , next(nullptr)
+    {
+    }
+};
+
+void register_shrinker(shrinker_t *shrinker);
+void unregister_shrinker(shrinker_t *shrinker);
+
+/// call shrinkers until nr_pages pages are freed
+///
+/// \return the count of pages freed
+u64 shrink_all(u64 nr_pages);
+
+/// ask the reclaim thread to balance the zones, safe to call from allocation paths
+///
+/// The reclaim thread is only woken up by the call which sets the request.
+void wakeup_reclaim();
+
+/// park the reclaim thread until wakeup_reclaim is called
+void wait_reclaim();
+
+/// Reclaim until every zone below its low watermark is back to its high watermark.
+/// Called by the reclaim thread.
+///
+/// \return the count of pages freed
+u64 balance_zones();
+
+} // namespace memory
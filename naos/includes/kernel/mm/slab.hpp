@@ -4,11 +4,16 @@
 #include "buddy.hpp"
 #include "common.hpp"
 #include "list_node_cache.hpp"
+#include "page.hpp"
 
 #define NewSlabGroup(domain, struct, align, flags) domain->create_new_slab_group(sizeof(struct), #struct, align, flags)
+#define NewSlabGroupWithCtor(domain, struct, align, flags, ctor, dtor)                                                 \
+    domain->create_new_slab_group(sizeof(struct), #struct, align, flags, ctor, dtor)
 
 namespace memory
 {
+struct slab;
+using slab_list_t = util::linked_list<slab *>;
 
 struct slab
 {
@@ -17,6 +22,8 @@ struct slab
     u32 rest;
     u32 color_offset;
     char *data_ptr;
+    /// node in the empty/partial/full list of the group
+    slab_list_t::iterator list_node;
 
     slab(slab &) = delete;
     slab(const slab &) = delete;
@@ -29,7 +36,54 @@ struct slab
           };
 };
 
-using slab_list_t = util::linked_list<slab *>;
+/// Slab color offsets step by cache line
+inline constexpr u64 slab_cache_line_size = 64;
+
+/// Object constructor or destructor.
+///
+/// Constructors run when a slab is created and destructors when it is released, so objects stay in the
+/// constructed state across alloc/free. They must not allocate from their own group.
+typedef void (*slab_obj_func)(void *obj);
+
+/// Max objects a magazine can hold
+inline constexpr u32 slab_magazine_max_rounds = 62;
+/// Max slab groups which can have a per-cpu magazine cache
+inline constexpr u32 slab_cpu_cache_max_groups = 64;
+
+/// A stack of free objects owned by a cpu or the group depot
+struct slab_magazine
+{
+    slab_magazine *next;
+    u32 rounds;
+    u32 capacity;
+    void *objects[slab_magazine_max_rounds];
+
+    slab_magazine(u32 capacity)
+        : next(nullptr)
+        , rounds(0)
+        , capacity(capacity)
+    {
+    }
+
+    bool is_full() const { return rounds >= capacity; }
+    bool is_empty() const { return rounds == 0; }
+};
+
+static_assert(sizeof(slab_magazine) == 512);
+
+/// Per cpu object cache of a slab group.
+///
+/// 'previous' is always full or empty. Used with interrupts disabled.
+struct slab_cpu_cache
+{
+    slab_magazine *loaded = nullptr;
+    slab_magazine *previous = nullptr;
+    u64 alloc_hit = 0;
+    u64 alloc_miss = 0;
+    u64 free_hit = 0;
+    u64 free_miss = 0;
+};
+
 using slab_list_node_allocator_t = memory::list_node_cache_allocator<slab_list_t>;
 
 /// A same slab list set
@@ -41,7 +95,13 @@ class slab_group
     const u64 size;
     const char *name;
     slab_list_t list_empty, list_partial, list_full;
+    /// color offset of the next new slab
     u32 color_offset;
+    /// largest color offset fitting the leftover space of a slab
+    u32 color_max;
+    u32 color_align;
+    slab_obj_func ctor;
+    slab_obj_func dtor;
     u64 flags;
     u64 align;
     u32 node_pre_slab;
@@ -49,19 +109,65 @@ class slab_group
     u64 all_obj_count;
     u64 all_obj_used;
 
+    /// index of the per cpu cache table
+    u32 cpu_cache_index;
+    /// rounds per magazine, 0 disables the magazine layer
+    u32 magazine_size;
+    lock::spinlock_t depot_lock;
+    slab_magazine *depot_full;
+    slab_magazine *depot_empty;
+    u64 depot_full_count;
+    u64 depot_empty_count;
+
   private:
     void new_memory_node();
     void delete_memory_node(slab *s);
 
+    void *slab_alloc();
+    void slab_free(void *ptr);
+
+    slab_cpu_cache *get_cpu_cache();
+    void *magazine_alloc(slab_cpu_cache *cache);
+    bool magazine_free(slab_cpu_cache *cache, void *ptr);
+    slab_magazine *depot_pop(slab_magazine *&list, u64 &count);
+    void depot_push(slab_magazine *&list, u64 &count, slab_magazine *mag);
+    /// free the objects of a magazine to their slabs, then the magazine itself
+    void drain_magazine(slab_magazine *mag);
+
   public:
-    slab_group(memory::IAllocator *allocator, u64 size, const char *name, u64 align, u64 flags);
+    slab_group(memory::IAllocator *allocator, u64 size, const char *name, u64 align, u64 flags,
+               slab_obj_func ctor = nullptr, slab_obj_func dtor = nullptr);
 
     const char *get_name() const { return name; }
     u64 get_size() const { return size; }
     void *alloc();
     void free(void *ptr);
     bool include_address(void *ptr);
-    int shrink();
+    /// Give cached objects of the depot and of the current cpu back to their slabs and free every empty slab
+    ///
+    /// \return the count of pages freed
+    u64 shrink();
+    /// pages of empty slabs plus the slabs the objects in depot magazines could empty.
+    ///
+    /// The magazines loaded by the cpus aren't counted, a shrink only drains those of the current cpu.
+    u64 get_reclaimable_count() const
+    {
+        return (list_empty.size() + depot_full_count * magazine_size / node_pre_slab) * page_pre_slab;
+    }
+
+    /// set rounds per magazine, 0 disables the per cpu cache of this group
+    void set_magazine_size(u32 rounds);
+    u32 get_magazine_size() const { return magazine_size; }
+
+    u64 get_obj_count() const { return all_obj_count; }
+    u64 get_obj_used() const { return all_obj_used; }
+    u64 get_slab_count() const { return list_empty.size() + list_partial.size() + list_full.size(); }
+    u32 get_obj_per_slab() const { return node_pre_slab; }
+    u32 get_page_per_slab() const { return page_pre_slab; }
+    /// count of objects held by full magazines in the depot
+    u64 get_depot_obj_count() const { return depot_full_count * magazine_size; }
+    /// get the cache of cpu 'cpuid', nullptr if the group has no per cpu cache
+    const slab_cpu_cache *get_cpu_cache(u32 cpuid);
 };
 
 using slab_group_list_t = util::linked_list<slab_group>;
@@ -75,6 +181,7 @@ struct slab_cache_pool
 
     slab_group_list_t slab_groups;
     slab_list_node_allocator_t slab_list_node_allocator;
+    /// group_lock must be held, the read lock isn't recursive
     slab_group_list_t::iterator find_slab_group_node(const char *name);
 
   public:
@@ -82,16 +189,28 @@ struct slab_cache_pool
     slab_group *find_slab_group(u64 size);
 
     slab_group_list_t &get_slab_groups() { return slab_groups; }
+    lock::rw_lock_t &get_group_lock() { return group_lock; }
 
-    slab_group *create_new_slab_group(u64 size, const char *name, u64 align, u64 flags);
+    slab_group *create_new_slab_group(u64 size, const char *name, u64 align, u64 flags, slab_obj_func ctor = nullptr,
+                                      slab_obj_func dtor = nullptr);
     void remove_slab_group(slab_group *group);
 
+    /// shrink groups until nr_pages pages are freed
+    u64 shrink(u64 nr_pages);
+    u64 get_reclaimable_count();
+
     slab_cache_pool();
 };
 
 extern slab_cache_pool *global_kmalloc_slab_domain;
 extern slab_cache_pool *global_dma_slab_domain;
 extern slab_cache_pool *global_object_slab_domain;
+/// shrinker callbacks of all slab domains
+u64 slab_shrink_count(u64 user_data);
+u64 slab_shrink_scan(u64 nr_pages, u64 user_data);
+
+/// The group magazines are allocated from
+extern slab_group *slab_magazine_group;
 
 /// An object allocator
 struct SlabObjectAllocator : IAllocator
@@ -0,0 +1,17 @@
+#pragma once
+#include "common.hpp"
+
+namespace memory
+{
+/// Write a text report of every slab group: object size, slabs, active objects and per cpu cached objects.
+///
+/// \return length of the report, truncated to size
+u64 slab_info(char *buffer, u64 size);
+
+/// Write a text report of each zone: free blocks per order and fragmentation index,
+/// followed by the per cpu page cache counters.
+///
+/// \return length of the report, truncated to size
+u64 buddy_info(char *buffer, u64 size);
+
+} // namespace memory
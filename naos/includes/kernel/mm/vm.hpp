@@ -30,9 +30,21 @@ enum flags : u64
 };
 }
 
+/// anonymous vm with flags::huge_page are backed by 2MB frames when a whole aligned window fits in the vm
+inline constexpr u64 huge_page_size = 0x200000;
+/// max windows collapsed to 2MB frames by one collapse_huge_pages pass
+inline constexpr u64 huge_page_collapse_batch = 4;
+/// a fault of a file vm reads and maps the unmapped pages of the aligned window of this many pages around it
+inline constexpr u64 file_fault_around_pages = 16;
+
 void init();
 void listen_page_fault();
 
+/// take a reference to a 4kb frame for another mapping
+void share_frame(void *phy_addr);
+/// drop a mapping of a 4kb frame, the last address space mapping it frees it
+void release_frame(void *phy_addr);
+
 struct vm_t;
 
 typedef bool (*vm_page_fault_func)(u64 page_addr, const vm_t *vm);
@@ -94,18 +106,58 @@ class mmu_paging
 {
   private:
     void *base_paging_addr;
+    /// tags the TLB entries of this address space, never reused
+    u64 context_id;
+    /// bumped by each shootdown, a cpu loading the address space flushes it if it has changed since the last load
+    std::atomic_uint64_t tlb_generation;
+    /// serializes page faults of anonymous vm, unmap and huge page collapse
+    lock::spinlock_t lock;
+
+    void split_huge_area(u64 start);
 
   public:
     mmu_paging();
     ~mmu_paging();
     void load_paging();
+    /// flush [start, end) on every cpu using this address space and wait for them
+    void flush_tlb_range(u64 start, u64 end);
+    /// flush this address space on every cpu using it and wait for them
+    void flush_tlb();
 
     void map_area(const vm_t *vm);
     void map_area_phy(const vm_t *vm, void *phy_address_start);
 
     void unmap_area(const vm_t *vm);
 
+    /// map a zeroed page at page_addr unless it's mapped, takes lock.
+    ///
+    /// The whole 2MB window is mapped by one frame if vm has flags::huge_page, the window is inside [vm->start,
+    /// limit) and no 4kb page of it is mapped. Falls back to a 4kb frame otherwise. The frame is zeroed before
+    /// lock is taken.
+    bool map_anonymous_page(const vm_t *vm, u64 page_addr, u64 limit);
+    /// map count new 4kb pages from start, lock must be held.
+    ///
+    /// Page i is mapped read only if bit i of read_only is set. A page whose address has been mapped by another
+    /// thread meanwhile is released.
+    void map_new_pages(const vm_t *vm, u64 start, void *const *pages, u64 count, u64 read_only);
+    /// copy the 512 pages of a fully populated window into one 2MB frame, the vma lock must be held.
+    ///
+    /// The pages are write protected and copied without lock, a page written or shared meanwhile cancels it.
+    ///
+    /// \return false if the window isn't fully populated by 4kb pages, has changed or no 2MB block is free
+    bool collapse_huge_area(const vm_t *vm, u64 start);
+
+    /// share the frames mapped at vm by parent with this table, lock of both must be held.
+    ///
+    /// Private writeable frames are mapped read only in both tables and copied on the first write.
+    void copy_area(mmu_paging &parent, const vm_t *vm);
+    /// give the faulting address space its own writeable copy of a shared frame
+    ///
+    /// \return false if no page is free
+    bool copy_on_write(const vm_t *vm, u64 page_addr);
+
     void *get_page_addr();
+    lock::spinlock_t &get_lock() { return lock; }
 
     void *page_map_vir2phy(void *virtual_addr);
 
@@ -121,9 +173,19 @@ struct info_t
     memory::vm::vm_allocator vma;
     memory::vm::mmu_paging mmu_paging;
     const vm_t *head_vm;
+    /// faults which have read the file backing a vm
+    std::atomic_uint64_t major_faults;
+    /// faults resolved without I/O
+    std::atomic_uint64_t minor_faults;
 
   private:
     u64 current_head_ptr;
+    /// link of the huge page collapse list
+    info_t *scan_prev, *scan_next;
+    /// collapse passes working on this info without the scan lock, it stays linked until they leave
+    u32 scan_refs;
+
+    friend u64 collapse_huge_pages(u64 max_windows);
 
   public:
     info_t();
@@ -134,9 +196,18 @@ struct info_t
     bool set_brk(u64 ptr);
     u64 get_brk();
 
+    /// duplicate the vma and the mappings of parent into this empty info, frames are shared copy-on-write
+    ///
+    /// \return false if a vm can't be added
+    bool fork_from(info_t *parent);
+
+    /// map a file or anonymous memory, the whole vm is mapped at once if page_ext_attr has flags::populate
     const vm_t *map_file(u64 start, fs::vfs::file *file, u64 file_map_offset, u64 map_length, flag_t page_ext_attr);
-    bool umap_file(u64 addr);
+    /// map every page of vm which isn't mapped yet, stops early if no page is free
+    void populate(const vm_t *vm);
+    /// write the pages written through the shared file mapping at addr back to the file
     void sync_map_file(u64 addr);
+    bool umap_file(u64 addr);
 };
 
 /// map struct
@@ -153,6 +224,11 @@ struct map_t
         , vm_info(vmi){};
 };
 
+/// collapse fully populated 2MB windows of all huge page vm into 2MB frames
+///
+/// \return count of windows collapsed
+u64 collapse_huge_pages(u64 max_windows);
+
 bool fill_file_vm(u64 page_addr, const vm_t *item);
 bool fill_expand_vm(u64 page_addr, const vm_t *item);
 
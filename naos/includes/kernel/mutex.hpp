@@ -1,35 +1,45 @@
 #pragma once
 #include "common.hpp"
-#include "wait.hpp"
+#include "lock.hpp"
 #include <atomic>
+namespace task
+{
+struct thread_t;
+} // namespace task
+
 namespace lock
 {
-bool mutex_func(u64 data);
+struct mutex_waiter_t;
 
+/// Sleeping lock which records its owner thread.
+///
+/// A locker spins while the owner runs on another CPU, the owner is likely to unlock soon. It sleeps when the
+/// owner is off CPU. The unlock hands the mutex to the first waiter, so a waiter can't starve behind spinners.
 struct mutex_t
 {
   private:
-    std::atomic_flag lock_m = ATOMIC_FLAG_INIT;
-    task::wait_queue wait_queue;
+    /// owner thread | mutex_waiters, 0 if unlocked
+    std::atomic_uint64_t owner;
+    spinlock_t wait_lock;
+    mutex_waiter_t *wait_head;
+    mutex_waiter_t *wait_tail;
+
+    void lock_slow();
+    void unlock_slow();
 
   public:
-    friend bool mutex_func(u64 data);
     mutex_t()
-        : wait_queue(memory::KernelCommonAllocatorV){};
+        : owner(0)
+        , wait_head(nullptr)
+        , wait_tail(nullptr){};
+    mutex_t(const mutex_t &) = delete;
+    mutex_t &operator=(const mutex_t &) = delete;
 
-    void lock()
-    {
-        while (!lock_m.test_and_set())
-        {
-            task::do_wait(&wait_queue, mutex_func, (u64)this, task::wait_context_type::uninterruptible);
-        };
-    }
+    void lock();
+    bool try_lock();
+    void unlock();
 
-    void unlock()
-    {
-        lock_m.clear();
-        task::do_wake_up(&wait_queue, 1);
-    }
+    task::thread_t *get_owner() const;
 };
 
 } // namespace lock
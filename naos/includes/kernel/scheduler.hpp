@@ -103,13 +103,18 @@ void add(thread_t *thread, scheduler_class scher);
 void remove(thread_t *thread);
 void update_state(thread_t *thread, thread_state state);
 void update_prop(thread_t *thread, u8 static_priority, u8 dyn_priority);
-bool reschedule_task_push(thread_t *task, u32 cpuid);
-bool reschedule_task_pull(thread_t *task);
+/// move a ready task of the current cpu to the migrate queue of cpuid
+///
+/// \return false if the queue of cpuid is full, the task stays on the current cpu
+bool migrate_task(thread_t *task, u32 cpuid);
 
 u64 sctl(int operator_type, thread_t *target, u64 attr, u64 *value, u64 size);
 
 ExportC void schedule();
 
-bool reload_load_fac();
+/// decay the load average of the current cpu
+///
+/// \return false if the last update is too recent
+bool update_load_avg();
 
 } // namespace task::scheduler
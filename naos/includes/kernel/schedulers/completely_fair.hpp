@@ -42,5 +42,7 @@ class completely_fair_scheduler : public scheduler
 
   private:
     task::thread_t *pick_available_task();
+    /// preempt the running thread if the woken thread is far enough behind it
+    void check_preempt_wakeup(thread_t *thread);
 };
 } // namespace task::scheduler
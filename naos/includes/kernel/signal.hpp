@@ -206,6 +206,16 @@ struct signal_pack_t
 
     void set(signal_num_t num, i64 error, i64 code, i64 status);
 
+    /// drop pending signals and masks, keep the event list storage
+    void reset()
+    {
+        masks = signal_mask_t();
+        sig_pending = false;
+        in_signal = false;
+        signal_stack = nullptr;
+        events.clean();
+    }
+
     void dispatch(signal_actions_t *actions);
 
     void user_return(u64 code);
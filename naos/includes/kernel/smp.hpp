@@ -6,9 +6,21 @@ namespace SMP
 
 void init();
 
-/// tlb shutdown
+/// a shootdown of more pages flushes the whole address space instead of each page
+inline constexpr u64 tlb_flush_page_threshold = 32;
+
+/// flush the TLB entries of every address space on every cpu and wait for them
 void flush_all_tlb();
 
+/// flush [start, end) of an address space on each cpu which has it loaded and wait for them.
+///
+/// Context 0 is the kernel, its ranges are flushed on every cpu. The other cpus drop the context by its tlb
+/// generation, the caller must bump it first.
+void flush_tlb_range(u64 context_id, u64 start, u64 end);
+
+/// flush the ranges posted to this cpu, every loop spinning with interrupts disabled calls it
+void answer_tlb_shootdown();
+
 void reschedule_cpu(u32 cpuid);
 
 /// call per cpu function
@@ -26,3 +26,4 @@ ExportC void *system_call_table[];
 #define EINNER -10
 #define EFAILED -11
 #define ECONTI -12ul
+#define EAGAIN -13
@@ -34,6 +34,8 @@ extern const process_id max_process_id;
 /// 65536
 extern const group_id max_group_id;
 struct thread_t;
+struct futex_waiter_t;
+struct futex_bucket_t;
 
 namespace process_attributes
 {
@@ -102,6 +104,7 @@ struct preempt_t
     bool preemptible() { return preempt_counter == 0; }
     void enable_preempt() { preempt_counter--; }
     void disable_preempt() { preempt_counter++; }
+    void reset() { preempt_counter = 0; }
     preempt_t()
         : preempt_counter(0)
     {
@@ -161,6 +164,9 @@ struct thread_t
     std::atomic_int wait_counter;
     signal_pack_t signal_pack;
     u64 error_code;
+    /// set while the thread is queued by futex_wait, changed under the lock of futex_bucket
+    futex_waiter_t *futex_waiter;
+    futex_bucket_t *volatile futex_bucket;
     thread_t();
 };
 
@@ -205,10 +211,18 @@ thread_t *create_thread(process_t *process, thread_start_func start_func, u64 ar
 process_t *create_process(fs::vfs::file *file, thread_start_func start_func, u64 arg0, const char *args,
                           const char *env, flag_t flags);
 
+/// create a process running a copy of the current process, the address space is shared copy-on-write.
+///
+/// The main thread of the new process returns from the current syscall with 0.
+process_t *fork_process(flag_t flags);
+
 process_t *create_kernel_process(thread_start_func start_func, u64 arg0, flag_t flags);
 
 void do_sleep(u64 milliseconds);
 
+/// sleep on a hrtimer, the precision is the microsecond of the clock source
+void do_nanosleep(u64 nanoseconds);
+
 NoReturn void do_exit(i64 value);
 
 void destroy_thread(thread_t *thread);
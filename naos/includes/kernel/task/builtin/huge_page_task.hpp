@@ -0,0 +1,7 @@
+#pragma once
+#include "common.hpp"
+
+namespace task::builtin::huge_page
+{
+void main(u64 arg0, u64 arg1, u64 arg2, u64 arg3);
+} // namespace task::builtin::huge_page
@@ -13,10 +13,49 @@ void init();
 /// \note the time of each CPU is not synchronized
 time::microsecond_t get_high_resolution_time();
 
-void add_watcher(u64 expires_delta_time, watcher_func func, u64 user_data);
+struct watcher_t;
 
-bool add_time_point_watcher(u64 expires_time_point, watcher_func func, u64 user_data);
+/// Refer to one arming of a watcher. It is safe to remove a watcher by a stale handle.
+struct watcher_handle_t
+{
+    watcher_t *watcher;
+    u64 id;
+
+    watcher_handle_t()
+        : watcher(nullptr)
+        , id(0)
+    {
+    }
+
+    watcher_handle_t(watcher_t *watcher, u64 id)
+        : watcher(watcher)
+        , id(id)
+    {
+    }
+
+    bool empty() const { return watcher == nullptr; }
+};
+
+///
+/// \brief call func on this CPU after expires_delta_time microseconds
+///
+/// \param slack the watcher may run up to slack microseconds later, so it shares a wakeup with others
+watcher_handle_t add_watcher(u64 expires_delta_time, watcher_func func, u64 user_data, u64 slack = 0);
 
-void remove_watcher(watcher_func func);
+/// \return an empty handle if the time point has passed
+watcher_handle_t add_time_point_watcher(u64 expires_time_point, watcher_func func, u64 user_data, u64 slack = 0);
+
+///
+/// \brief call func on this CPU at a time point, not rounded to the timer wheel unit
+///
+/// The clock event is programmed for it directly on a tickless CPU. Without a one-shot clock event it runs on the
+/// next tick.
+watcher_handle_t add_hrtimer(u64 expires_time_point, watcher_func func, u64 user_data);
+
+///
+/// \brief cancel a watcher or a hrtimer, can be called on any CPU
+///
+/// \return false if the watcher has run or is running
+bool remove_watcher(watcher_handle_t handle);
 
 } // namespace timer
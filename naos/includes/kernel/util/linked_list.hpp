@@ -39,6 +39,9 @@ template <typename E> class linked_list
             : node(node){};
 
       public:
+        iterator()
+            : node(nullptr){};
+
         E &operator*() { return node->element; }
         E *operator&() { return &node->element; }
         E *operator->() { return &node->element; }
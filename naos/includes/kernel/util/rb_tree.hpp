@@ -0,0 +1,88 @@
+#pragma once
+#include "common.hpp"
+
+namespace util
+{
+/// node embedded in the element of an intrusive red-black tree
+struct rb_node
+{
+    rb_node *parent;
+    rb_node *left;
+    rb_node *right;
+    bool red;
+
+    rb_node()
+        : parent(nullptr)
+        , left(nullptr)
+        , right(nullptr)
+        , red(false)
+    {
+    }
+};
+
+/// intrusive red-black tree.
+///
+/// The tree allocates nothing, the node lives in the element and the element is got back by container_of.
+/// The leftmost node is cached, so reading the minimum is O(1). Equal keys are inserted to the right.
+class rb_tree
+{
+  private:
+    rb_node *root;
+    rb_node *leftmost;
+    u64 count;
+
+    void rotate_left(rb_node *node);
+    void rotate_right(rb_node *node);
+    void insert_fixup(rb_node *node);
+    void erase_fixup(rb_node *node, rb_node *parent);
+    void link(rb_node *node, rb_node *parent, rb_node **place, bool is_leftmost);
+
+  public:
+    rb_tree()
+        : root(nullptr)
+        , leftmost(nullptr)
+        , count(0)
+    {
+    }
+    rb_tree(const rb_tree &) = delete;
+    rb_tree &operator=(const rb_tree &) = delete;
+
+    /// insert node, less(a, b) returns true if a must be ordered before b
+    template <typename Less> void insert(rb_node *node, Less less)
+    {
+        rb_node **place = &root;
+        rb_node *parent = nullptr;
+        bool is_leftmost = true;
+        while (*place != nullptr)
+        {
+            parent = *place;
+            if (less(node, parent))
+            {
+                place = &parent->left;
+            }
+            else
+            {
+                place = &parent->right;
+                is_leftmost = false;
+            }
+        }
+        link(node, parent, place, is_leftmost);
+    }
+
+    void remove(rb_node *node);
+
+    rb_node *first() const { return leftmost; }
+    /// in-order successor, nullptr at the last node
+    static rb_node *next(rb_node *node);
+
+    bool empty() const { return root == nullptr; }
+    u64 size() const { return count; }
+};
+
+/// get the element containing the rb_node at Member
+template <typename T, rb_node T::*Member> T *container_of(rb_node *node)
+{
+    return (T *)((char *)node - (u64)(&(((T *)nullptr)->*Member)));
+}
+
+} // namespace util
@@ -0,0 +1,60 @@
+#pragma once
+#include "common.hpp"
+#include "formatter.hpp"
+#include "str.hpp"
+
+namespace util
+{
+/// Append text to a fixed buffer, used by the /proc text files
+struct text_writer
+{
+    char *buffer;
+    u64 size;
+    u64 pos;
+
+    text_writer(char *buffer, u64 size)
+        : buffer(buffer)
+        , size(size)
+        , pos(0)
+    {
+    }
+
+    /// append str, left aligned and padded with spaces to width
+    void put(const char *str, u64 width = 0)
+    {
+        u64 n = 0;
+        for (; str[n] != 0 && pos < size; n++)
+            buffer[pos++] = str[n];
+        for (; n < width && pos < size; n++)
+            buffer[pos++] = ' ';
+    }
+
+    void put(u64 val, u64 width = 0)
+    {
+        char str[32];
+        util::formatter::uint2str(val, str, sizeof(str));
+        put(str, width);
+    }
+
+    /// append a per mille value as a fraction, -1 is printed as -1.000
+    void put_fraction(i64 per_mille, u64 width = 0)
+    {
+        char str[32];
+        int n = 0;
+        if (per_mille < 0)
+        {
+            str[n++] = '-';
+            per_mille = -per_mille;
+        }
+        util::formatter::uint2str(per_mille / 1000, str + n, sizeof(str) - n);
+        n = util::strlen(str);
+        str[n++] = '.';
+        str[n++] = '0' + per_mille / 100 % 10;
+        str[n++] = '0' + per_mille / 10 % 10;
+        str[n++] = '0' + per_mille % 10;
+        str[n] = 0;
+        put(str, width);
+    }
+};
+
+} // namespace util
@@ -64,6 +64,8 @@ bool has_feature(feature f)
             ret_cpu_feature(0x80000001, edx, 11);
         case feature::pcid:
             ret_cpu_feature(0x1, ecx, 17);
+        case feature::invpcid:
+            ret_cpu_feature(0x7, ebx, 10);
         case feature::fpu:
             ret_cpu_feature(0x1, edx, 0);
         case feature::huge_page_1gb:
@@ -80,6 +82,8 @@ bool has_feature(feature f)
             ret_cpu_feature(0x1, edx, 4);
         case feature::contant_tsc:
             ret_cpu_feature(0x80000007, edx, 8);
+        case feature::tsc_deadline:
+            ret_cpu_feature(0x1, ecx, 24);
         case feature::sse:
             ret_cpu_feature(0x1, edx, 25);
         case feature::sse2:
@@ -117,4 +121,91 @@ u64 get_feature(feature f)
 
 const char *get_cpu_manufacturer() { return cpu_name; }
 
+/// bits needed for count ids
+u32 id_shift(u32 count)
+{
+    u32 shift = 0;
+    while ((1u << shift) < count)
+        shift++;
+    return shift;
+}
+
+/// bits of the apic id shared by all cpus sharing the last level cache, -1 if no cache leaf
+int llc_shift(u32 leaf)
+{
+    u32 eax, ebx, ecx, edx;
+    int shift = -1;
+    u32 max_level = 0;
+    for (u32 sub = 0; sub < 16; sub++)
+    {
+        cpu_id_ex(leaf, sub, &eax, &ebx, &ecx, &edx);
+        u32 type = bits(eax, 0, 4);
+        if (type == 0)
+            break;
+        u32 level = bits(eax, 5, 7);
+        if (level >= max_level)
+        {
+            max_level = level;
+            shift = id_shift(bits(eax, 14, 25) + 1);
+        }
+    }
+    return shift;
+}
+
+topology_t get_topology()
+{
+    u32 eax, ebx, ecx, edx;
+    topology_t topo;
+    u32 smt_shift = 0, package_shift = 0;
+
+    bool has_leaf_b = false;
+    if (max_basic_number >= 0xB)
+    {
+        cpu_id_ex(0xB, 0, &eax, &ebx, &ecx, &edx);
+        has_leaf_b = bits(ebx, 0, 15) != 0;
+    }
+    if (has_leaf_b)
+    {
+        topo.apic_id = edx;
+        for (u32 sub = 0; sub < 8; sub++)
+        {
+            cpu_id_ex(0xB, sub, &eax, &ebx, &ecx, &edx);
+            u32 type = bits(ecx, 8, 15);
+            if (type == 0)
+                break;
+            if (type == 1) // SMT level
+                smt_shift = bits(eax, 0, 4);
+            package_shift = bits(eax, 0, 4);
+        }
+    }
+    else
+    {
+        cpu_id(1, &eax, &ebx, &ecx, &edx);
+        topo.apic_id = bits(ebx, 24, 31);
+        u32 logical = (edx & (1u << 28)) ? bits(ebx, 16, 23) : 1;
+        u32 cores = 1;
+        if (max_basic_number >= 4)
+        {
+            cpu_id_ex(4, 0, &eax, &ebx, &ecx, &edx);
+            cores = bits(eax, 26, 31) + 1;
+        }
+        package_shift = id_shift(logical);
+        smt_shift = logical > cores ? id_shift(logical / cores) : 0;
+    }
+
+    int cache_shift = -1;
+    if (max_basic_number >= 4)
+        cache_shift = llc_shift(4);
+    if (cache_shift < 0 && max_extend_number >= 0x8000001D)
+        cache_shift = llc_shift(0x8000001D);
+    if (cache_shift < 0)
+        cache_shift = package_shift;
+
+    topo.smt_id = topo.apic_id & ((1u << smt_shift) - 1);
+    topo.core_id = (topo.apic_id & ((1u << package_shift) - 1)) >> smt_shift;
+    topo.package_id = topo.apic_id >> package_shift;
+    topo.llc_id = topo.apic_id >> cache_shift;
+    return topo;
+}
+
 } // namespace arch::cpu_info
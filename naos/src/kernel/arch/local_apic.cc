@@ -5,6 +5,7 @@
 #include "kernel/arch/klib.hpp"
 #include "kernel/arch/paging.hpp"
 #include "kernel/arch/pit.hpp"
+#include "kernel/arch/tsc.hpp"
 #include "kernel/irq.hpp"
 #include "kernel/mm/memory.hpp"
 #include "kernel/mm/new.hpp"
@@ -66,6 +67,8 @@ const u16 timer_divide_register = 62; // 0x83E
 
 const u16 self_pip = 63;
 
+const u32 msr_tsc_deadline = 0x6E0;
+
 const u16 lvt_index_array[] = {
     lvt_cmci, lvt_timer, lvt_thermal_sensor_register, lvt_performance_register, lvt_lint_0, lvt_lint_1, lvt_error, 0};
 
@@ -339,6 +342,9 @@ void clock_event::init(u64 HZ)
     id = cpu::current().get_apic_id();
 
     is_suspend = false;
+    is_oneshot = false;
+    use_tsc_deadline =
+        cpu_info::has_feature(cpu_info::feature::tsc_deadline) && cpu_info::has_feature(cpu_info::feature::contant_tsc);
     suspend();
     local_irq_setup(lvt_index::timer, irq::hard_vector::local_apic_timer, 0);
     write_register(lvt_index_array[lvt_index::timer], read_register(lvt_index_array[lvt_index::timer]) | (0b01 << 17));
@@ -367,6 +373,15 @@ void clock_event::resume()
         uctx::UninterruptibleContext icu;
 
         local_enable(lvt_index::timer);
+        if (is_oneshot)
+        {
+            if (use_tsc_deadline)
+                _wrmsr(msr_tsc_deadline, 0);
+            // back to periodic mode
+            write_register(lvt_index_array[lvt_index::timer],
+                           (read_register(lvt_index_array[lvt_index::timer]) & ~(0b11 << 17)) | (0b01 << 17));
+            is_oneshot = false;
+        }
 
         write_register(timer_initial_count_register, init_counter);
         write_register(timer_divide_register, divide);
@@ -375,6 +390,35 @@ void clock_event::resume()
     }
 }
 
+void clock_event::set_next_event(time::microsecond_t delta)
+{
+    uctx::UninterruptibleContext icu;
+    u64 tsc_per_us = use_tsc_deadline ? TSC::make_clock()->get_tick_per_microsecond() : 0;
+    if (!is_oneshot)
+    {
+        // timer mode bits 17-18: 00 one-shot, 10 TSC-deadline
+        u32 mode = tsc_per_us != 0 ? (0b10 << 17) : 0;
+        write_register(lvt_index_array[lvt_index::timer],
+                       (read_register(lvt_index_array[lvt_index::timer]) & ~(0b11 << 17)) | mode);
+        is_oneshot = true;
+        // the serializing MSR write must not pass the LVT switch
+        _mfence();
+    }
+    if (tsc_per_us != 0)
+    {
+        // an absolute deadline doesn't lose the time spent counting down a bus clock divided counter
+        _wrmsr(msr_tsc_deadline, _rdtsc() + delta * tsc_per_us);
+        return;
+    }
+    u64 count = delta * (bus_frequency / divide_value(divide)) / 1000000;
+    if (count == 0)
+        count = 1;
+    else if (count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF;
+    // writing the initial count starts the countdown
+    write_register(timer_initial_count_register, count);
+}
+
 void clock_event::wait_next_tick()
 {
     u64 old = tick_count;
@@ -77,12 +77,36 @@ Unpaged_Text_Section void temp_init(bool is_bsp)
     __asm__ __volatile__("movq %0, %%cr3	\n\t" : : "r"(temp_pml4_addr) : "memory");
 }
 
+/// set CR0.WP, supervisor writes to read only pages must fault so that copy-on-write frames are copied first
+void enable_write_protect()
+{
+    u64 cr0;
+    __asm__ __volatile__("movq %%cr0, %0	\n\t" : "=r"(cr0) : :);
+    cr0 |= 1ul << 16;
+    __asm__ __volatile__("movq %0, %%cr0	\n\t" : : "r"(cr0) : "memory");
+}
+
+bool pcid_enabled = false;
+bool invpcid_supported = false;
+
+/// set CR4.PCIDE, CR3 must hold PCID 0
+void enable_pcid()
+{
+    u64 cr4;
+    __asm__ __volatile__("movq %%cr4, %0	\n\t" : "=r"(cr4) : :);
+    cr4 |= 1ul << 17;
+    __asm__ __volatile__("movq %0, %%cr4	\n\t" : : "r"(cr4) : "memory");
+}
+
 void init()
 {
     auto base_kernel_page_addr = (base_paging_t *)memory::kernel_vm_info->mmu_paging.get_page_addr();
+    enable_write_protect();
     if (!cpu::current().is_bsp())
     {
         load(base_kernel_page_addr);
+        if (pcid_enabled)
+            enable_pcid();
         return;
     }
     u64 max_maped_memory = memory::get_max_maped_memory();
@@ -108,6 +132,14 @@ void init()
     trace::debug("Reload page table");
     load(base_kernel_page_addr);
     memory::kernel_vm_info->mmu_paging.load_paging();
+
+    if (cpu_info::has_feature(cpu_info::feature::pcid))
+    {
+        invpcid_supported = cpu_info::has_feature(cpu_info::feature::invpcid);
+        trace::debug("Tag TLB entries by PCID", invpcid_supported ? ", invalidate by INVPCID" : "");
+        enable_pcid();
+        pcid_enabled = true;
+    }
 }
 
 void check_pml4e(pml4t *base_addr, int pml4_index)
@@ -178,6 +210,44 @@ NoReturn void error_unmap()
                  "or not aligned.");
 }
 
+/// map frame_count 4kb frames at v in one page table walk, frame i is at phy_of(i)
+template <typename F> void map_4kb_frames(pml4t &top_page, u64 v, u64 frame_count, u32 page_ext_flags, F phy_of)
+{
+    u64 pml4e_index = get_bits(v, 39, 8);
+    u64 pdpe_index = get_bits(v, 30, 8);
+    u64 pde_index = get_bits(v, 21, 8);
+    u64 pte_index = get_bits(v, 12, 8);
+
+    check_pde(&top_page, pml4e_index, pdpe_index, pde_index, true);
+    for (u64 i = 0; i < frame_count; i++, pte_index++)
+    {
+        if (pte_index >= 512)
+        {
+            if (++pde_index >= 512)
+            {
+                if (++pdpe_index >= 512)
+                {
+                    if (++pml4e_index >= 512)
+                        error_map();
+                    check_pml4e(&top_page, pml4e_index);
+                    pdpe_index = 0;
+                }
+                check_pdpe(&top_page, pml4e_index, pdpe_index, true);
+                pde_index = 0;
+            }
+            check_pde(&top_page, pml4e_index, pdpe_index, pde_index, true);
+            pte_index = 0;
+        }
+        auto &pml4e = top_page[pml4e_index];
+        auto &pdpe = pml4e.next()[pdpe_index];
+        auto &pde = pdpe.next()[pde_index];
+        if (pde.next()[pte_index].is_present())
+            error_map();
+        pde.next()[pte_index] = pt_entry(phy_of(i), flags::present | page_ext_flags);
+        pde.set_common_data(pde.get_common_data() + 1);
+    }
+}
+
 bool map(base_paging_t *base_paging_addr, void *virt_start_addr, void *phy_start_addr, u64 frame_size, u64 frame_count,
          u32 page_ext_flags)
 {
@@ -191,7 +261,6 @@ bool map(base_paging_t *base_paging_addr, void *virt_start_addr, void *phy_start
     u64 pml4e_index = get_bits(v, 39, 8);
     u64 pdpe_index = get_bits(v, 30, 8);
     u64 pde_index = get_bits(v, 21, 8);
-    u64 pte_index = get_bits(v, 12, 8);
 
     u8 *phy_addr = (u8 *)phy_start_addr;
 
@@ -242,34 +311,8 @@ bool map(base_paging_t *base_paging_addr, void *virt_start_addr, void *phy_start
         }
         break;
         case frame_size::size_4kb: {
-            check_pde(&top_page, pml4e_index, pdpe_index, pde_index, true);
-            for (u32 i = 0; i < frame_count; i++, pte_index++, phy_addr += (u32)frame_size)
-            {
-                if (pte_index >= 512)
-                {
-                    if (++pde_index >= 512)
-                    {
-                        if (++pdpe_index >= 512)
-                        {
-                            if (++pml4e_index >= 512)
-                                error_map();
-                            check_pml4e(&top_page, pml4e_index);
-                            pdpe_index = 0;
-                        }
-                        check_pdpe(&top_page, pml4e_index, pdpe_index, true);
-                        pde_index = 0;
-                    }
-                    check_pde(&top_page, pml4e_index, pdpe_index, pde_index, true);
-                    pte_index = 0;
-                }
-                auto &pml4e = top_page[pml4e_index];
-                auto &pdpe = pml4e.next()[pdpe_index];
-                auto &pde = pdpe.next()[pde_index];
-                if (pde.next()[pte_index].is_present())
-                    error_map();
-                pde.next()[pte_index] = pt_entry(phy_addr, flags::present | page_ext_flags);
-                pde.set_common_data(pde.get_common_data() + 1);
-            }
+            map_4kb_frames(top_page, v, frame_count, page_ext_flags,
+                           [phy_addr](u64 i) { return phy_addr + i * frame_size::size_4kb; });
         }
         break;
         default:
@@ -278,6 +321,18 @@ bool map(base_paging_t *base_paging_addr, void *virt_start_addr, void *phy_start
     return true;
 }
 
+bool map_frames(base_paging_t *base_paging_addr, void *virt_start_addr, void *const *phy_frames, u64 frame_count,
+                u32 page_ext_flags)
+{
+    uctx::UninterruptibleContext icu;
+    // virtual address doesn't align of 4kb
+    if (((u64)virt_start_addr & (frame_size::size_4kb - 1)) != 0)
+        error_map();
+    map_4kb_frames(*(pml4t *)base_paging_addr, (u64)virt_start_addr, frame_count, page_ext_flags,
+                   [phy_frames](u64 i) { return phy_frames[i]; });
+    return true;
+}
+
 void clean_null_page_pml4e(pml4t &base_page, u64 pml4e_index)
 {
     auto &e = base_page[pml4e_index];
@@ -449,84 +504,187 @@ base_paging_t *current()
 {
     u64 v;
     __asm__ __volatile__("movq %%cr3, %0	\n\t" : "=r"(v) : :);
-    return (base_paging_t *)memory::kernel_phyaddr_to_virtaddr(v);
+    return (base_paging_t *)memory::kernel_phyaddr_to_virtaddr(v & ~(cr3_pcid_mask));
 }
 
-template <typename PageTable> bool copy(PageTable *dst, PageTable *src, int idx)
+/// PCID of each slot is its index + 1, PCID 0 tags the kernel page table loaded at boot
+struct pcid_slot_t
+{
+    u64 context_id;
+    u64 generation;
+    /// tlb generation of the context when the slot was last loaded
+    u64 tlb_generation;
+};
+
+/// Address spaces that own a PCID on a cpu, the TLB may still hold their entries.
+///
+/// A slot is valid while its generation is the generation of the cpu, bumping it invalidates every slot at once.
+struct pcid_state_t
 {
-    auto &source = src->entries[idx];
-    if (likely(source.is_present()))
+    pcid_slot_t slots[pcid_slot_count];
+    u32 next_slot;
+    u64 generation;
+
+    pcid_state_t()
+        : next_slot(0)
+        , generation(1)
     {
-        auto &to = dst->entries[idx];
-        if (to.is_present())
+        for (auto &slot : slots)
         {
-            if (likely(to.get_addr() != source.get_addr()))
-            {
-                delete_page_table<PageTable>((PageTable *)to.get_addr());
-            }
-            else
-            {
-                return false;
-            }
+            slot.context_id = 0;
+            slot.generation = 0;
+            slot.tlb_generation = 0;
         }
-        to = source;
-        to.set_addr(new_page_table<PageTable>());
-        return true;
     }
-    return false;
+};
+
+pcid_state_t pcid_states[cpu::max_cpu_support];
+
+/// context loaded by each cpu, read by the cpus shooting down its TLB
+std::atomic_uint64_t loaded_contexts[cpu::max_cpu_support];
+
+/// invpcid types
+enum class invpcid_type : u64
+{
+    address = 0,
+    single_context = 1,
+    all_context_global = 2,
+    all_context = 3,
+};
+
+void invpcid(invpcid_type type, u64 pcid, u64 addr)
+{
+    struct
+    {
+        u64 pcid;
+        u64 addr;
+    } desc = {pcid, addr};
+    __asm__ __volatile__("invpcid %0, %1	\n\t" : : "m"(desc), "r"((u64)type) : "memory");
 }
 
-/// TODO: fill page table
-void copy_page_table(base_paging_t *to, base_paging_t *source, u64 start, u64 end, bool override)
+void load_context(base_paging_t *base_paging_addr, u64 context_id, const std::atomic_uint64_t &tlb_generation)
 {
-    pml4t *dst = (pml4t *)to;
-    pml4t *src = (pml4t *)source;
+    u64 cr3 = (u64)memory::kernel_virtaddr_to_phyaddr(base_paging_addr);
+    // publish the context before reading its generation, a shootdown either sees this cpu or bumped it before
+    loaded_contexts[cpu::id()] = context_id;
+    u64 tlb_gen = tlb_generation;
+    if (!pcid_enabled)
+    {
+        __asm__ __volatile__("movq %0, %%cr3	\n\t" : : "r"(cr3) : "memory");
+        return;
+    }
+    auto &state = pcid_states[cpu::id()];
+    for (u32 i = 0; i < pcid_slot_count; i++)
+    {
+        auto &slot = state.slots[i];
+        if (slot.context_id == context_id && slot.generation == state.generation)
+        {
+            cr3 |= i + 1;
+            // the entries tagged by this PCID are still valid unless the context was flushed since
+            if (slot.tlb_generation == tlb_gen)
+                cr3 |= cr3_no_flush;
+            slot.tlb_generation = tlb_gen;
+            __asm__ __volatile__("movq %0, %%cr3	\n\t" : : "r"(cr3) : "memory");
+            return;
+        }
+    }
+    // take the next slot, the load flushes the entries of its previous owner
+    u32 i = state.next_slot;
+    state.next_slot = (i + 1) % pcid_slot_count;
+    state.slots[i].context_id = context_id;
+    state.slots[i].generation = state.generation;
+    state.slots[i].tlb_generation = tlb_gen;
+    cr3 |= i + 1;
+    __asm__ __volatile__("movq %0, %%cr3	\n\t" : : "r"(cr3) : "memory");
+}
 
-    u64 pml4e_index = get_bits(start, 39, 8);
-    u64 pdpe_index = get_bits(start, 30, 8);
-    u64 pde_index = get_bits(start, 21, 8);
-    u64 pte_index = get_bits(start, 12, 8);
-    u64 page_count = (end - start) / memory::page_size;
-    if (override)
+u64 get_loaded_context(u32 cpuid) { return loaded_contexts[cpuid]; }
+
+void invalidate_page(void *virt_addr)
+{
+    __asm__ __volatile__("invlpg (%0)	\n\t" : : "r"(virt_addr) : "memory");
+}
+
+void flush_all_context()
+{
+    uctx::UninterruptibleContext icu;
+    if (!pcid_enabled)
+    {
+        reload();
+        return;
+    }
+    if (invpcid_supported)
+    {
+        invpcid(invpcid_type::all_context, 0, 0);
+        return;
+    }
+    // drop the other PCIDs by generation, the current one by the reload
+    pcid_states[cpu::id()].generation++;
+    reload();
+}
+
+u64 copy_page_table(base_paging_t *to, base_paging_t *source, u64 start, u64 end, bool write_protect,
+                    void (*frame_func)(void *phy_addr))
+{
+    uctx::UninterruptibleContext icu;
+    auto &src = *(pml4t *)source;
+    auto &dst = *(pml4t *)to;
+    u64 count = 0;
+    u64 v = start;
+    while (v < end)
     {
-        for (u64 i = 0; i < page_count; i++)
+        u64 pml4e_index = get_bits(v, 39, 8);
+        u64 pdpe_index = get_bits(v, 30, 8);
+        u64 pde_index = get_bits(v, 21, 8);
+        // skip the whole range of a missing table
+        auto &pml4e = src[pml4e_index];
+        if (!pml4e.is_present())
         {
-            if (copy(dst, src, pml4e_index))
-            {
-                auto &pdpt_src = src->entries[pml4e_index].next();
-                auto &pdpt_dst = dst->entries[pml4e_index].next();
-                if (copy(&pdpt_dst, &pdpt_src, pdpe_index))
-                {
-                    auto &pdt_src = pdpt_src.entries[pdpe_index].next();
-                    auto &pdt_dst = pdpt_dst.entries[pdpe_index].next();
-                    if (copy(&pdt_dst, &pdt_src, pde_index))
-                    {
-                        auto &pet_src = pdt_src.entries[pml4e_index].next();
-                        auto &pet_dst = pdt_dst.entries[pml4e_index].next();
-                        copy(&pet_dst, &pet_src, pte_index);
-                    }
-                }
-            }
+            v = (v & ~(pdpt_entry::big_page_size * 512 - 1)) + pdpt_entry::big_page_size * 512;
+            continue;
         }
-        pte_index++;
-        if (pte_index >= 512)
+        auto &pdpe = pml4e.next()[pdpe_index];
+        if (!pdpe.is_present())
         {
-            pte_index = 0;
-            pde_index++;
-            if (pde_index >= 512)
+            v = (v & ~(pdpt_entry::big_page_size - 1)) + pdpt_entry::big_page_size;
+            continue;
+        }
+        kassert(!pdpe.is_big_page(), "Can't copy a 1GB frame at ", (void *)v);
+        auto &pde = pdpe.next()[pde_index];
+        u64 window_end = (v & ~(pd_entry::big_page_size - 1)) + pd_entry::big_page_size;
+        if (!pde.is_present())
+        {
+            v = window_end;
+            continue;
+        }
+        kassert(!pde.is_big_page(), "Split the 2MB frame at ", (void *)v, " before copying it");
+        if (window_end > end)
+            window_end = end;
+
+        pd_entry *to_pde = nullptr;
+        for (; v < window_end; v += frame_size::size_4kb)
+        {
+            auto &pte = pde.next()[get_bits(v, 12, 8)];
+            if (!pte.is_present())
+                continue;
+            if (to_pde == nullptr)
             {
-                pde_index = 0;
-                pdpe_index++;
-                if (pdpe_index >= 512)
-                {
-                    pdpe_index = 0;
-                    pml4e_index++;
-                    if (pml4e_index >= 512)
-                        error_map();
-                }
+                check_pde(&dst, pml4e_index, pdpe_index, pde_index, true);
+                to_pde = &dst[pml4e_index].next()[pdpe_index].next()[pde_index];
             }
+            auto &to_pte = to_pde->next()[get_bits(v, 12, 8)];
+            if (to_pte.is_present())
+                error_map();
+            if (write_protect)
+                pte.clear_writable();
+            to_pte = pte;
+            to_pde->set_common_data(to_pde->get_common_data() + 1);
+            if (frame_func != nullptr)
+                frame_func(pte.get_phy_addr());
+            count++;
         }
     }
+    return count;
 }
 
 void sync_kernel_page_table(base_paging_t *to, base_paging_t *kernel)
@@ -545,6 +703,89 @@ void sync_kernel_page_table(base_paging_t *to, base_paging_t *kernel)
     }
 }
 
+/// get the page directory entry of virt_addr, nullptr if the upper tables are not present or map 1gb pages
+pd_entry *get_pde(base_paging_t *base_paging_addr, u64 virt_addr)
+{
+    auto &pml4e = ((pml4t *)base_paging_addr)->entries[get_bits(virt_addr, 39, 8)];
+    if (!pml4e.is_present())
+        return nullptr;
+    auto &pdpe = pml4e.next()[get_bits(virt_addr, 30, 8)];
+    if (!pdpe.is_present() || pdpe.is_big_page())
+        return nullptr;
+    return &pdpe.next()[get_bits(virt_addr, 21, 8)];
+}
+
+u64 get_map_frame_size(base_paging_t *base_paging_addr, void *virt_addr)
+{
+    u64 v = (u64)virt_addr;
+    auto &pml4e = ((pml4t *)base_paging_addr)->entries[get_bits(v, 39, 8)];
+    if (!pml4e.is_present())
+        return 0;
+    auto &pdpe = pml4e.next()[get_bits(v, 30, 8)];
+    if (!pdpe.is_present())
+        return 0;
+    if (pdpe.is_big_page())
+        return frame_size::size_1gb;
+    auto &pde = pdpe.next()[get_bits(v, 21, 8)];
+    if (!pde.is_present())
+        return 0;
+    if (pde.is_big_page())
+        return frame_size::size_2mb;
+    if (!pde.next()[get_bits(v, 12, 8)].is_present())
+        return 0;
+    return frame_size::size_4kb;
+}
+
+pt_entry *get_pte(base_paging_t *base_paging_addr, void *virt_addr)
+{
+    auto *pde = get_pde(base_paging_addr, (u64)virt_addr);
+    if (pde == nullptr || !pde->is_present() || pde->is_big_page())
+        return nullptr;
+    auto &pte = pde->next()[get_bits((u64)virt_addr, 12, 8)];
+    if (!pte.is_present())
+        return nullptr;
+    return &pte;
+}
+
+u64 get_page_table_entries(base_paging_t *base_paging_addr, void *virt_addr)
+{
+    auto *pde = get_pde(base_paging_addr, (u64)virt_addr);
+    if (pde == nullptr || !pde->is_present() || pde->is_big_page())
+        return 0;
+    return pde->get_common_data();
+}
+
+bool split_big_page(base_paging_t *base_paging_addr, void *virt_addr)
+{
+    uctx::UninterruptibleContext icu;
+    auto *pde = get_pde(base_paging_addr, (u64)virt_addr);
+    if (pde == nullptr || !pde->is_present() || !pde->is_big_page())
+        return false;
+
+    u32 page_flags = flags::present;
+    if (pde->is_writable())
+        page_flags |= flags::writable;
+    if (pde->is_user_mode())
+        page_flags |= flags::user_mode;
+    if (pde->is_write_through())
+        page_flags |= flags::write_through;
+    if (pde->is_cache_disable())
+        page_flags |= flags::cache_disable;
+    if (pde->is_global())
+        page_flags |= flags::global;
+
+    auto *table = new_page_table<pt>();
+    char *phy_addr = (char *)pde->get_phy_addr();
+    for (int i = 0; i < 512; i++, phy_addr += frame_size::size_4kb)
+        (*table)[i] = pt_entry(phy_addr, page_flags);
+
+    pd_entry entry(nullptr, flags::present | flags::writable | flags::user_mode);
+    entry.set_addr(table);
+    entry.set_common_data(512);
+    *pde = entry;
+    return true;
+}
+
 bool get_map_address(base_paging_t *base_paging_addr, void *virt_addr, void **phy_addr)
 {
     u64 start = (u64)virt_addr;
@@ -86,6 +86,20 @@ u64 enter_userland(::task::thread_t *thd, void *entry, u64 arg)
     return 1;
 }
 
+u64 create_fork_thread(::task::thread_t *thd)
+{
+    auto *frame = (regs_t *)((u64)arch::cpu::current().get_kernel_rsp() - sizeof(regs_t));
+    auto *regs = (regs_t *)((u64)thd->kernel_stack_top - sizeof(regs_t));
+    util::memcopy(regs, frame, sizeof(regs_t));
+    regs->rax = 0;
+
+    auto &register_info = *thd->register_info;
+    register_info.rip = (void *)&_sys_ret;
+    register_info.rsp = regs;
+    register_info.task = thd;
+    return 0;
+}
+
 bool make_signal_context(void *stack, void *func, userland_code_context *context)
 {
     u64 rsp;
@@ -1,6 +1,7 @@
 #include "kernel/cpu.hpp"
 #include "kernel/arch/cpu.hpp"
 #include "kernel/mm/new.hpp"
+#include "kernel/mm/slab.hpp"
 #include "kernel/task.hpp"
 #include "kernel/trace.hpp"
 namespace cpu
@@ -25,6 +26,9 @@ void init()
     cpu->smp_id = arch::cpu::id();
     cpu->soft_irq_wait_queue =
         memory::New<task::wait_queue>(memory::KernelCommonAllocatorV, memory::KernelCommonAllocatorV);
+    cpu->slab_cpu_cache =
+        memory::NewArray<memory::slab_cpu_cache>(memory::KernelCommonAllocatorV, memory::slab_cpu_cache_max_groups);
+    cpu->page_cpu_cache = memory::New<memory::page_cpu_cache>(memory::KernelCommonAllocatorV);
 
     auto &c = arch::cpu::current();
     trace::debug("[cpu", c.get_id(), "] exception rsp:", (void *)c.get_exception_rsp(),
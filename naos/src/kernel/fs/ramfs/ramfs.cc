@@ -24,6 +24,30 @@ bool inode::create_symbolink(vfs::dentry *entry, const char *target)
 
 const char *inode::symbolink() { return (const char *)start_ptr; }
 
+bool inode::read_page(u64 index, byte *buffer)
+{
+    u64 offset = index * memory::page_size;
+    u64 size = 0;
+    if (start_ptr != nullptr && offset < file_size)
+    {
+        size = file_size - offset > memory::page_size ? memory::page_size : file_size - offset;
+        util::memcopy(buffer, start_ptr + offset, size);
+    }
+    util::memzero(buffer + size, memory::page_size - size);
+    return true;
+}
+
+bool inode::write_page(u64 index, const byte *buffer, u64 size)
+{
+    u64 offset = index * memory::page_size;
+    if (start_ptr == nullptr || offset >= file_size)
+        return false;
+    if (size > file_size - offset)
+        size = file_size - offset;
+    util::memcopy(start_ptr + offset, buffer, size);
+    return true;
+}
+
 i64 file::iwrite(const byte *buffer, u64 size, flag_t flags)
 {
     inode *node = (inode *)entry->get_inode();
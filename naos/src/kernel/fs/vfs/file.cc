@@ -1,6 +1,7 @@
 #include "kernel/fs/vfs/file.hpp"
 #include "kernel/fs/vfs/dentry.hpp"
 #include "kernel/fs/vfs/inode.hpp"
+#include "kernel/fs/vfs/page_cache.hpp"
 #include "kernel/fs/vfs/pseudo.hpp"
 #include "kernel/fs/vfs/super_block.hpp"
 #include "kernel/fs/vfs/vfs.hpp"
@@ -29,6 +30,13 @@ void file::close()
     if (ref_count == 0)
     {
         auto entry = this->entry;
+        if (type != fs::inode_type_t::file && type != fs::inode_type_t::directory &&
+            type != fs::inode_type_t::symbolink)
+        {
+            auto pd = entry->get_inode()->get_pseudo_data();
+            if (pd)
+                pd->release_file(this);
+        }
         auto su = entry->get_inode()->get_super_block();
         if (mode & mode::unlink_on_close)
             unlink(entry);
@@ -65,13 +73,20 @@ i64 file::read(byte *ptr, u64 max_size, flag_t flags)
     auto type = entry->get_inode()->get_type();
     if (type == fs::inode_type_t::file || type == fs::inode_type_t::directory || type == fs::inode_type_t::symbolink)
     {
+        auto cache = entry->get_inode()->get_page_cache();
+        if (cache != nullptr)
+        {
+            i64 size = cache->read(pointer_offset, ptr, max_size);
+            pointer_offset += size;
+            return size;
+        }
         return iread(ptr, max_size, flags);
     }
     else
     {
         auto pd = entry->get_inode()->get_pseudo_data();
         if (pd)
-            return pd->read(ptr, max_size, flags);
+            return pd->read_file(this, ptr, max_size, flags);
         return -1;
     }
     return 0;
@@ -82,7 +97,13 @@ i64 file::write(const byte *ptr, u64 size, flag_t flags)
     auto type = entry->get_inode()->get_type();
     if (type == fs::inode_type_t::file || type == fs::inode_type_t::directory || type == fs::inode_type_t::symbolink)
     {
-        return iwrite(ptr, size, flags);
+        i64 offset = pointer_offset;
+        i64 ret = iwrite(ptr, size, flags);
+        // written through, the cached pages are kept up to date
+        auto cache = entry->get_inode()->get_page_cache();
+        if (ret > 0 && cache != nullptr)
+            cache->update(offset, ptr, ret);
+        return ret;
     }
     else
     {
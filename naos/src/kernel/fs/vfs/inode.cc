@@ -1,8 +1,35 @@
 #include "kernel/fs/vfs/inode.hpp"
 #include "kernel/fs/vfs/dentry.hpp"
+#include "kernel/fs/vfs/page_cache.hpp"
+#include "kernel/mm/memory.hpp"
 #include "kernel/timer.hpp"
 namespace fs::vfs
 {
+inode::~inode()
+{
+    auto c = cache.load(std::memory_order_acquire);
+    if (c != nullptr)
+        memory::Delete<>(memory::KernelCommonAllocatorV, c);
+}
+
+page_cache *inode::get_page_cache()
+{
+    auto c = cache.load(std::memory_order_acquire);
+    if (likely(c != nullptr))
+        return c;
+    if (get_type() != inode_type_t::file || !has_data_pages())
+        return nullptr;
+    c = memory::New<page_cache>(memory::KernelCommonAllocatorV, this);
+    page_cache *exp = nullptr;
+    if (!cache.compare_exchange_strong(exp, c, std::memory_order_acq_rel))
+    {
+        // created by another thread
+        memory::Delete<>(memory::KernelCommonAllocatorV, c);
+        return exp;
+    }
+    return c;
+}
+
 bool inode::has_permission(flag_t pf, user_id uid, group_id gid)
 {
     if (uid == owner)
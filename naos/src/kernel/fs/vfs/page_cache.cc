@@ -0,0 +1,407 @@
+#include "kernel/fs/vfs/page_cache.hpp"
+#include "kernel/fs/vfs/inode.hpp"
+#include "kernel/mm/memory.hpp"
+#include "kernel/mm/shrinker.hpp"
+#include "kernel/mm/vm.hpp"
+#include "kernel/trace.hpp"
+#include "kernel/ucontext.hpp"
+#include "kernel/util/memory.hpp"
+
+namespace fs::vfs
+{
+/// tag of a page entry, the low bits of a page address are free
+const u64 page_entry_dirty = 1;
+/// levels needed to index every u64
+const u32 page_cache_max_height = (64 + page_cache_node_shift - 1) / page_cache_node_shift;
+/// entries handled under one lock by writeback and evict
+const u64 page_cache_batch = 16;
+
+lock::spinlock_t page_cache_list_lock;
+page_cache *page_cache_list = nullptr;
+
+byte *entry_page(void *entry) { return (byte *)((u64)entry & ~(memory::page_size - 1)); }
+
+u64 slot_of(u64 index, u32 level) { return (index >> (level * page_cache_node_shift)) & (page_cache_node_slots - 1); }
+
+/// the tree of height indexes index
+bool fits(u64 index, u32 height)
+{
+    return height * page_cache_node_shift >= 64 || (index >> (height * page_cache_node_shift)) == 0;
+}
+
+void pin_page(byte *page) { memory::vm::share_frame(memory::kernel_virtaddr_to_phyaddr(page)); }
+
+u64 gang_walk(page_cache_node *node, u32 level, u64 base, u64 start, u64 tag, u64 *indexes, void **entries, u64 max)
+{
+    u64 n = 0;
+    u64 span = 1ul << (level * page_cache_node_shift);
+    for (u64 i = 0; i < page_cache_node_slots && n < max; i++)
+    {
+        void *slot = node->slots[i];
+        u64 index = base + i * span;
+        if (slot == nullptr || index + span <= start)
+            continue;
+        if (level > 0)
+        {
+            n += gang_walk((page_cache_node *)slot, level - 1, index, start, tag, indexes + n, entries + n, max - n);
+        }
+        else if (tag == 0 || ((u64)slot & tag))
+        {
+            indexes[n] = index;
+            entries[n] = slot;
+            n++;
+        }
+    }
+    return n;
+}
+
+page_cache::page_cache(inode *owner)
+    : owner(owner)
+    , root(nullptr)
+    , height(0)
+    , page_count(0)
+    , dirty_count(0)
+    , write_seq(0)
+    , prev(nullptr)
+{
+    uctx::RawSpinLockUninterruptibleContext ctx(page_cache_list_lock);
+    next = page_cache_list;
+    if (next != nullptr)
+        next->prev = this;
+    page_cache_list = this;
+}
+
+page_cache::~page_cache()
+{
+    {
+        // wait until the shrinker leaves this cache
+        uctx::RawSpinLockUninterruptibleContext ctx(page_cache_list_lock);
+        if (prev != nullptr)
+            prev->next = next;
+        else
+            page_cache_list = next;
+        if (next != nullptr)
+            next->prev = prev;
+    }
+    u64 indexes[page_cache_batch];
+    void *entries[page_cache_batch];
+    u64 n;
+    while ((n = gang_lookup(0, 0, indexes, entries, page_cache_batch)) > 0)
+    {
+        for (u64 i = 0; i < n; i++)
+        {
+            remove(indexes[i]);
+            // a mapped page is freed by its last unmap
+            memory::vm::release_frame(memory::kernel_virtaddr_to_phyaddr(entry_page(entries[i])));
+        }
+    }
+}
+
+void **page_cache::lookup_slot(u64 index)
+{
+    if (height == 0 || !fits(index, height))
+        return nullptr;
+    page_cache_node *node = root;
+    for (u32 level = height - 1; level > 0; level--)
+    {
+        node = (page_cache_node *)node->slots[slot_of(index, level)];
+        if (node == nullptr)
+            return nullptr;
+    }
+    return &node->slots[slot_of(index, 0)];
+}
+
+bool page_cache::insert(u64 index, void *entry)
+{
+    while (height == 0 || !fits(index, height))
+    {
+        auto node = memory::New<page_cache_node>(memory::KernelCommonAllocatorV);
+        if (unlikely(node == nullptr))
+            return false;
+        if (root != nullptr)
+        {
+            node->slots[0] = root;
+            node->count = 1;
+        }
+        root = node;
+        height++;
+    }
+    page_cache_node *node = root;
+    for (u32 level = height - 1; level > 0; level--)
+    {
+        void *&slot = node->slots[slot_of(index, level)];
+        if (slot == nullptr)
+        {
+            slot = memory::New<page_cache_node>(memory::KernelCommonAllocatorV);
+            if (unlikely(slot == nullptr))
+                return false;
+            node->count++;
+        }
+        node = (page_cache_node *)slot;
+    }
+    void *&slot = node->slots[slot_of(index, 0)];
+    if (slot == nullptr)
+        node->count++;
+    slot = entry;
+    return true;
+}
+
+void page_cache::remove(u64 index)
+{
+    if (height == 0 || !fits(index, height))
+        return;
+    page_cache_node *path[page_cache_max_height];
+    page_cache_node *node = root;
+    for (u32 level = height - 1; level > 0; level--)
+    {
+        path[level] = node;
+        node = (page_cache_node *)node->slots[slot_of(index, level)];
+        if (node == nullptr)
+            return;
+    }
+    if (node->slots[slot_of(index, 0)] == nullptr)
+        return;
+    node->slots[slot_of(index, 0)] = nullptr;
+    // free the nodes left empty bottom up
+    u32 level = 0;
+    while (--node->count == 0)
+    {
+        memory::Delete<>(memory::KernelCommonAllocatorV, node);
+        if (++level == height)
+        {
+            root = nullptr;
+            height = 0;
+            return;
+        }
+        node = path[level];
+        node->slots[slot_of(index, level)] = nullptr;
+    }
+}
+
+u64 page_cache::gang_lookup(u64 start, u64 tag, u64 *indexes, void **entries, u64 max)
+{
+    if (height == 0 || !fits(start, height))
+        return 0;
+    return gang_walk(root, height - 1, 0, start, tag, indexes, entries, max);
+}
+
+byte *page_cache::get_page(u64 index, bool *io)
+{
+    u64 seq;
+    {
+        uctx::RawSpinLockUninterruptibleContext ctx(lock);
+        void **slot = lookup_slot(index);
+        if (slot != nullptr && *slot != nullptr)
+        {
+            byte *page = entry_page(*slot);
+            pin_page(page);
+            return page;
+        }
+        seq = write_seq;
+    }
+
+    byte *page = (byte *)memory::malloc_page();
+    if (unlikely(page == nullptr))
+        return nullptr;
+    for (;;)
+    {
+        if (!owner->read_page(index, page))
+        {
+            memory::free_page(page);
+            return nullptr;
+        }
+        if (io != nullptr)
+            *io = true;
+
+        uctx::RawSpinLockUninterruptibleContext ctx(lock);
+        void **slot = lookup_slot(index);
+        if (slot != nullptr && *slot != nullptr)
+        {
+            // cached by another thread meanwhile
+            memory::free_page(page);
+            page = entry_page(*slot);
+        }
+        else if (seq != write_seq)
+        {
+            // an update may have missed the page being read
+            seq = write_seq;
+            continue;
+        }
+        else if (unlikely(!insert(index, page)))
+        {
+            memory::free_page(page);
+            return nullptr;
+        }
+        else
+        {
+            page_count++;
+        }
+        pin_page(page);
+        return page;
+    }
+}
+
+void page_cache::put_page(byte *page) { memory::vm::release_frame(memory::kernel_virtaddr_to_phyaddr(page)); }
+
+void page_cache::set_dirty(u64 index, byte *page)
+{
+    uctx::RawSpinLockUninterruptibleContext ctx(lock);
+    void **slot = lookup_slot(index);
+    if (slot == nullptr || entry_page(*slot) != page || ((u64)*slot & page_entry_dirty))
+        return;
+    *slot = (void *)((u64)page | page_entry_dirty);
+    dirty_count++;
+}
+
+u64 page_cache::writeback(u64 start, u64 end)
+{
+    u64 written = 0;
+    u64 indexes[page_cache_batch];
+    void *entries[page_cache_batch];
+    while (start < end)
+    {
+        u64 n;
+        {
+            uctx::RawSpinLockUninterruptibleContext ctx(lock);
+            n = gang_lookup(start, page_entry_dirty, indexes, entries, page_cache_batch);
+            for (u64 i = 0; i < n; i++)
+            {
+                if (indexes[i] >= end)
+                {
+                    n = i;
+                    break;
+                }
+                // a write while the page is written back sets it dirty again
+                *lookup_slot(indexes[i]) = entry_page(entries[i]);
+                dirty_count--;
+                pin_page(entry_page(entries[i]));
+            }
+        }
+        if (n == 0)
+            break;
+
+        u64 size = owner->get_size();
+        for (u64 i = 0; i < n; i++)
+        {
+            byte *page = entry_page(entries[i]);
+            u64 offset = indexes[i] * memory::page_size;
+            if (offset < size)
+            {
+                u64 len = size - offset > memory::page_size ? memory::page_size : size - offset;
+                if (owner->write_page(indexes[i], page, len))
+                    written++;
+                else
+                    set_dirty(indexes[i], page);
+            }
+            put_page(page);
+        }
+        start = indexes[n - 1] + 1;
+    }
+    return written;
+}
+
+u64 page_cache::evict(u64 nr_pages)
+{
+    u64 freed = 0;
+    u64 start = 0;
+    u64 indexes[page_cache_batch];
+    void *entries[page_cache_batch];
+    uctx::RawSpinLockUninterruptibleContext ctx(lock);
+    while (freed < nr_pages)
+    {
+        u64 n = gang_lookup(start, 0, indexes, entries, page_cache_batch);
+        if (n == 0)
+            break;
+        for (u64 i = 0; i < n && freed < nr_pages; i++)
+        {
+            if ((u64)entries[i] & page_entry_dirty)
+                continue;
+            byte *page = entry_page(entries[i]);
+            auto desc = memory::virt_addr_to_page(page);
+            // mapped or pinned, a pin is only taken under the lock
+            if (desc != nullptr && desc->share_count.load(std::memory_order_acquire) > 0)
+                continue;
+            remove(indexes[i]);
+            page_count--;
+            memory::free_page(page);
+            freed++;
+        }
+        start = indexes[n - 1] + 1;
+    }
+    return freed;
+}
+
+i64 page_cache::read(u64 offset, byte *buffer, u64 size)
+{
+    u64 file_size = owner->get_size();
+    if (offset >= file_size)
+        return 0;
+    if (size > file_size - offset)
+        size = file_size - offset;
+
+    u64 done = 0;
+    while (done < size)
+    {
+        u64 in = (offset + done) & (memory::page_size - 1);
+        u64 n = memory::page_size - in > size - done ? size - done : memory::page_size - in;
+        byte *page = get_page((offset + done) / memory::page_size);
+        if (unlikely(page == nullptr))
+            break;
+        util::memcopy(buffer + done, page + in, n);
+        put_page(page);
+        done += n;
+    }
+    return done;
+}
+
+void page_cache::update(u64 offset, const byte *buffer, u64 size)
+{
+    u64 end = offset + size;
+    while (offset < end)
+    {
+        u64 in = offset & (memory::page_size - 1);
+        u64 n = memory::page_size - in > end - offset ? end - offset : memory::page_size - in;
+        byte *page = nullptr;
+        {
+            uctx::RawSpinLockUninterruptibleContext ctx(lock);
+            write_seq++;
+            void **slot = lookup_slot(offset / memory::page_size);
+            if (slot != nullptr && *slot != nullptr)
+            {
+                page = entry_page(*slot);
+                pin_page(page);
+            }
+        }
+        if (page != nullptr)
+        {
+            util::memcopy(page + in, buffer, n);
+            put_page(page);
+        }
+        buffer += n;
+        offset += n;
+    }
+}
+
+u64 page_cache_shrink_count(u64 user_data)
+{
+    u64 count = 0;
+    uctx::RawSpinLockUninterruptibleContext ctx(page_cache_list_lock);
+    for (page_cache *cache = page_cache_list; cache != nullptr; cache = cache->next)
+        count += cache->page_count - cache->dirty_count;
+    return count;
+}
+
+u64 page_cache_shrink_scan(u64 nr_pages, u64 user_data)
+{
+    u64 freed = 0;
+    uctx::RawSpinLockUninterruptibleContext ctx(page_cache_list_lock);
+    for (page_cache *cache = page_cache_list; cache != nullptr && freed < nr_pages; cache = cache->next)
+        freed += cache->evict(nr_pages - freed);
+    return freed;
+}
+
+memory::shrinker_t page_cache_shrinker("page_cache", page_cache_shrink_count, page_cache_shrink_scan, 0);
+
+void init_page_cache() { memory::register_shrinker(&page_cache_shrinker); }
+
+} // namespace fs::vfs
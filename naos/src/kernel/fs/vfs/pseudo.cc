@@ -1,5 +1,8 @@
 #include "kernel/fs/vfs/pseudo.hpp"
 #include "kernel/fs/vfs/defines.hpp"
+#include "kernel/fs/vfs/file.hpp"
+#include "kernel/ucontext.hpp"
+#include "kernel/util/memory.hpp"
 namespace fs::vfs
 {
 
@@ -63,4 +66,56 @@ void pseudo_pipe_t::close()
     task::do_wake_up(&wait_queue);
 }
 
+i64 pseudo_text_t::write(const byte *data, u64 size, flag_t flags) { return -1; }
+
+/// snapshot of a pseudo_text_t read by one open file
+struct pseudo_text_state_t
+{
+    char *text;
+    u64 length;
+    u64 offset;
+};
+
+/// the text has no offset without a file
+i64 pseudo_text_t::read(byte *data, u64 max_size, flag_t flags) { return -1; }
+
+void pseudo_text_t::close() {}
+
+i64 pseudo_text_t::read_file(file *f, byte *data, u64 max_size, flag_t flags)
+{
+    auto state = (pseudo_text_state_t *)f->pseudo_state;
+    if (state == nullptr)
+    {
+        state = memory::New<pseudo_text_state_t>(memory::KernelCommonAllocatorV);
+        state->text = (char *)memory::KernelMemoryAllocatorV->allocate(buffer_size, 8);
+        state->length = 0;
+        state->offset = 0;
+        f->pseudo_state = state;
+    }
+    if (state->offset == 0)
+    {
+        uctx::RawSpinLockUninterruptibleContext ctx(spinlock);
+        state->length = func(state->text, buffer_size);
+    }
+    // the user buffer may fault, copy without the lock
+    u64 n = state->length - state->offset;
+    if (n > max_size)
+        n = max_size;
+    util::memcopy(data, state->text + state->offset, n);
+    state->offset += n;
+    if (n == 0)
+        state->offset = 0;
+    return n;
+}
+
+void pseudo_text_t::release_file(file *f)
+{
+    auto state = (pseudo_text_state_t *)f->pseudo_state;
+    if (state == nullptr)
+        return;
+    memory::KernelMemoryAllocatorV->deallocate(state->text);
+    memory::Delete<>(memory::KernelCommonAllocatorV, state);
+    f->pseudo_state = nullptr;
+}
+
 } // namespace fs::vfs
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "kernel/fs/vfs/mm.hpp"
 #include "kernel/fs/vfs/mount.hpp"
 #include "kernel/fs/vfs/nameidata.hpp"
+#include "kernel/fs/vfs/page_cache.hpp"
 #include "kernel/fs/vfs/pseudo.hpp"
 #include "kernel/fs/vfs/super_block.hpp"
 #include "kernel/mm/list_node_cache.hpp"
@@ -39,7 +40,11 @@ struct data_t
 
 data_t *data;
 
-void init() { data = memory::New<data_t>(memory::KernelCommonAllocatorV); }
+void init()
+{
+    data = memory::New<data_t>(memory::KernelCommonAllocatorV);
+    init_page_cache();
+}
 
 int register_fs(file_system *fs)
 {
@@ -0,0 +1,248 @@
+#include "kernel/futex.hpp"
+#include "kernel/lock.hpp"
+#include "kernel/scheduler.hpp"
+#include "kernel/task.hpp"
+#include "kernel/timer.hpp"
+#include "kernel/ucontext.hpp"
+
+namespace task
+{
+
+struct futex_bucket_t;
+
+/// lives on the stack of the waiting thread, a wait allocates nothing
+struct futex_waiter_t
+{
+    futex_waiter_t *prev;
+    futex_waiter_t *next;
+    /// changed by a requeue, see lock_waiter_bucket
+    futex_bucket_t *volatile bucket;
+    void *vm;
+    u32 *addr;
+    thread_t *thread;
+    /// armed under the bucket lock, so futex_cancel finds it
+    timer::watcher_handle_t timer;
+    /// set by the waker under the bucket lock
+    bool woken;
+};
+
+struct futex_bucket_t
+{
+    lock::spinlock_t lock;
+    futex_waiter_t *head;
+    futex_waiter_t *tail;
+};
+
+constexpr u64 futex_hash_bits = 8;
+
+futex_bucket_t futex_table[1ul << futex_hash_bits];
+
+futex_bucket_t *get_bucket(void *vm, u32 *addr)
+{
+    u64 key = ((u64)vm >> 4) ^ ((u64)addr >> 2);
+    return &futex_table[(key * 0x9E3779B97F4A7C15ul) >> (64 - futex_hash_bits)];
+}
+
+/// waiters are appended, so they are woken up in the order they came
+void list_add(futex_bucket_t *bucket, futex_waiter_t *waiter)
+{
+    waiter->bucket = bucket;
+    waiter->thread->futex_bucket = bucket;
+    waiter->thread->futex_waiter = waiter;
+    waiter->next = nullptr;
+    waiter->prev = bucket->tail;
+    if (bucket->tail != nullptr)
+        bucket->tail->next = waiter;
+    else
+        bucket->head = waiter;
+    bucket->tail = waiter;
+}
+
+void list_del(futex_bucket_t *bucket, futex_waiter_t *waiter)
+{
+    if (waiter->prev != nullptr)
+        waiter->prev->next = waiter->next;
+    else
+        bucket->head = waiter->next;
+    if (waiter->next != nullptr)
+        waiter->next->prev = waiter->prev;
+    else
+        bucket->tail = waiter->prev;
+    waiter->prev = nullptr;
+    waiter->next = nullptr;
+    waiter->thread->futex_waiter = nullptr;
+    waiter->thread->futex_bucket = nullptr;
+}
+
+/// lock the bucket a waiter is queued in, a requeue may move the waiter before the lock is got
+futex_bucket_t *lock_waiter_bucket(futex_waiter_t *waiter)
+{
+    for (;;)
+    {
+        futex_bucket_t *bucket = waiter->bucket;
+        bucket->lock.lock();
+        if (bucket == waiter->bucket)
+            return bucket;
+        bucket->lock.unlock();
+    }
+}
+
+/// the waker holds the bucket lock, the waiter can't return before the thread is set ready
+void wake_waiter(futex_bucket_t *bucket, futex_waiter_t *waiter)
+{
+    list_del(bucket, waiter);
+    waiter->woken = true;
+    scheduler::update_state(waiter->thread, thread_state::ready);
+}
+
+void futex_timeout(u64 expires, u64 data) { scheduler::update_state((thread_t *)data, thread_state::ready); }
+
+futex_wait_result futex_wait(u32 *addr, u32 val, u64 timeout)
+{
+    void *vm = current_process()->mm_info;
+    // fault the page in before the bucket lock is held
+    (void)*(volatile u32 *)addr;
+
+    futex_waiter_t waiter;
+    waiter.vm = vm;
+    waiter.addr = addr;
+    waiter.thread = current();
+    waiter.woken = false;
+    u64 deadline = timeout != 0 ? timer::get_high_resolution_time() + timeout : 0;
+
+    uctx::UninterruptibleContext icu;
+    futex_bucket_t *bucket = get_bucket(vm, addr);
+    {
+        uctx::RawSpinLockContext ctx(bucket->lock);
+        // checked under the bucket lock, a waker changing the value after that finds this waiter
+        if (*(volatile u32 *)addr != val)
+            return futex_wait_result::again;
+        list_add(bucket, &waiter);
+        if (deadline != 0)
+            waiter.timer = timer::add_hrtimer(deadline, futex_timeout, (u64)waiter.thread);
+    }
+
+    futex_wait_result result = futex_wait_result::ok;
+    for (;;)
+    {
+        auto thd = current();
+        thd->attributes |= task::thread_attributes::need_schedule;
+        scheduler::update_state(thd, thread_state::interruptable);
+        scheduler::schedule();
+
+        bucket = lock_waiter_bucket(&waiter);
+        if (waiter.woken)
+        {
+            bucket->lock.unlock();
+            break;
+        }
+        if (thd->signal_pack.is_set())
+            result = futex_wait_result::interrupted;
+        else if (deadline != 0 && timer::get_high_resolution_time() >= deadline)
+            result = futex_wait_result::timeout;
+        else
+        {
+            // false wake up, try sleep.
+            bucket->lock.unlock();
+            continue;
+        }
+        list_del(bucket, &waiter);
+        bucket->lock.unlock();
+        break;
+    }
+    timer::remove_watcher(waiter.timer);
+    return result;
+}
+
+void futex_cancel(thread_t *thd)
+{
+    uctx::UninterruptibleContext icu;
+    for (;;)
+    {
+        // the bucket is static, the waiter is only touched once its bucket lock shows it's still queued
+        futex_bucket_t *bucket = thd->futex_bucket;
+        if (bucket == nullptr)
+            return;
+        bucket->lock.lock();
+        if (bucket != thd->futex_bucket)
+        {
+            // woken or requeued meanwhile
+            bucket->lock.unlock();
+            continue;
+        }
+        futex_waiter_t *waiter = thd->futex_waiter;
+        list_del(bucket, waiter);
+        waiter->woken = true;
+        timer::remove_watcher(waiter->timer);
+        bucket->lock.unlock();
+        return;
+    }
+}
+
+u64 futex_wake(u32 *addr, u64 count)
+{
+    void *vm = current_process()->mm_info;
+    futex_bucket_t *bucket = get_bucket(vm, addr);
+    uctx::RawSpinLockUninterruptibleContext ctx(bucket->lock);
+    u64 woken = 0;
+    for (futex_waiter_t *waiter = bucket->head; waiter != nullptr && woken < count;)
+    {
+        futex_waiter_t *next = waiter->next;
+        if (waiter->vm == vm && waiter->addr == addr)
+        {
+            wake_waiter(bucket, waiter);
+            woken++;
+        }
+        waiter = next;
+    }
+    return woken;
+}
+
+u64 futex_requeue(u32 *addr, u64 count, u64 requeue_count, u32 *addr2)
+{
+    void *vm = current_process()->mm_info;
+    futex_bucket_t *bucket = get_bucket(vm, addr);
+    futex_bucket_t *bucket2 = get_bucket(vm, addr2);
+
+    uctx::UninterruptibleContext icu;
+    // lock by address order, two requeues in opposite directions don't deadlock
+    futex_bucket_t *first = bucket < bucket2 ? bucket : bucket2;
+    futex_bucket_t *second = bucket < bucket2 ? bucket2 : bucket;
+    first->lock.lock();
+    if (second != first)
+        second->lock.lock();
+
+    u64 woken = 0;
+    u64 moved = 0;
+    for (futex_waiter_t *waiter = bucket->head; waiter != nullptr;)
+    {
+        futex_waiter_t *next = waiter->next;
+        if (waiter->vm == vm && waiter->addr == addr)
+        {
+            if (woken < count)
+            {
+                wake_waiter(bucket, waiter);
+                woken++;
+            }
+            else if (moved >= requeue_count)
+            {
+                break;
+            }
+            else
+            {
+                list_del(bucket, waiter);
+                waiter->addr = addr2;
+                list_add(bucket2, waiter);
+                moved++;
+            }
+        }
+        waiter = next;
+    }
+
+    if (second != first)
+        second->lock.unlock();
+    first->lock.unlock();
+    return woken + moved;
+}
+
+} // namespace task
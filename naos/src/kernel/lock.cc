@@ -0,0 +1,183 @@
+#include "kernel/lock.hpp"
+#include "kernel/arch/cpu.hpp"
+#include "kernel/preempt.hpp"
+#include "kernel/smp.hpp"
+#include "kernel/trace.hpp"
+#include "kernel/util/text_writer.hpp"
+
+namespace lock
+{
+
+constexpr u32 spinlock_tail_shift = 16;
+/// a cpu may queue for a lock in task, soft irq, hard irq and exception context at once
+constexpr u32 mcs_nesting = 4;
+
+struct alignas(64) mcs_node_t
+{
+    mcs_node_t *volatile next;
+    volatile u32 locked;
+    /// nodes in use, only meaningful in the first node of a cpu
+    u32 count;
+};
+
+mcs_node_t mcs_nodes[arch::cpu::max_cpu_support][mcs_nesting];
+
+/// pause in a spin loop. The owner may wait for a TLB shootdown of this cpu, answer it even if interrupts are off
+inline void spin_pause()
+{
+    cpu_pause();
+    SMP::answer_tlb_shootdown();
+}
+
+mcs_node_t *decode_tail(u32 tail)
+{
+    tail >>= spinlock_tail_shift;
+    return &mcs_nodes[(tail >> 2) - 1][tail & 3];
+}
+
+void spinlock_t::lock_slow()
+{
+#ifdef _LOCK_STAT
+    u64 start = _rdtsc();
+#endif
+    // the node belongs to this cpu, the thread must not move until it leaves the queue
+    task::disable_preempt();
+    u32 cpu = arch::cpu::id();
+    mcs_node_t *nodes = mcs_nodes[cpu];
+    u32 idx = nodes[0].count++;
+    kassert(idx < mcs_nesting, "Spinlock nesting is too deep");
+    mcs_node_t *node = &nodes[idx];
+    node->next = nullptr;
+    node->locked = 0;
+    u32 tail = ((cpu + 1) << 2 | idx) << spinlock_tail_shift;
+
+    u32 old = lock_m.load(std::memory_order_relaxed);
+    while (!lock_m.compare_exchange_weak(old, (old & spinlock_locked_mask) | tail, std::memory_order_acq_rel))
+    {
+    }
+    if (old & ~spinlock_locked_mask)
+    {
+        // wait on our own node until the previous waiter becomes the owner
+        decode_tail(old)->next = node;
+        while (!node->locked)
+            spin_pause();
+    }
+
+    // head of the queue, wait for the owner
+    u32 v;
+    while ((v = lock_m.load(std::memory_order_acquire)) & spinlock_locked_mask)
+        spin_pause();
+    for (;;)
+    {
+        if ((v & ~spinlock_locked_mask) == tail)
+        {
+            // last in the queue, clear the tail too
+            if (lock_m.compare_exchange_weak(v, spinlock_locked, std::memory_order_acquire))
+                break;
+            continue;
+        }
+        // the tail keeps the fast path out, only the head sets the locked byte
+        lock_m.fetch_add(spinlock_locked, std::memory_order_acquire);
+        mcs_node_t *next;
+        while ((next = node->next) == nullptr)
+            spin_pause();
+        next->locked = 1;
+        break;
+    }
+    nodes[0].count--;
+    task::enable_preempt();
+#ifdef _LOCK_STAT
+    if (stat != nullptr)
+        stat->record_contended(_rdtsc() - start);
+#endif
+}
+
+/// a reader in interrupt context may have interrupted a reader, it must not wait for waiting writers
+bool reader_in_interrupt()
+{
+    auto &cpu = arch::cpu::current();
+    return cpu.in_soft_irq() || cpu.is_in_interrupt_context() || cpu.is_in_exception_context();
+}
+
+void rw_lock_t::lock_read_slow()
+{
+#ifdef _LOCK_STAT
+    u64 start = _rdtsc();
+#endif
+    u64 block = reader_in_interrupt() ? rw_lock_writer : ~rw_lock_reader_mask;
+    u64 exp;
+    do
+    {
+        while ((exp = lock_m.load(std::memory_order_relaxed)) & block)
+            spin_pause();
+    } while (!lock_m.compare_exchange_weak(exp, exp + 1, std::memory_order_acquire));
+#ifdef _LOCK_STAT
+    if (stat != nullptr)
+        stat->record_contended(_rdtsc() - start);
+#endif
+}
+
+void rw_lock_t::lock_write_slow()
+{
+#ifdef _LOCK_STAT
+    u64 start = _rdtsc();
+#endif
+    // announce the writer, new readers wait from now on
+    lock_m.fetch_add(rw_lock_waiting_writer, std::memory_order_relaxed);
+    u64 exp;
+    do
+    {
+        while ((exp = lock_m.load(std::memory_order_relaxed)) & (rw_lock_writer | rw_lock_reader_mask))
+            spin_pause();
+    } while (!lock_m.compare_exchange_weak(exp, (exp - rw_lock_waiting_writer) | rw_lock_writer,
+                                           std::memory_order_acquire));
+#ifdef _LOCK_STAT
+    if (stat != nullptr)
+        stat->record_contended(_rdtsc() - start);
+#endif
+}
+
+std::atomic<lock_stat_t *> lock_stat_list = nullptr;
+
+lock_stat_t::lock_stat_t(const char *name)
+    : name(name)
+    , acquire_count(0)
+    , contended_count(0)
+    , max_wait_cycles(0)
+{
+    lock_stat_t *head = lock_stat_list.load();
+    do
+    {
+        next = head;
+    } while (!lock_stat_list.compare_exchange_weak(head, this));
+}
+
+void lock_stat_t::record_contended(u64 wait_cycles)
+{
+    acquire_count++;
+    contended_count++;
+    u64 max = max_wait_cycles.load(std::memory_order_relaxed);
+    while (wait_cycles > max && !max_wait_cycles.compare_exchange_weak(max, wait_cycles))
+    {
+    }
+}
+
+u64 lock_stat_info(char *buffer, u64 size)
+{
+    util::text_writer writer(buffer, size);
+#ifndef _LOCK_STAT
+    writer.put("kernel built without LOCK_STAT, the counters are not updated\n");
+#endif
+    writer.put("name                    acquire         contended       max_wait_cycles\n");
+    for (lock_stat_t *stat = lock_stat_list.load(); stat != nullptr; stat = stat->next)
+    {
+        writer.put(stat->name, 24);
+        writer.put(stat->acquire_count, 16);
+        writer.put(stat->contended_count, 16);
+        writer.put(stat->max_wait_cycles);
+        writer.put("\n");
+    }
+    return writer.pos;
+}
+
+} // namespace lock
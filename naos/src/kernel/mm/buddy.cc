@@ -1,229 +1,355 @@
 #include "kernel/mm/buddy.hpp"
 #include "kernel/lock.hpp"
 #include "kernel/mm/memory.hpp"
+#include "kernel/mm/shrinker.hpp"
+#include "kernel/trace.hpp"
 #include "kernel/ucontext.hpp"
-#include "kernel/util/bit_set.hpp"
 namespace memory
 {
 
-const int buddy_max_page = 1 << 8;
-
 BuddyAllocator *KernelBuddyAllocatorV;
-lock::spinlock_t buddy_lock;
+BuddyAllocator *KernelDMABuddyAllocatorV;
+
+lock::lock_stat_t buddy_lock_stat("buddy");
 
-u64 buddy::fit_size(u64 size)
+u32 size_to_order(u64 size)
 {
-    size |= size >> 1;
-    size |= size >> 2;
-    size |= size >> 4;
-    size |= size >> 8;
-    size |= size >> 16;
-    return size + 1;
+    u64 pages = (size + page_size - 1) / page_size;
+    u32 order = 0;
+    while ((1ul << order) < pages)
+        order++;
+    return order;
 }
 
-int buddy::alloc(u64 pages)
+buddy::buddy(page_t *pages, u64 start_pfn, u64 page_count)
+    : pages(pages)
+    , start_pfn(start_pfn)
+    , end_pfn(start_pfn + page_count)
+    , free_pages(0)
+    , watermark_min(page_count / 256 + 8)
+    , watermark_low(watermark_min * 5 / 4)
+    , watermark_high(watermark_min * 3 / 2)
 {
-    if (pages == 0)
-        pages = 1;
-    else if ((pages & (pages - 1)) != 0) // not pow of 2
-        pages = fit_size(pages);
-
-    // The existing maximum size does not apply to callers.
-    if (array[0] < pages)
-        return -1;
-
-    // Find block
-    u64 target_page = (size + 1) / 2;
-    int i = 0;
-    for (; target_page != pages; target_page >>= 1)
+    spinlock.set_stat(&buddy_lock_stat);
+    for (auto &area : free_area)
     {
-        if (array[i * 2 + 1] >= pages) // Available at left branch
-        {
-            i = i * 2 + 1;
-        }
-        else // Available at right branch
-        {
-            i = i * 2 + 2;
-        }
+        area.head = nullptr;
+        area.count = 0;
     }
-    array[i] = 0;
-    int index = i;
-    while (index > 0) ///< Modify the value of it
+    // split the zone into the largest naturally aligned blocks
+    u64 pfn = start_pfn;
+    while (pfn < end_pfn)
     {
-        index = ((index + 1) >> 1) - 1;
-        auto a = array[index * 2 + 1];
-        auto b = array[index * 2 + 2];
-        if (a < b) // maximum size
-        {
-            a = b;
-        }
-        array[index] = a; ///< reset maximum size
+        u32 order = 0;
+        while (order + 1 < buddy_max_order && (pfn & ((1ul << (order + 1)) - 1)) == 0 &&
+               pfn + (1ul << (order + 1)) <= end_pfn)
+            order++;
+        list_add(pfn, order);
+        free_pages += 1ul << order;
+        pfn += 1ul << order;
     }
-    return (i + 1) * target_page - (size + 1) / 2;
 }
 
-void buddy::free(int offset)
+void buddy::list_add(u64 pfn, u32 order)
 {
-    int index = offset + (size + 1) / 2 - 1;
-    u64 node_size = 1;
-    for (; array[index]; index = ((index + 1) >> 1) - 1)
+    page_t *page = pfn_to_page(pfn);
+    auto &area = free_area[order];
+    page->flags |= page_flags::buddy_free;
+    page->order = order;
+    page->free_prev = nullptr;
+    page->free_next = area.head;
+    if (area.head != nullptr)
+        area.head->free_prev = page;
+    area.head = page;
+    area.count++;
+}
+
+void buddy::list_del(u64 pfn, u32 order)
+{
+    page_t *page = pfn_to_page(pfn);
+    auto &area = free_area[order];
+    if (page->free_prev != nullptr)
+        page->free_prev->free_next = page->free_next;
+    else
+        area.head = page->free_next;
+    if (page->free_next != nullptr)
+        page->free_next->free_prev = page->free_prev;
+    page->free_prev = nullptr;
+    page->free_next = nullptr;
+    page->flags &= ~page_flags::buddy_free;
+    area.count--;
+}
+
+void buddy::free_block(u64 pfn, u32 order)
+{
+    while (order + 1 < buddy_max_order)
     {
-        node_size *= 2;
-        if (index == 0)
-            return;
+        u64 buddy_pfn = pfn ^ (1ul << order);
+        if (buddy_pfn < start_pfn || buddy_pfn + (1ul << order) > end_pfn)
+            break;
+        page_t *buddy_page = pfn_to_page(buddy_pfn);
+        if (!(buddy_page->flags & page_flags::buddy_free) || buddy_page->order != order)
+            break;
+        list_del(buddy_pfn, order);
+        pfn &= ~(1ul << order);
+        order++;
     }
-    array[index] = node_size;
+    list_add(pfn, order);
+}
 
-    while (index > 0)
+i64 buddy::alloc_block(u32 order, u32 align_order)
+{
+    u32 cur = order > align_order ? order : align_order;
+    for (; cur < buddy_max_order; cur++)
     {
-        index = ((index + 1) >> 1) - 1;
-        node_size *= 2;
-
-        auto left = array[index * 2 + 1];
-        auto right = array[index * 2 + 2];
+        if (free_area[cur].head != nullptr)
+            break;
+    }
+    if (cur >= buddy_max_order)
+        return -1;
 
-        if (left + right == node_size)
-            array[index] = node_size;
-        else
-            array[index] = left > right ? left : right;
+    u64 pfn = page_to_pfn(free_area[cur].head);
+    list_del(pfn, cur);
+    // give back the upper halves, the lower half keeps the alignment of the original block
+    while (cur > order)
+    {
+        cur--;
+        list_add(pfn + (1ul << cur), cur);
     }
+    pfn_to_page(pfn)->order = order;
+    free_pages -= 1ul << order;
+    return pfn;
+}
+
+i64 buddy::alloc(u32 order, u32 align_order)
+{
+    uctx::RawSpinLockUninterruptibleContext ctx(spinlock);
+    return alloc_block(order, align_order);
 }
 
-buddy::buddy(int page_count)
-    : size(page_count * 2 - 1)
-    , array((u16 *)memory::VirtBootAllocatorV->allocate(sizeof(u16) * size, 1))
+u32 buddy::alloc_bulk(u64 *pfns, u32 count)
 {
-    if ((page_count & (page_count - 1)) != 0)
-        return;
-    u64 node_size = size + 1;
-    for (int i = 0; i < size; i++)
+    uctx::RawSpinLockUninterruptibleContext ctx(spinlock);
+    u32 i = 0;
+    for (; i < count; i++)
     {
-        if (((i + 1) & (i)) == 0)
-        {
-            node_size >>= 1;
-        }
-        array[i] = node_size;
+        i64 pfn = alloc_block(0, 0);
+        if (pfn < 0)
+            break;
+        pfns[i] = pfn;
     }
+    return i;
 }
 
-/*
-Tag memory used by kernel.
-*/
-bool buddy::tag_alloc(int start_offset, int len)
+void buddy::free(u64 pfn)
 {
-    // no include this [start_offset, end_offset)
-    int end_offset = start_offset + len - 1;
+    uctx::RawSpinLockUninterruptibleContext ctx(spinlock);
+    page_t *page = pfn_to_page(pfn);
+    kassert(!(page->flags & page_flags::buddy_free), "Double free of buddy block ", (void *)(pfn * page_size));
+    u32 order = page->order;
+    free_pages += 1ul << order;
+    free_block(pfn, order);
+}
 
-    int start_index = start_offset + (size + 1) / 2 - 1;
-    int end_index = end_offset + (size + 1) / 2 - 1;
-    for (int i = start_index; i <= end_index; i++)
+void buddy::free_bulk(const u64 *pfns, u32 count)
+{
+    uctx::RawSpinLockUninterruptibleContext ctx(spinlock);
+    for (u32 i = 0; i < count; i++)
     {
-        array[i] = 0;
+        kassert(!(pfn_to_page(pfns[i])->flags & page_flags::buddy_free), "Double free of buddy block ",
+                (void *)(pfns[i] * page_size));
+        free_pages++;
+        free_block(pfns[i], 0);
     }
-    int sindex = start_index, eindex = end_index;
-    u64 node_size = size + 1;
-    while (sindex > 0 && eindex > 0)
+}
+
+void buddy::split(u64 pfn)
+{
+    uctx::RawSpinLockUninterruptibleContext ctx(spinlock);
+    page_t *page = pfn_to_page(pfn);
+    kassert(!(page->flags & page_flags::buddy_free), "Split of free buddy block ", (void *)(pfn * page_size));
+    u64 count = 1ul << page->order;
+    for (u64 i = 0; i < count; i++)
+        page[i].order = 0;
+}
+
+void buddy::tag_alloc(u64 pfn_start, u64 pfn_end)
+{
+    uctx::RawSpinLockUninterruptibleContext ctx(spinlock);
+
+    for (u64 pfn = pfn_start; pfn < pfn_end; pfn++)
     {
-        sindex = ((sindex + 1) >> 1) - 1;
-        eindex = ((eindex + 1) >> 1) - 1;
-        for (int i = sindex; i <= eindex; i++)
+        // find the free block containing this page
+        u32 order = 0;
+        u64 head = pfn;
+        for (; order < buddy_max_order; order++)
         {
-            auto left = array[i * 2 + 1];
-            auto right = array[i * 2 + 2];
+            head = pfn & ~((1ul << order) - 1);
+            if (head < start_pfn)
+            {
+                order = buddy_max_order;
+                break;
+            }
+            page_t *page = pfn_to_page(head);
+            if ((page->flags & page_flags::buddy_free) && page->order == order)
+                break;
+        }
+        if (order >= buddy_max_order) // reserved already
+            continue;
 
-            if (left + right == node_size)
-                array[i] = node_size; // merge
+        list_del(head, order);
+        if (head >= pfn_start && head + (1ul << order) <= pfn_end)
+        {
+            // whole block is inside the range
+            free_pages -= 1ul << order;
+            pfn = head + (1ul << order) - 1;
+            continue;
+        }
+        // split until only this page is left
+        while (order > 0)
+        {
+            order--;
+            u64 half = 1ul << order;
+            if (pfn < head + half)
+            {
+                list_add(head + half, order);
+            }
             else
             {
-                array[i] = left > right ? left : right;
+                list_add(head, order);
+                head += half;
             }
         }
-        node_size >>= 1;
+        pfn_to_page(pfn)->order = 0;
+        free_pages--;
     }
-    return true;
 }
 
-void buddy::cat_tree(buddy_tree *tree, int index)
+BuddyAllocator::BuddyAllocator(zone_type_t zone_type)
+    : zone_type(zone_type)
 {
-    if (index > size)
-    {
-        return;
-    }
-    tree->val = array[index];
+}
+
+BuddyAllocator::~BuddyAllocator() {}
+
+void *BuddyAllocator::allocate(u64 size, u64 align)
+{
+    u32 order = size_to_order(size);
+    u32 align_order = align > page_size ? size_to_order(align) : 0;
+    if (unlikely(order >= buddy_max_order || align_order >= buddy_max_order))
+        return nullptr;
 
-    if (index * 2 + 2 > size)
+    // keep every zone above its min watermark first, then dip into the reserve
+    for (int pass = 0; pass < 2; pass++)
     {
-        tree->left = nullptr;
-        tree->right = nullptr;
+        zone_type_t type = zone_type;
+        for (;;)
+        {
+            for (int i = 0; i < global_zones.count; i++)
+            {
+                zone_t &zone = global_zones.zones[i];
+                if (zone.type != type)
+                    continue;
+                auto b = (buddy *)zone.buddy_impl;
+                if (pass == 0 && b->get_free_pages() < b->get_watermark_min() + (1ul << order))
+                    continue;
+                i64 pfn = b->alloc(order, align_order);
+                if (pfn >= 0)
+                {
+                    if (unlikely(b->get_free_pages() < b->get_watermark_low()))
+                        wakeup_reclaim();
+                    return memory::kernel_phyaddr_to_virtaddr((void *)(pfn * page_size));
+                }
+            }
+            if (type == zone_type_t::dma)
+                break;
+            type = zone_type_t::dma;
+        }
     }
-    else
+    wakeup_reclaim();
+    return nullptr;
+}
+
+void BuddyAllocator::deallocate(void *ptr)
+{
+    ptr = memory::kernel_virtaddr_to_phyaddr(ptr);
+
+    for (int i = 0; i < global_zones.count; i++)
     {
+        zone_t &zone = global_zones.zones[i];
 
-        tree->left = tree + index * 2 + 1 - index;
-        tree->right = tree + index * 2 + 2 - index;
-        cat_tree(tree->left, index * 2 + 1);
-        cat_tree(tree->right, index * 2 + 2);
+        if ((char *)ptr >= zone.start && (char *)ptr < zone.end)
+        {
+            kassert(((u64)ptr & (page_size - 1)) == 0, "Buddy block address should be page aligned ", ptr);
+            ((buddy *)zone.buddy_impl)->free((u64)ptr / page_size);
+            return;
+        }
     }
 }
 
-buddy_tree *buddy::gen_tree()
+u32 BuddyAllocator::allocate_pages(void **pages, u32 count)
 {
-    buddy_tree *tree = memory::NewArray<buddy_tree>(memory::VirtBootAllocatorV, size);
-    cat_tree(tree, 0);
-    return tree;
+    u64 pfns[page_cpu_cache_batch];
+    u32 n = 0;
+    zone_type_t type = zone_type;
+    for (;;)
+    {
+        for (int i = 0; i < global_zones.count && n < count; i++)
+        {
+            zone_t &zone = global_zones.zones[i];
+            if (zone.type != type)
+                continue;
+            u32 want = count - n;
+            if (want > page_cpu_cache_batch)
+                want = page_cpu_cache_batch;
+            auto b = (buddy *)zone.buddy_impl;
+            u32 got = b->alloc_bulk(pfns, want);
+            for (u32 j = 0; j < got; j++)
+                pages[n++] = memory::kernel_phyaddr_to_virtaddr((void *)(pfns[j] * page_size));
+            if (unlikely(b->get_free_pages() < b->get_watermark_low()))
+                wakeup_reclaim();
+        }
+        if (n >= count || type == zone_type_t::dma)
+            break;
+        type = zone_type_t::dma;
+    }
+    return n;
 }
 
-BuddyAllocator::BuddyAllocator() {}
-
-BuddyAllocator::~BuddyAllocator() {}
-
-void *BuddyAllocator::allocate(u64 size, u64 align)
+void BuddyAllocator::deallocate_pages(void *const *pages, u32 count)
 {
-    uctx::RawSpinLockUninterruptibleContext ctx(buddy_lock);
-
-    auto page = (size + 0x1000 - 1) / 0x1000;
+    u64 pfns[page_cpu_cache_batch];
     for (int i = 0; i < global_zones.count; i++)
     {
         zone_t &zone = global_zones.zones[i];
-
-        auto buddies = (buddy_contanier *)zone.buddy_impl;
-        for (int j = 0; j < buddies->count; j++)
+        u32 n = 0;
+        for (u32 j = 0; j < count; j++)
         {
-            i64 offset = buddies->buddies[j].alloc(page);
-            if (offset >= 0 && offset < buddy_max_page)
+            char *phy = (char *)memory::kernel_virtaddr_to_phyaddr(pages[j]);
+            if (phy >= zone.start && phy < zone.end)
             {
-                auto ptr = (byte *)zone.start + offset * memory::page_size;
-                return memory::kernel_phyaddr_to_virtaddr((byte *)ptr + buddy_max_page * page_size * j);
+                pfns[n++] = (u64)phy / page_size;
+                if (n == page_cpu_cache_batch)
+                {
+                    ((buddy *)zone.buddy_impl)->free_bulk(pfns, n);
+                    n = 0;
+                }
             }
         }
+        if (n > 0)
+            ((buddy *)zone.buddy_impl)->free_bulk(pfns, n);
     }
-    return nullptr;
 }
-
-void BuddyAllocator::deallocate(void *ptr)
+void BuddyAllocator::split(void *ptr)
 {
     ptr = memory::kernel_virtaddr_to_phyaddr(ptr);
 
-    uctx::RawSpinLockUninterruptibleContext ctx(buddy_lock);
-
     for (int i = 0; i < global_zones.count; i++)
     {
         zone_t &zone = global_zones.zones[i];
-
         if ((char *)ptr >= zone.start && (char *)ptr < zone.end)
         {
-            auto buddies = (buddy_contanier *)zone.buddy_impl;
-
-            int buddy_index =
-                ((byte *)ptr - (byte *)zone.start + (memory::page_size * buddy_max_page) + memory::page_size) /
-                    (memory::page_size * buddy_max_page) -
-                1;
-            i64 offset =
-                ((byte *)ptr - buddy_max_page * page_size * buddy_index - (byte *)zone.start) / memory::page_size;
-            kassert(offset >= 0 && offset < buddy_max_page,
-                    "offset should not less than 0 or more than buddy max page");
-
-            buddies->buddies[buddy_index].free(offset);
+            ((buddy *)zone.buddy_impl)->split((u64)ptr / page_size);
             return;
         }
     }
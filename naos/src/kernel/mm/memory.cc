@@ -3,13 +3,17 @@
 #include "kernel/arch/exception.hpp"
 #include "kernel/arch/klib.hpp"
 #include "kernel/arch/paging.hpp"
+#include "kernel/cpu.hpp"
 #include "kernel/irq.hpp"
 #include "kernel/kernel.hpp"
 #include "kernel/mm/buddy.hpp"
 #include "kernel/mm/msg_queue.hpp"
 #include "kernel/mm/new.hpp"
+#include "kernel/mm/shrinker.hpp"
 #include "kernel/mm/slab.hpp"
 #include "kernel/mm/vm.hpp"
+#include "kernel/smp.hpp"
+#include "kernel/ucontext.hpp"
 
 namespace memory
 {
@@ -47,6 +51,11 @@ const u64 interrupt_stack_size = interrupt_stack_page_count * memory::page_size;
 const u64 exception_stack_size = exception_stack_page_count * memory::page_size;
 const u64 exception_nmi_stack_size = exception_nmi_stack_page_count * memory::page_size;
 const u64 max_memory_support = 0x100000000000ul;
+/// vfree purges the TLB after this many pages are freed lazily
+const u64 vmap_lazy_max_pages = 8192;
+const u32 vmap_lazy_max_areas = 64;
+/// largest kmalloc served by a single buddy block
+const u64 kmalloc_large_max_size = page_size << (buddy_max_order - 1);
 
 VirtBootAllocator *VirtBootAllocatorV;
 PhyBootAllocator *PhyBootAllocatorV;
@@ -84,6 +93,75 @@ struct kmalloc_t
     {1024, "kmalloc-1024"}, {1536, "kmalloc-1536"}, {2048, "kmalloc-2048"}, {3072, "kmalloc-3072"},
     {4096, "kmalloc-4096"}, {6144, "kmalloc-6144"}, {8192, "kmalloc-8192"}};
 
+page_cpu_cache *get_page_cpu_cache()
+{
+    // cpu data is not ready in early boot
+    auto data = (cpu::cpu_data_t *)arch::cpu::current_user_data();
+    if (unlikely(data == nullptr))
+        return nullptr;
+    return (page_cpu_cache *)data->get_page_cpu_cache();
+}
+
+u64 cached_pages(page_cpu_cache *cache) { return cache->hot_count + cache->cold_count; }
+
+u64 page_cpu_cache_shrink_count(u64 user_data)
+{
+    u64 count = 0;
+    u64 cpu_count = cpu::count();
+    for (u32 i = 0; i < cpu_count; i++)
+    {
+        auto cache = (page_cpu_cache *)cpu::get(i).get_page_cpu_cache();
+        if (cache != nullptr)
+            count += cached_pages(cache);
+    }
+    return count;
+}
+
+/// give every page cached by the current cpu back to the buddy
+u64 drain_page_cpu_cache()
+{
+    uctx::UninterruptibleContext icu;
+    page_cpu_cache *cache = get_page_cpu_cache();
+    if (unlikely(cache == nullptr))
+        return 0;
+    u64 freed = cached_pages(cache);
+    KernelBuddyAllocatorV->deallocate_pages(cache->hot, cache->hot_count);
+    KernelBuddyAllocatorV->deallocate_pages(cache->cold, cache->cold_count);
+    cache->hot_count = 0;
+    cache->cold_count = 0;
+    cache->drain_times++;
+    cache->drain_pages += freed;
+    return freed;
+}
+
+void drain_page_cpu_cache_call(u64 user_data) { drain_page_cpu_cache(); }
+
+/// drain the cache of this cpu and ask the other cpus to drain theirs
+///
+/// The other cpus aren't waited for, a cpu spinning on a lock held by the caller can't take the call. The pages
+/// they cache at the call are counted as freed.
+u64 page_cpu_cache_shrink_scan(u64 nr_pages, u64 user_data)
+{
+    u64 freed = 0;
+    u64 cpu_count = cpu::count();
+    u32 self = cpu::current().id();
+    for (u32 i = 0; i < cpu_count; i++)
+    {
+        auto cache = (page_cpu_cache *)cpu::get(i).get_page_cpu_cache();
+        if (i == self || cache == nullptr)
+            continue;
+        u64 cached = cached_pages(cache);
+        if (cached == 0)
+            continue;
+        SMP::call_cpu(i, drain_page_cpu_cache_call, 0);
+        freed += cached;
+    }
+    return freed + drain_page_cpu_cache();
+}
+
+shrinker_t slab_shrinker("slab", slab_shrink_count, slab_shrink_scan, 0);
+shrinker_t page_cpu_cache_shrinker("page_cpu_cache", page_cpu_cache_shrink_count, page_cpu_cache_shrink_scan, 0);
+
 void tag_zone_buddy_memory(void *start_addr, void *end_addr)
 {
     for (int i = 0; i < global_zones.count; i++)
@@ -144,6 +222,9 @@ void init(const kernel_start_args *args, u64 fix_memory_limit)
             u64 end = ((u64)mm_item->addr + mm_item->len - 1) & ~(page_size - 1);
             if (start < end)
                 global_zones.count++;
+            // split the DMA part into its own zone
+            if (start < dma_zone_limit && end > dma_zone_limit)
+                global_zones.count++;
             max_memory_available += mm_item->len;
         }
         if (mm_item->addr + mm_item->len > max_memory_maped)
@@ -169,30 +250,30 @@ void init(const kernel_start_args *args, u64 fix_memory_limit)
         u64 end = ((u64)mm_item->addr + mm_item->len - 1) & ~(page_size - 1);
         if (start >= end)
             continue;
-        auto &item = global_zones.zones[cid];
-        item.start = (void *)start;
-        item.end = (void *)end;
-        item.page_count = (end - start) / page_size;
-        auto buddies = New<buddy_contanier>(VirtBootAllocatorV);
-
-        item.buddy_impl = buddies;
-        auto count = item.page_count / buddy_max_page;
-        auto rest = item.page_count % buddy_max_page;
-        if (likely(rest > 0))
-            buddies->count = count + 1;
-        else
-            buddies->count = count;
-        trace::debug("Memory zone ", cid, " page count:", item.page_count, ", buddy count:", buddies->count);
-        if (likely(buddies->count > 0))
-        {
-            buddies->buddies = NewArray<buddy>(VirtBootAllocatorV, buddies->count, buddy_max_page);
-            if (rest > 0)
-                buddies->buddies[buddies->count - 1].tag_alloc(rest, buddy_max_page - rest);
-        }
-        else
+        while (start < end)
         {
+            auto &item = global_zones.zones[cid];
+            u64 zone_end = end;
+            if (start < dma_zone_limit)
+            {
+                item.type = zone_type_t::dma;
+                if (zone_end > dma_zone_limit)
+                    zone_end = dma_zone_limit;
+            }
+            else
+            {
+                item.type = zone_type_t::normal;
+            }
+            item.start = (void *)start;
+            item.end = (void *)zone_end;
+            item.page_count = (zone_end - start) / page_size;
+            item.pages = NewArray<page_t>(VirtBootAllocatorV, item.page_count);
+            item.buddy_impl = New<buddy>(VirtBootAllocatorV, item.pages, start / page_size, item.page_count);
+            trace::debug("Memory zone ", cid, (item.type == zone_type_t::dma ? " (dma)" : " (normal)"),
+                         " page count:", item.page_count);
+            start = zone_end;
+            cid++;
         }
-        cid++;
     }
     // map the kernel and data
     auto start_kernel = args->kernel_base & ~(page_size - 1);
@@ -200,7 +281,7 @@ void init(const kernel_start_args *args, u64 fix_memory_limit)
 
     auto start_data = (args->data_base) & ~(page_size - 1);
     auto end_data = (u64)PhyBootAllocator::current_ptr_address() + sizeof(slab_cache_pool) * 3 +
-                    sizeof(void *) * 2 * 6 + sizeof(vm::vm_allocator) + fix_memory_limit;
+                    sizeof(void *) * 2 * 7 + sizeof(vm::vm_allocator) + fix_memory_limit;
     end_data = (end_data + page_size - 1) & ~(page_size - 1);
 
     if (start_data < end_kernel)
@@ -236,17 +317,23 @@ void init(const kernel_start_args *args, u64 fix_memory_limit)
                  ", length:", (end_image_data - start_image_data), " -> ", (end_image_data - start_image_data) >> 10,
                  "Kib");
 
-    KernelBuddyAllocatorV = New<BuddyAllocator>(VirtBootAllocatorV);
+    KernelBuddyAllocatorV = New<BuddyAllocator>(VirtBootAllocatorV, zone_type_t::normal);
+    KernelDMABuddyAllocatorV = New<BuddyAllocator>(VirtBootAllocatorV, zone_type_t::dma);
 
     global_kmalloc_slab_domain = New<slab_cache_pool>(VirtBootAllocatorV);
     global_dma_slab_domain = New<slab_cache_pool>(VirtBootAllocatorV);
     global_object_slab_domain = New<slab_cache_pool>(VirtBootAllocatorV);
 
+    slab_magazine_group = NewSlabGroup(global_object_slab_domain, slab_magazine, 8, 0);
+    slab_magazine_group->set_magazine_size(0);
+
     for (auto &i : kmalloc_fixed_slab_size)
     {
         i.group = global_kmalloc_slab_domain->create_new_slab_group(i.size, i.name, 8, 0);
     }
     KernelCommonAllocatorV = New<KernelCommonAllocator>(VirtBootAllocatorV);
+    register_shrinker(&slab_shrinker);
+    register_shrinker(&page_cpu_cache_shrinker);
 
     memory::vm::init();
     kernel_vm_info = New<vm::info_t>(VirtBootAllocatorV);
@@ -265,6 +352,17 @@ u64 get_max_available_memory() { return max_memory_available; }
 
 u64 get_max_maped_memory() { return max_memory_maped; }
 
+/// allocate physically contiguous pages from buddy, the block order is kept in the head page descriptor
+void *kmalloc_large(u64 size, u64 align)
+{
+    void *ptr = KernelBuddyAllocatorV->allocate(size, align);
+    if (unlikely(ptr == nullptr))
+        return nullptr;
+    page_t *page = virt_addr_to_page(ptr);
+    page->flags |= page_flags::large_kmalloc;
+    return ptr;
+}
+
 void *kmalloc(u64 size, u64 align)
 {
     if (unlikely(align > size))
@@ -273,10 +371,8 @@ void *kmalloc(u64 size, u64 align)
     }
 
     if (size > kmalloc_fixed_slab_size[sizeof(kmalloc_fixed_slab_size) / sizeof(kmalloc_fixed_slab_size[0]) - 1].size)
-    {
-        trace::panic("allocate size is too large");
-        return nullptr;
-    }
+        return kmalloc_large(size, align);
+
     u64 left = 0, right = sizeof(kmalloc_fixed_slab_size) / sizeof(kmalloc_fixed_slab_size[0]), mid;
 
     while (left < right)
@@ -302,67 +398,203 @@ void *kmalloc(u64 size, u64 align)
 
 void kfree(void *addr)
 {
-    for (auto it : kmalloc_fixed_slab_size)
+    page_t *page = virt_addr_to_page(addr);
+    if (unlikely(page == nullptr))
+        return;
+    if (likely(page->flags & page_flags::slab))
     {
-        if (it.group->include_address(addr))
+        SlabObjectAllocator allocator(page->slab_group_owner);
+        allocator.deallocate(addr);
+    }
+    else if (page->flags & page_flags::large_kmalloc)
+    {
+        page->flags &= ~page_flags::large_kmalloc;
+        KernelBuddyAllocatorV->deallocate(addr);
+    }
+}
+
+/// Freed vmalloc areas waiting for a TLB purge. Their page tables are cleared and their frames are freed,
+/// but the virtual range is kept reserved until every CPU has dropped the stale translations.
+struct vmap_lazy_t
+{
+    const vm::vm_t *areas[vmap_lazy_max_areas];
+    u32 count = 0;
+    u64 pages = 0;
+    lock::spinlock_t spinlock;
+} vmap_lazy;
+
+/// flush all TLBs once and give the pending virtual ranges back. vmap_lazy.spinlock must be held.
+void purge_vmap_lazy_areas()
+{
+    if (vmap_lazy.count == 0)
+        return;
+    SMP::flush_all_tlb();
+    for (u32 i = 0; i < vmap_lazy.count; i++)
+        kernel_vm_info->vma.deallocate_map(vmap_lazy.areas[i]);
+    vmap_lazy.count = 0;
+    vmap_lazy.pages = 0;
+}
+
+void purge_vmap_lazy()
+{
+    uctx::RawSpinLockUninterruptibleContext ctx(vmap_lazy.spinlock);
+    purge_vmap_lazy_areas();
+}
+
+/// unmap a vmalloc range and free its frames, the caller purges the TLB
+void vfree_area(const vm::vm_t *vm)
+{
+    auto base = (arch::paging::base_paging_t *)kernel_vm_info->mmu_paging.get_page_addr();
+    void *frames[page_cpu_cache_batch];
+    u32 n = 0;
+    for (u64 start = vm->start; start < vm->end; start += page_size)
+    {
+        void *phy;
+        if (arch::paging::get_map_address(base, (void *)start, &phy))
         {
-            SlabObjectAllocator allocator(it.group);
-            allocator.deallocate(addr);
-            return;
+            frames[n++] = memory::kernel_phyaddr_to_virtaddr(phy);
+            if (n == page_cpu_cache_batch)
+            {
+                KernelBuddyAllocatorV->deallocate_pages(frames, n);
+                n = 0;
+            }
         }
     }
+    if (n > 0)
+        KernelBuddyAllocatorV->deallocate_pages(frames, n);
+    arch::paging::unmap(base, (void *)vm->start, arch::paging::frame_size::size_4kb,
+                        (vm->end - vm->start) / arch::paging::frame_size::size_4kb);
 }
 
 void *vmalloc(u64 size, u64 align)
 {
-    auto vm = kernel_vm_info->vma.allocate_map(size, align, 0, 0);
-    for (u64 start = vm->start; start < vm->end; start += page_size)
+    auto vm = kernel_vm_info->vma.allocate_map(size, vm::flags::readable | vm::flags::writeable, 0, 0);
+    if (unlikely(vm == nullptr))
     {
-        auto phy = memory::kernel_virtaddr_to_phyaddr(KernelBuddyAllocatorV->allocate(1, 0));
-        arch::paging::map((arch::paging::base_paging_t *)kernel_vm_info->mmu_paging.get_page_addr(), (void *)start, phy,
-                          arch::paging::frame_size::size_4kb, 1,
-                          arch::paging::flags::writable | arch::paging::flags::present);
+        // virtual space may be held by lazily freed areas
+        purge_vmap_lazy();
+        vm = kernel_vm_info->vma.allocate_map(size, vm::flags::readable | vm::flags::writeable, 0, 0);
+        if (unlikely(vm == nullptr))
+            return nullptr;
     }
-    arch::paging::reload();
+    auto base = (arch::paging::base_paging_t *)kernel_vm_info->mmu_paging.get_page_addr();
+    void *frames[page_cpu_cache_batch];
+    for (u64 start = vm->start; start < vm->end;)
+    {
+        u32 want = (vm->end - start) / page_size;
+        if (want > page_cpu_cache_batch)
+            want = page_cpu_cache_batch;
+        u32 n = KernelBuddyAllocatorV->allocate_pages(frames, want);
+        if (unlikely(n < want))
+        {
+            KernelBuddyAllocatorV->deallocate_pages(frames, n);
+            if (start > vm->start)
+            {
+                vm::vm_t mapped(vm->start, start, vm->flags, 0, 0);
+                vfree_area(&mapped);
+            }
+            kernel_vm_info->vma.deallocate_map(vm);
+            return nullptr;
+        }
+        for (u32 i = 0; i < n; i++)
+            frames[i] = memory::kernel_virtaddr_to_phyaddr(frames[i]);
+        arch::paging::map_frames(base, (void *)start, frames, n,
+                                 arch::paging::flags::writable | arch::paging::flags::present);
+        start += n * page_size;
+    }
+    // the range was not present before, so no TLB entry can be stale
     return (void *)vm->start;
 }
 
 void vfree(void *addr)
 {
     auto vm = kernel_vm_info->vma.get_vm_area((u64)addr);
-    if (vm)
+    if (unlikely(!vm))
+        return;
+
+    uctx::RawSpinLockUninterruptibleContext ctx(vmap_lazy.spinlock);
+    for (u32 i = 0; i < vmap_lazy.count; i++)
     {
-        /// TODO: free page memory
-        kernel_vm_info->vma.deallocate_map(vm);
-        arch::paging::unmap((arch::paging::base_paging_t *)kernel_vm_info->mmu_paging.get_page_addr(),
-                            (void *)vm->start, arch::paging::frame_size::size_4kb,
-                            (vm->end - vm->start) / arch::paging::frame_size::size_4kb);
+        if (unlikely(vmap_lazy.areas[i] == vm))
+            trace::panic("vfree on a freed address ", addr);
     }
+    vfree_area(vm);
+
+    if (vmap_lazy.count == vmap_lazy_max_areas)
+        purge_vmap_lazy_areas();
+    vmap_lazy.areas[vmap_lazy.count++] = vm;
+    vmap_lazy.pages += (vm->end - vm->start) / page_size;
+    if (vmap_lazy.pages >= vmap_lazy_max_pages)
+        purge_vmap_lazy_areas();
 }
 
 void zone_t::tag_used(u64 offset_start, u64 offset_end)
 {
-    auto buddies = (buddy_contanier *)buddy_impl;
-    u64 s_buddy = offset_start / buddy_max_page;
-    u64 e_buddy = offset_end / buddy_max_page;
-    u64 s_buddy_rest = offset_start % buddy_max_page;
-    u64 e_buddy_rest = offset_end % buddy_max_page;
-    if (s_buddy == e_buddy)
+    u64 start_pfn = (u64)start / page_size;
+    ((buddy *)buddy_impl)->tag_alloc(start_pfn + offset_start, start_pfn + offset_end);
+}
+
+page_t *phy_addr_to_page(void *phy_addr)
+{
+    for (int i = 0; i < global_zones.count; i++)
     {
-        buddies->buddies[s_buddy].tag_alloc(s_buddy_rest, e_buddy_rest - s_buddy_rest);
-        return;
+        auto &zone = global_zones.zones[i];
+        if ((char *)phy_addr >= (char *)zone.start && (char *)phy_addr < (char *)zone.end)
+        {
+            return &zone.pages[((u64)phy_addr - (u64)zone.start) / page_size];
+        }
     }
-    buddies->buddies[s_buddy].tag_alloc(s_buddy_rest, buddy_max_page - s_buddy_rest);
-    for (u64 i = s_buddy + 1; i < e_buddy; i++)
+    return nullptr;
+}
+
+page_t *virt_addr_to_page(void *virt_addr) { return phy_addr_to_page(kernel_virtaddr_to_phyaddr(virt_addr)); }
+
+void *malloc_page()
+{
+    uctx::UninterruptibleContext icu;
+    page_cpu_cache *cache = get_page_cpu_cache();
+    if (unlikely(cache == nullptr))
+        return KernelBuddyAllocatorV->allocate(page_size, 0);
+
+    cache->alloc_times++;
+    if (likely(cache->hot_count > 0))
+        return cache->hot[--cache->hot_count];
+
+    if (cache->cold_count == 0)
     {
-        buddies->buddies[i].tag_alloc(0, buddy_max_page);
+        u32 n = KernelBuddyAllocatorV->allocate_pages(cache->cold, page_cpu_cache_batch);
+        cache->refill_times++;
+        cache->refill_pages += n;
+        cache->cold_count = n;
+        if (unlikely(n == 0))
+            return nullptr;
     }
-    buddies->buddies[e_buddy].tag_alloc(0, e_buddy_rest);
+    return cache->cold[--cache->cold_count];
 }
 
-void *malloc_page() { return KernelBuddyAllocatorV->allocate(1, 0); }
+void free_page(void *addr)
+{
+    uctx::UninterruptibleContext icu;
+    page_cpu_cache *cache = get_page_cpu_cache();
+    if (unlikely(cache == nullptr))
+    {
+        KernelBuddyAllocatorV->deallocate(addr);
+        return;
+    }
 
-void free_page(void *addr) { KernelBuddyAllocatorV->deallocate(addr); }
+    cache->free_times++;
+    if (unlikely(cache->hot_count == page_cpu_cache_high))
+    {
+        // give the oldest pages back to the buddy
+        KernelBuddyAllocatorV->deallocate_pages(cache->hot, page_cpu_cache_batch);
+        for (u32 i = page_cpu_cache_batch; i < page_cpu_cache_high; i++)
+            cache->hot[i - page_cpu_cache_batch] = cache->hot[i];
+        cache->hot_count -= page_cpu_cache_batch;
+        cache->drain_times++;
+        cache->drain_pages += page_cpu_cache_batch;
+    }
+    cache->hot[cache->hot_count++] = addr;
+}
 
 void *KernelCommonAllocator::allocate(u64 size, u64 align) { return kmalloc(size, align); }
 
@@ -374,17 +606,19 @@ void KernelVirtualAllocator::deallocate(void *p) { vfree(p); }
 
 void *KernelMemoryAllocator::allocate(u64 size, u64 align)
 {
-    if (size > 4096)
+    if (size <= kmalloc_large_max_size)
     {
-        return vmalloc(size, align);
+        void *ptr = kmalloc(size, align);
+        if (likely(ptr != nullptr))
+            return ptr;
+        // physical memory is too fragmented
     }
-    return kmalloc(size, align);
+    return vmalloc(size, align);
 }
 
 void KernelMemoryAllocator::deallocate(void *p)
 {
-    auto vm = kernel_vm_info->vma.get_vm_area((u64)p);
-    if (!vm)
+    if ((u64)p >= kernel_mmap_bottom_address && (u64)p < kernel_mmap_top_address)
     {
         vfree(p);
         return;
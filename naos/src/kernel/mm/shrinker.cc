@@ -0,0 +1,106 @@
+#include "kernel/mm/shrinker.hpp"
+#include "kernel/lock.hpp"
+#include "kernel/mm/buddy.hpp"
+#include "kernel/mm/memory.hpp"
+#include "kernel/mm/new.hpp"
+#include "kernel/timer.hpp"
+#include "kernel/ucontext.hpp"
+#include "kernel/wait.hpp"
+#include <atomic>
+
+namespace memory
+{
+
+/// pages to reclaim when an allocation failed without any zone under its low watermark
+const u64 reclaim_fragmented_pages = 256;
+/// a wake up lost between the check and the sleep of the reclaim thread is redone after this interval
+const u64 reclaim_recheck_us = 100000;
+
+shrinker_t *shrinker_list = nullptr;
+lock::rw_lock_t shrinker_lock;
+std::atomic_bool reclaim_requested = false;
+/// created by the reclaim thread, the allocator isn't ready at static init
+std::atomic<task::wait_queue *> reclaim_wait_queue = nullptr;
+
+void register_shrinker(shrinker_t *shrinker)
+{
+    uctx::RawWriteLockUninterruptibleContext ctx(shrinker_lock);
+    shrinker->next = shrinker_list;
+    shrinker_list = shrinker;
+}
+
+void unregister_shrinker(shrinker_t *shrinker)
+{
+    uctx::RawWriteLockUninterruptibleContext ctx(shrinker_lock);
+    shrinker_t **prev = &shrinker_list;
+    for (shrinker_t *s = shrinker_list; s != nullptr; prev = &s->next, s = s->next)
+    {
+        if (s == shrinker)
+        {
+            *prev = s->next;
+            s->next = nullptr;
+            return;
+        }
+    }
+}
+
+u64 shrink_all(u64 nr_pages)
+{
+    u64 freed = 0;
+    uctx::RawReadLockContext ctx(shrinker_lock);
+    for (shrinker_t *s = shrinker_list; s != nullptr && freed < nr_pages; s = s->next)
+    {
+        if (s->count(s->user_data) == 0)
+            continue;
+        freed += s->scan(nr_pages - freed, s->user_data);
+    }
+    return freed;
+}
+
+void wakeup_reclaim()
+{
+    if (reclaim_requested.exchange(true))
+        return;
+    // before the reclaim thread runs, its first pass sees the request
+    auto queue = reclaim_wait_queue.load(std::memory_order_acquire);
+    if (queue != nullptr)
+        task::do_wake_up(queue);
+}
+
+bool reclaim_pending(u64 user_data) { return reclaim_requested; }
+
+void reclaim_recheck(u64 expires, u64 user_data) { task::do_wake_up((task::wait_queue *)user_data); }
+
+void wait_reclaim()
+{
+    auto queue = reclaim_wait_queue.load(std::memory_order_relaxed);
+    if (queue == nullptr)
+    {
+        queue = memory::New<task::wait_queue>(KernelCommonAllocatorV, KernelCommonAllocatorV);
+        reclaim_wait_queue.store(queue, std::memory_order_release);
+    }
+    auto timer = timer::add_watcher(reclaim_recheck_us, reclaim_recheck, (u64)queue);
+    task::do_wait(queue, reclaim_pending, 0, task::wait_context_type::interruptable);
+    timer::remove_watcher(timer);
+}
+
+u64 balance_zones()
+{
+    bool requested = reclaim_requested.exchange(false);
+    u64 target = 0;
+    for (int i = 0; i < global_zones.count; i++)
+    {
+        auto b = (buddy *)global_zones.zones[i].buddy_impl;
+        u64 free = b->get_free_pages();
+        if (free < b->get_watermark_low())
+            target += b->get_watermark_high() - free;
+    }
+    // an allocation failed although no zone is low, large blocks are fragmented
+    if (target == 0 && requested)
+        target = reclaim_fragmented_pages;
+    if (target == 0)
+        return 0;
+    return shrink_all(target);
+}
+
+} // namespace memory
@@ -1,43 +1,109 @@
 #include "kernel/mm/slab.hpp"
+#include "kernel/arch/cpu.hpp"
+#include "kernel/cpu.hpp"
 #include "kernel/lock.hpp"
+#include "kernel/mm/memory.hpp"
 #include "kernel/ucontext.hpp"
 #include "kernel/util/str.hpp"
+#include <atomic>
 namespace memory
 {
 
 slab_cache_pool *global_kmalloc_slab_domain, *global_dma_slab_domain, *global_object_slab_domain;
+slab_group *slab_magazine_group;
+
+std::atomic_uint32_t slab_cpu_cache_next_index = 0;
+
+u32 default_magazine_size(u64 obj_size)
+{
+    if (obj_size <= 256)
+        return 32;
+    else if (obj_size <= 1024)
+        return 16;
+    else if (obj_size <= 4096)
+        return 8;
+    return 4;
+}
 void slab_group::new_memory_node()
 {
     slab *s = (slab *)memory::KernelBuddyAllocatorV->allocate(page_pre_slab * memory::page_size, 8);
-    new (s) slab(node_pre_slab, 0);
+    new (s) slab(node_pre_slab, color_offset);
+
+    // rotate the color so objects of consecutive slabs don't alias the same cache sets
+    color_offset += color_align;
+    if (color_offset > color_max)
+        color_offset = 0;
 
     s->data_ptr = (char *)s + sizeof(slab);
-    s->data_ptr = (char *)(((u64)s->data_ptr + align - 1) & ~(align - 1));
+    s->data_ptr = (char *)(((u64)s->data_ptr + align - 1) & ~(align - 1)) + s->color_offset;
     s->bitmap.clean_all();
-    list_empty.push_back(s);
+    if (ctor != nullptr)
+    {
+        for (u32 i = 0; i < node_pre_slab; i++)
+            ctor(s->data_ptr + i * obj_align_size);
+    }
+    s->list_node = list_empty.push_back(s);
     all_obj_count += node_pre_slab;
+
+    page_t *page = virt_addr_to_page(s);
+    for (u32 i = 0; i < page_pre_slab; i++, page++)
+    {
+        page->flags |= page_flags::slab;
+        page->slab_group_owner = this;
+        page->slab_owner = s;
+    }
 }
 
 void slab_group::delete_memory_node(slab *s)
 {
     kassert(s->rest == node_pre_slab, "slab error rest:", s->rest, " target:", node_pre_slab);
     all_obj_count -= node_pre_slab;
+    if (dtor != nullptr)
+    {
+        for (u32 i = 0; i < node_pre_slab; i++)
+            dtor(s->data_ptr + i * obj_align_size);
+    }
+
+    page_t *page = virt_addr_to_page(s);
+    for (u32 i = 0; i < page_pre_slab; i++, page++)
+    {
+        page->flags &= ~page_flags::slab;
+        page->slab_group_owner = nullptr;
+        page->slab_owner = nullptr;
+    }
     s->~slab();
     memory::KernelBuddyAllocatorV->deallocate(s);
 }
 
-slab_group::slab_group(memory::IAllocator *allocator, u64 size, const char *name, u64 align, u64 flags)
+lock::lock_stat_t slab_depot_lock_stat("slab_depot");
+
+slab_group::slab_group(memory::IAllocator *allocator, u64 size, const char *name, u64 align, u64 flags,
+                       slab_obj_func ctor, slab_obj_func dtor)
     : obj_align_size((size + align - 1) & ~(align - 1))
     , size(size)
     , name(name)
     , list_empty(allocator)
     , list_partial(allocator)
     , list_full(allocator)
+    , color_offset(0)
+    , ctor(ctor)
+    , dtor(dtor)
     , flags(flags)
     , align(align)
     , all_obj_count(0)
     , all_obj_used(0)
+    , cpu_cache_index(slab_cpu_cache_next_index++)
+    , depot_full(nullptr)
+    , depot_empty(nullptr)
+    , depot_full_count(0)
+    , depot_empty_count(0)
 {
+    depot_lock.set_stat(&slab_depot_lock_stat);
+    if (cpu_cache_index < slab_cpu_cache_max_groups)
+        magazine_size = default_magazine_size(obj_align_size);
+    else
+        magazine_size = 0;
+
     u64 restsize = memory::page_size - ((sizeof(slab) + align - 1) & ~(align - 1));
 
     if (obj_align_size * 64 > restsize)
@@ -76,9 +142,13 @@ slab_group::slab_group(memory::IAllocator *allocator, u64 size, const char *name
         page_pre_slab = 1;
         node_pre_slab = restsize / obj_align_size;
     }
+
+    u64 leftover = restsize + memory::page_size * (page_pre_slab - 1) - node_pre_slab * obj_align_size;
+    color_align = align > slab_cache_line_size ? align : slab_cache_line_size;
+    color_max = leftover / color_align * color_align;
 }
 
-void *slab_group::alloc()
+void *slab_group::slab_alloc()
 {
     uctx::RawWriteLockUninterruptibleContext ctx(slab_lock);
     if (list_partial.empty())
@@ -87,7 +157,8 @@ void *slab_group::alloc()
         {
             new_memory_node();
         }
-        list_partial.push_back(list_empty.pop_back());
+        slab *s = list_empty.pop_back();
+        s->list_node = list_partial.push_back(s);
     }
     slab *slab = list_partial.back();
     auto &bitmap = slab->bitmap;
@@ -101,89 +172,241 @@ void *slab_group::alloc()
 
     if (slab->rest == 0)
     {
-        list_full.push_back(list_partial.pop_back());
+        list_partial.pop_back();
+        slab->list_node = list_full.push_back(slab);
     }
     return slab->data_ptr + i * obj_align_size;
 }
 
-void slab_group::free(void *ptr)
+void slab_group::slab_free(void *ptr)
 {
     uctx::RawWriteLockUninterruptibleContext ctx(slab_lock);
 
-    char *page_addr = (char *)((u64)ptr & ~(memory::page_size * page_pre_slab - 1));
+    page_t *page = virt_addr_to_page(ptr);
+    kassert(page != nullptr && page->slab_group_owner == this, "Not an address of slab group ", name);
+    slab *s = page->slab_owner;
+    bool was_full = s->rest == 0;
 
-    for (auto it = list_partial.begin(); it != list_partial.end(); ++it)
+    u64 index = ((char *)ptr - s->data_ptr) / obj_align_size;
+    kassert(s->bitmap.get(index), "Not an assigned address.");
+    s->bitmap.clean(index);
+    s->rest++;
+    all_obj_used--;
+
+    slab_list_t &from = was_full ? list_full : list_partial;
+    if (s->rest == node_pre_slab)
     {
-        if (page_addr == (char *)*it)
+        from.remove(s->list_node);
+        if (all_obj_used * 2 < all_obj_count)
         {
-            auto &e = **it;
-            u64 index = ((char *)ptr - e.data_ptr) / obj_align_size;
-            kassert(e.bitmap.get(index), "Not an assigned address.");
-            e.bitmap.clean(index);
-            e.rest++;
-            all_obj_used--;
-
-            if (e.rest == node_pre_slab)
-            {
-                list_empty.push_back(*it);
-                list_partial.remove(it);
-
-                if (all_obj_used * 2 < all_obj_count)
-                {
-                    delete_memory_node(&e);
-                    list_empty.pop_back();
-                }
-            }
-
+            delete_memory_node(s);
             return;
         }
+        s->list_node = list_empty.push_back(s);
+    }
+    else if (was_full)
+    {
+        list_full.remove(s->list_node);
+        s->list_node = list_partial.push_back(s);
+    }
+}
+
+slab_cpu_cache *slab_group::get_cpu_cache()
+{
+    // cpu data is not ready in early boot
+    auto data = (cpu::cpu_data_t *)arch::cpu::current_user_data();
+    if (unlikely(data == nullptr))
+        return nullptr;
+    auto caches = (slab_cpu_cache *)data->get_slab_cpu_cache();
+    if (unlikely(caches == nullptr))
+        return nullptr;
+    return &caches[cpu_cache_index];
+}
+
+const slab_cpu_cache *slab_group::get_cpu_cache(u32 cpuid)
+{
+    if (cpu_cache_index >= slab_cpu_cache_max_groups)
+        return nullptr;
+    auto caches = (slab_cpu_cache *)cpu::get(cpuid).get_slab_cpu_cache();
+    if (caches == nullptr)
+        return nullptr;
+    return &caches[cpu_cache_index];
+}
+
+slab_magazine *slab_group::depot_pop(slab_magazine *&list, u64 &count)
+{
+    uctx::RawSpinLockContext ctx(depot_lock);
+    slab_magazine *mag = list;
+    if (mag != nullptr)
+    {
+        list = mag->next;
+        mag->next = nullptr;
+        count--;
+    }
+    return mag;
+}
+
+void slab_group::depot_push(slab_magazine *&list, u64 &count, slab_magazine *mag)
+{
+    uctx::RawSpinLockContext ctx(depot_lock);
+    mag->next = list;
+    list = mag;
+    count++;
+}
+
+void *slab_group::magazine_alloc(slab_cpu_cache *cache)
+{
+    if (likely(cache->loaded != nullptr && !cache->loaded->is_empty()))
+    {
+        cache->alloc_hit++;
+        return cache->loaded->objects[--cache->loaded->rounds];
+    }
+    if (cache->previous != nullptr && !cache->previous->is_empty())
+    {
+        auto mag = cache->loaded;
+        cache->loaded = cache->previous;
+        cache->previous = mag;
+        cache->alloc_hit++;
+        return cache->loaded->objects[--cache->loaded->rounds];
+    }
+    cache->alloc_miss++;
+
+    slab_magazine *full = depot_pop(depot_full, depot_full_count);
+    if (full == nullptr)
+        return nullptr;
+    if (cache->previous != nullptr)
+        depot_push(depot_empty, depot_empty_count, cache->previous);
+    cache->previous = cache->loaded;
+    cache->loaded = full;
+    return cache->loaded->objects[--cache->loaded->rounds];
+}
+
+bool slab_group::magazine_free(slab_cpu_cache *cache, void *ptr)
+{
+    if (likely(cache->loaded != nullptr && !cache->loaded->is_full()))
+    {
+        cache->free_hit++;
+        cache->loaded->objects[cache->loaded->rounds++] = ptr;
+        return true;
+    }
+    if (cache->previous != nullptr && cache->previous->is_empty())
+    {
+        auto mag = cache->loaded;
+        cache->loaded = cache->previous;
+        cache->previous = mag;
+        cache->free_hit++;
+        cache->loaded->objects[cache->loaded->rounds++] = ptr;
+        return true;
+    }
+    cache->free_miss++;
+
+    slab_magazine *empty = depot_pop(depot_empty, depot_empty_count);
+    if (empty == nullptr)
+    {
+        void *mem = slab_magazine_group->alloc();
+        if (unlikely(mem == nullptr))
+            return false;
+        empty = new (mem) slab_magazine(magazine_size);
+    }
+    if (cache->loaded != nullptr)
+    {
+        if (cache->previous != nullptr)
+            depot_push(depot_full, depot_full_count, cache->previous);
+        cache->previous = cache->loaded;
     }
-    for (auto it = list_full.begin(); it != list_full.end(); ++it)
+    cache->loaded = empty;
+    cache->loaded->objects[cache->loaded->rounds++] = ptr;
+    return true;
+}
+
+void *slab_group::alloc()
+{
+    if (magazine_size > 0)
     {
-        if (page_addr == (char *)*it)
+        uctx::UninterruptibleContext icu;
+        slab_cpu_cache *cache = get_cpu_cache();
+        if (likely(cache != nullptr))
         {
-            auto &e = **it;
-            e.bitmap.clean(((char *)ptr - e.data_ptr) / obj_align_size);
-            e.rest++;
-            all_obj_used--;
-            list_partial.push_back(*it);
-            list_full.remove(it);
-            return;
+            void *ptr = magazine_alloc(cache);
+            if (likely(ptr != nullptr))
+                return ptr;
         }
     }
-    trace::panic("Unreachable control flow.");
+    return slab_alloc();
 }
 
-bool slab_group::include_address(void *ptr)
+void slab_group::free(void *ptr)
 {
-    uctx::RawReadLockUninterruptibleContext ctx(slab_lock);
-
-    char *page_addr = (char *)((u64)ptr & ~(memory::page_size * page_pre_slab - 1));
-    for (auto e : list_full)
+    if (magazine_size > 0)
     {
-        if (page_addr == (char *)e)
-            return true;
+        uctx::UninterruptibleContext icu;
+        slab_cpu_cache *cache = get_cpu_cache();
+        if (likely(cache != nullptr) && magazine_free(cache, ptr))
+            return;
     }
+    slab_free(ptr);
+}
 
-    for (auto e : list_partial)
+void slab_group::set_magazine_size(u32 rounds)
+{
+    if (cpu_cache_index >= slab_cpu_cache_max_groups)
+        return;
+    if (rounds > slab_magazine_max_rounds)
+        rounds = slab_magazine_max_rounds;
+    magazine_size = rounds;
+}
+
+void slab_group::drain_magazine(slab_magazine *mag)
+{
+    for (u32 i = 0; i < mag->rounds; i++)
+        slab_free(mag->objects[i]);
+    mag->~slab_magazine();
+    slab_magazine_group->free(mag);
+}
+
+u64 slab_group::shrink()
+{
+    slab_magazine *mag;
+    while ((mag = depot_pop(depot_full, depot_full_count)) != nullptr)
+        drain_magazine(mag);
+    while ((mag = depot_pop(depot_empty, depot_empty_count)) != nullptr)
+        drain_magazine(mag);
+
+    if (magazine_size > 0)
     {
-        if (page_addr == (char *)e)
-            return true;
+        // the magazines of other cpus are only touched by their owner
+        uctx::UninterruptibleContext icu;
+        slab_cpu_cache *cache = get_cpu_cache();
+        if (cache != nullptr)
+        {
+            if (cache->loaded != nullptr)
+                drain_magazine(cache->loaded);
+            if (cache->previous != nullptr)
+                drain_magazine(cache->previous);
+            cache->loaded = nullptr;
+            cache->previous = nullptr;
+        }
     }
 
-    for (auto e : list_empty)
+    uctx::RawWriteLockUninterruptibleContext ctx(slab_lock);
+    u64 pages = 0;
+    while (!list_empty.empty())
     {
-        if (page_addr == (char *)e)
-            return true;
+        slab *s = list_empty.pop_back();
+        delete_memory_node(s);
+        pages += page_pre_slab;
     }
+    return pages;
+}
 
-    return false;
+bool slab_group::include_address(void *ptr)
+{
+    page_t *page = virt_addr_to_page(ptr);
+    return page != nullptr && (page->flags & page_flags::slab) && page->slab_group_owner == this;
 }
 
 slab_group_list_t::iterator slab_cache_pool::find_slab_group_node(const char *name)
 {
-    uctx::RawReadLockUninterruptibleContext ctx(group_lock);
-
     auto group = slab_groups.begin();
     while (group != slab_groups.end())
     {
@@ -224,10 +447,11 @@ slab_group *slab_cache_pool::find_slab_group(u64 size)
     return nullptr;
 }
 
-slab_group *slab_cache_pool::create_new_slab_group(u64 size, const char *name, u64 align, u64 flags)
+slab_group *slab_cache_pool::create_new_slab_group(u64 size, const char *name, u64 align, u64 flags,
+                                                   slab_obj_func ctor, slab_obj_func dtor)
 {
     uctx::RawWriteLockUninterruptibleContext ctx(group_lock);
-    return &slab_groups.emplace_back(&slab_list_node_allocator, size, name, align, flags);
+    return &slab_groups.emplace_back(&slab_list_node_allocator, size, name, align, flags, ctor, dtor);
 }
 
 void slab_cache_pool::remove_slab_group(slab_group *slab_obj)
@@ -246,9 +470,12 @@ void slab_cache_pool::remove_slab_group(slab_group *slab_obj)
     }
 }
 
+lock::lock_stat_t slab_group_lock_stat("slab_group");
+
 slab_cache_pool::slab_cache_pool()
     : slab_groups(memory::KernelBuddyAllocatorV)
 {
+    group_lock.set_stat(&slab_group_lock_stat);
 }
 
 void *SlabObjectAllocator::allocate(u64 size, u64 align)
@@ -261,4 +488,43 @@ void *SlabObjectAllocator::allocate(u64 size, u64 align)
 
 void SlabObjectAllocator::deallocate(void *ptr) { slab_obj->free(ptr); };
 
-} // namespace memory
\ No newline at end of file
+u64 slab_cache_pool::shrink(u64 nr_pages)
+{
+    uctx::RawReadLockUninterruptibleContext ctx(group_lock);
+    u64 freed = 0;
+    for (auto &group : slab_groups)
+    {
+        if (freed >= nr_pages)
+            break;
+        if (group.get_reclaimable_count() > 0)
+            freed += group.shrink();
+    }
+    return freed;
+}
+
+u64 slab_cache_pool::get_reclaimable_count()
+{
+    uctx::RawReadLockUninterruptibleContext ctx(group_lock);
+    u64 count = 0;
+    for (auto &group : slab_groups)
+        count += group.get_reclaimable_count();
+    return count;
+}
+
+u64 slab_shrink_count(u64 user_data)
+{
+    return global_kmalloc_slab_domain->get_reclaimable_count() + global_dma_slab_domain->get_reclaimable_count() +
+           global_object_slab_domain->get_reclaimable_count();
+}
+
+u64 slab_shrink_scan(u64 nr_pages, u64 user_data)
+{
+    u64 freed = global_kmalloc_slab_domain->shrink(nr_pages);
+    if (freed < nr_pages)
+        freed += global_dma_slab_domain->shrink(nr_pages - freed);
+    if (freed < nr_pages)
+        freed += global_object_slab_domain->shrink(nr_pages - freed);
+    return freed;
+}
+
+} // namespace memory
@@ -0,0 +1,114 @@
+#include "kernel/mm/stat.hpp"
+#include "kernel/cpu.hpp"
+#include "kernel/mm/buddy.hpp"
+#include "kernel/mm/memory.hpp"
+#include "kernel/mm/slab.hpp"
+#include "kernel/ucontext.hpp"
+#include "kernel/util/text_writer.hpp"
+
+namespace memory
+{
+
+void slab_pool_info(util::text_writer &writer, slab_cache_pool *pool)
+{
+    u64 cpu_count = cpu::count();
+    uctx::RawReadLockUninterruptibleContext ctx(pool->get_group_lock());
+    for (auto &group : pool->get_slab_groups())
+    {
+        u64 cached = group.get_depot_obj_count();
+        for (u32 i = 0; i < cpu_count; i++)
+        {
+            auto cache = group.get_cpu_cache(i);
+            if (cache == nullptr)
+                continue;
+            if (cache->loaded != nullptr)
+                cached += cache->loaded->rounds;
+            if (cache->previous != nullptr)
+                cached += cache->previous->rounds;
+        }
+        u64 used = group.get_obj_used();
+        writer.put(group.get_name(), 24);
+        writer.put(group.get_size(), 8);
+        writer.put(group.get_obj_count(), 10);
+        writer.put(used > cached ? used - cached : 0, 10);
+        writer.put(cached, 10);
+        writer.put(group.get_slab_count(), 8);
+        writer.put(group.get_obj_per_slab(), 10);
+        writer.put(group.get_page_per_slab(), 11);
+        writer.put(group.get_magazine_size());
+        writer.put("\n");
+    }
+}
+
+u64 slab_info(char *buffer, u64 size)
+{
+    util::text_writer writer(buffer, size);
+    writer.put("name                    size    objs      active    cpu_cache slabs   obj/slab  pages/slab magazine\n");
+    slab_pool_info(writer, global_kmalloc_slab_domain);
+    slab_pool_info(writer, global_dma_slab_domain);
+    slab_pool_info(writer, global_object_slab_domain);
+    return writer.pos;
+}
+
+/// Fragmentation index of an allocation of 2^order pages in per mille, -1000 if a free block is large enough.
+/// Towards 0 the allocation fails for lack of memory, towards 1000 it fails because of fragmentation.
+i64 fragmentation_index(buddy *b, u32 order)
+{
+    u64 blocks = 0;
+    for (u32 i = 0; i < buddy_max_order; i++)
+    {
+        if (i >= order && b->get_free_blocks(i) > 0)
+            return -1000;
+        blocks += b->get_free_blocks(i);
+    }
+    if (blocks == 0)
+        return 0;
+    u64 requested = 1ul << order;
+    return 1000 - (i64)((1000 + b->get_free_pages() * 1000 / requested) / blocks);
+}
+
+u64 buddy_info(char *buffer, u64 size)
+{
+    util::text_writer writer(buffer, size);
+    for (int i = 0; i < global_zones.count; i++)
+    {
+        auto &zone = global_zones.zones[i];
+        auto b = (buddy *)zone.buddy_impl;
+        writer.put("zone ");
+        writer.put(i, 4);
+        writer.put(zone.type == zone_type_t::dma ? "dma" : "normal", 8);
+        writer.put("pages ");
+        writer.put(zone.page_count, 10);
+        writer.put("free ");
+        writer.put(b->get_free_pages());
+        writer.put("\n  free blocks ");
+        for (u32 order = 0; order < buddy_max_order; order++)
+            writer.put(b->get_free_blocks(order), 7);
+        writer.put("\n  frag index  ");
+        for (u32 order = 0; order < buddy_max_order; order++)
+            writer.put_fraction(fragmentation_index(b, order), 7);
+        writer.put("\n");
+    }
+
+    writer.put("cpu  hot   cold  alloc       free        refill      refill_pages drain       drain_pages\n");
+    u64 cpu_count = cpu::count();
+    for (u32 i = 0; i < cpu_count; i++)
+    {
+        auto cache = (page_cpu_cache *)cpu::get(i).get_page_cpu_cache();
+        if (cache == nullptr)
+            continue;
+        writer.put(i, 5);
+        writer.put(cache->hot_count, 6);
+        writer.put(cache->cold_count, 6);
+        writer.put(cache->alloc_times, 12);
+        writer.put(cache->free_times, 12);
+        writer.put(cache->refill_times, 12);
+        writer.put(cache->refill_pages, 13);
+        writer.put(cache->drain_times, 12);
+        writer.put(cache->drain_pages);
+        writer.put("\n");
+    }
+    return writer.pos;
+}
+
+} // namespace memory
@@ -2,17 +2,26 @@
 #include "kernel/arch/exception.hpp"
 #include "kernel/arch/idt.hpp"
 #include "kernel/arch/paging.hpp"
+#include "kernel/arch/regs.hpp"
 #include "kernel/cpu.hpp"
+#include "kernel/fs/vfs/dentry.hpp"
 #include "kernel/fs/vfs/file.hpp"
+#include "kernel/fs/vfs/inode.hpp"
+#include "kernel/fs/vfs/page_cache.hpp"
 #include "kernel/fs/vfs/vfs.hpp"
 #include "kernel/irq.hpp"
 #include "kernel/mm/memory.hpp"
+#include "kernel/smp.hpp"
 #include "kernel/task.hpp"
 #include "kernel/trace.hpp"
 #include "kernel/ucontext.hpp"
 
 namespace memory::vm
 {
+/// page fault error code bits
+const u64 page_fault_present = 1;
+const u64 page_fault_write = 2;
+
 irq::request_result _ctx_interrupt_ page_fault_func(const void *regs, u64 extra_data, u64 user_data)
 {
     auto *thread = cpu::current().get_task();
@@ -28,14 +37,27 @@ irq::request_result _ctx_interrupt_ page_fault_func(const void *regs, u64 extra_
         auto vm = info->vma.get_vm_area(extra_data);
         if (vm != nullptr)
         {
-            if (vm->handle != nullptr)
+            u64 error_code = ((const regs_t *)regs)->error_code;
+            if ((error_code & (page_fault_present | page_fault_write)) == (page_fault_present | page_fault_write))
+            {
+                // write to a mapped page, only a copy-on-write frame can be resolved
+                if (!(vm->flags & flags::writeable) || !info->mmu_paging.copy_on_write(vm, extra_data))
+                {
+                    return irq::request_result::no_handled;
+                }
+                info->minor_faults++;
+            }
+            else if (vm->handle != nullptr)
             {
                 if (!vm->handle(extra_data, vm))
                 {
                     return irq::request_result::no_handled;
                 }
+                // fill_file_vm counts its own faults
+                if (!(vm->flags & flags::file))
+                    info->minor_faults++;
             }
-            arch::paging::reload();
+            // not present entries aren't cached, and the fault has dropped the entry it faulted on
             return irq::request_result::ok;
         }
     }
@@ -62,6 +84,29 @@ template <typename _T> void delete_page_table(_T *addr)
     memory::Delete<_T>(memory::KernelBuddyAllocatorV, addr);
 }
 
+void share_frame(void *phy_addr)
+{
+    auto page = memory::phy_addr_to_page(phy_addr);
+    if (page != nullptr)
+        page->share_count++;
+}
+
+/// drop a mapping of a 4kb frame, the last address space mapping it frees it
+void release_frame(void *phy_addr)
+{
+    auto page = memory::phy_addr_to_page(phy_addr);
+    if (page != nullptr)
+    {
+        u32 count = page->share_count.load(std::memory_order_relaxed);
+        while (count > 0)
+        {
+            if (page->share_count.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel))
+                return;
+        }
+    }
+    memory::free_page(memory::kernel_phyaddr_to_virtaddr(phy_addr));
+}
+
 int search_vma(const vm_t &vm, u64 p)
 {
     if (p >= vm.end)
@@ -156,11 +201,77 @@ const vm_t *vm_allocator::get_vm_area(u64 p)
     return &it;
 }
 
-mmu_paging::mmu_paging() { base_paging_addr = new_page_table<arch::paging::base_paging_t>(); }
+std::atomic_uint64_t mmu_context_id = 1;
+
+mmu_paging::mmu_paging()
+    : tlb_generation(0)
+{
+    base_paging_addr = new_page_table<arch::paging::base_paging_t>();
+    context_id = mmu_context_id++;
+}
 
 mmu_paging::~mmu_paging() { delete_page_table((arch::paging::base_paging_t *)base_paging_addr); }
 
-void mmu_paging::load_paging() { arch::paging::load((arch::paging::base_paging_t *)base_paging_addr); }
+void mmu_paging::load_paging()
+{
+    arch::paging::load_context((arch::paging::base_paging_t *)base_paging_addr, context_id, tlb_generation);
+}
+
+void mmu_paging::flush_tlb_range(u64 start, u64 end)
+{
+    tlb_generation++;
+    SMP::flush_tlb_range(this == &memory::kernel_vm_info->mmu_paging ? 0 : context_id, start, end);
+}
+
+void mmu_paging::flush_tlb() { flush_tlb_range(0, (u64)-1); }
+
+/// frames freed by one shootdown
+const u32 unmap_batch_size = 32;
+/// tag of a 2MB frame in an unmap batch, frame addresses are page aligned
+const u64 unmap_batch_huge = 1;
+
+/// Frames unmapped from an address space, freed after one shootdown of the span they were mapped at.
+struct unmap_batch_t
+{
+    mmu_paging &paging;
+    u64 start = 0;
+    u64 end = 0;
+    u32 count = 0;
+    u64 frames[unmap_batch_size];
+
+    explicit unmap_batch_t(mmu_paging &paging)
+        : paging(paging)
+    {
+    }
+
+    void add(u64 vir, u64 size, void *phy, bool huge_frame)
+    {
+        if (count == unmap_batch_size)
+            flush();
+        if (count == 0 || vir < start)
+            start = vir;
+        if (count == 0 || vir + size > end)
+            end = vir + size;
+        frames[count] = (u64)phy | (huge_frame ? unmap_batch_huge : 0);
+        count++;
+    }
+
+    void flush()
+    {
+        if (count == 0)
+            return;
+        paging.flush_tlb_range(start, end);
+        for (u32 i = 0; i < count; i++)
+        {
+            void *phy = (void *)(frames[i] & ~unmap_batch_huge);
+            if (frames[i] & unmap_batch_huge)
+                memory::KernelBuddyAllocatorV->deallocate(memory::kernel_phyaddr_to_virtaddr(phy));
+            else
+                release_frame(phy);
+        }
+        count = 0;
+    }
+};
 
 void mmu_paging::map_area(const vm_t *vm)
 {
@@ -208,24 +319,50 @@ void mmu_paging::map_area_phy(const vm_t *vm, void *phy_address_start)
     }
 }
 
+void mmu_paging::split_huge_area(u64 start)
+{
+    void *phy;
+    arch::paging::get_map_address((arch::paging::base_paging_t *)base_paging_addr, (void *)start, &phy);
+    arch::paging::split_big_page((arch::paging::base_paging_t *)base_paging_addr, (void *)start);
+    memory::KernelBuddyAllocatorV->split(memory::kernel_phyaddr_to_virtaddr(phy));
+}
+
 void mmu_paging::unmap_area(const vm_t *vm)
 {
     if (unlikely(vm == nullptr))
         return;
-    uctx::UninterruptibleContext uic;
+    uctx::RawSpinLockUninterruptibleContext ctx(lock);
+    auto base = (arch::paging::base_paging_t *)base_paging_addr;
+    unmap_batch_t batch(*this);
     if (vm->flags & flags::expand)
     {
-        u64 page_count = (vm->end - vm->start) / page_size;
-        for (u64 i = 0; i < page_count; i++)
+        u64 vir = vm->start;
+        while (vir < vm->end)
         {
-            auto vir = (void *)(vm->start + i * page_size);
             void *phy;
-            if (arch::paging::get_map_address((arch::paging::base_paging_t *)base_paging_addr, vir, &phy))
+            u64 frame_size = arch::paging::get_map_frame_size(base, (void *)vir);
+            if (frame_size == arch::paging::frame_size::size_2mb)
             {
-                arch::paging::unmap((arch::paging::base_paging_t *)base_paging_addr, (void *)vir,
-                                    arch::paging::frame_size::size_4kb, 1);
-                memory::free_page(memory::kernel_phyaddr_to_virtaddr(phy));
+                u64 start = vir & ~(huge_page_size - 1);
+                if (start < vm->start || start + huge_page_size > vm->end)
+                {
+                    // only a part of the window goes away, unmap it page by page
+                    split_huge_area(start);
+                    continue;
+                }
+                arch::paging::get_map_address(base, (void *)vir, &phy);
+                arch::paging::unmap(base, (void *)start, arch::paging::frame_size::size_2mb, 1);
+                batch.add(start, huge_page_size, phy, true);
+                vir = start + huge_page_size;
+                continue;
             }
+            if (frame_size == arch::paging::frame_size::size_4kb)
+            {
+                arch::paging::get_map_address(base, (void *)vir, &phy);
+                arch::paging::unmap(base, (void *)vir, arch::paging::frame_size::size_4kb, 1);
+                batch.add(vir, page_size, phy, false);
+            }
+            vir += page_size;
         }
     }
     else
@@ -235,18 +372,246 @@ void mmu_paging::unmap_area(const vm_t *vm)
         {
             auto vir = (void *)(vm->start + i * page_size);
             void *phy;
-            if (arch::paging::get_map_address((arch::paging::base_paging_t *)base_paging_addr, vir, &phy))
+            if (arch::paging::get_map_address(base, vir, &phy))
             {
-                memory::free_page(memory::kernel_phyaddr_to_virtaddr(phy));
+                arch::paging::unmap(base, vir, arch::paging::frame_size::size_4kb, 1);
+                batch.add((u64)vir, page_size, phy, false);
             }
             else
             {
                 trace::panic("mmu_paging umap failed! This is not a expand vm_area.");
             }
         }
-        arch::paging::unmap((arch::paging::base_paging_t *)base_paging_addr, (void *)vm->start,
-                            arch::paging::frame_size::size_4kb, page_count);
     }
+    batch.flush();
+}
+
+u64 page_attributes(const vm_t *vm)
+{
+    u64 attr = 0;
+    if (vm->flags & flags::writeable)
+        attr |= arch::paging::flags::writable;
+    if (vm->flags & flags::user_mode)
+        attr |= arch::paging::flags::user_mode;
+    return attr;
+}
+
+bool mmu_paging::map_anonymous_page(const vm_t *vm, u64 page_addr, u64 limit)
+{
+    auto base = (arch::paging::base_paging_t *)base_paging_addr;
+    u64 start = page_addr & ~(huge_page_size - 1);
+    page_addr &= ~(page_size - 1);
+    void *phy;
+    bool huge = (vm->flags & flags::huge_page) && start >= vm->start && start + huge_page_size <= limit;
+    if (huge)
+    {
+        uctx::RawSpinLockUninterruptibleContext ctx(lock);
+        // another thread has mapped it
+        if (arch::paging::get_map_address(base, (void *)page_addr, &phy))
+            return true;
+        huge = arch::paging::get_page_table_entries(base, (void *)start) == 0;
+    }
+    if (huge)
+    {
+        byte *ptr = (byte *)memory::KernelBuddyAllocatorV->allocate(huge_page_size, huge_page_size);
+        if (likely(ptr != nullptr))
+        {
+            // zeroed without the lock, the window is checked again before it's mapped
+            util::memzero(ptr, huge_page_size);
+            uctx::RawSpinLockUninterruptibleContext ctx(lock);
+            if (arch::paging::get_map_address(base, (void *)page_addr, &phy))
+            {
+                memory::KernelBuddyAllocatorV->deallocate(ptr);
+                return true;
+            }
+            if (arch::paging::get_page_table_entries(base, (void *)start) == 0)
+            {
+                arch::paging::map(base, (void *)start, memory::kernel_virtaddr_to_phyaddr(ptr),
+                                  arch::paging::frame_size::size_2mb, 1, page_attributes(vm));
+                return true;
+            }
+            memory::KernelBuddyAllocatorV->deallocate(ptr);
+        }
+        // no order 9 block is free or a 4kb page of the window has been mapped, fall back to 4kb pages
+    }
+    byte *ptr = (byte *)memory::malloc_page();
+    if (unlikely(ptr == nullptr))
+        return false;
+    util::memzero(ptr, page_size);
+    uctx::RawSpinLockUninterruptibleContext ctx(lock);
+    if (arch::paging::get_map_address(base, (void *)page_addr, &phy))
+    {
+        memory::free_page(ptr);
+        return true;
+    }
+    arch::paging::map(base, (void *)page_addr, memory::kernel_virtaddr_to_phyaddr(ptr),
+                      arch::paging::frame_size::size_4kb, 1, page_attributes(vm));
+    return true;
+}
+
+void mmu_paging::map_new_pages(const vm_t *vm, u64 start, void *const *pages, u64 count, u64 read_only)
+{
+    auto base = (arch::paging::base_paging_t *)base_paging_addr;
+    for (u64 i = 0; i < count; i++)
+    {
+        void *phy;
+        void *addr = (void *)(start + i * page_size);
+        if (arch::paging::get_map_address(base, addr, &phy))
+        {
+            release_frame(memory::kernel_virtaddr_to_phyaddr(pages[i]));
+            continue;
+        }
+        u64 attr = page_attributes(vm);
+        if (read_only & (1ul << i))
+            attr &= ~arch::paging::flags::writable;
+        arch::paging::map(base, addr, memory::kernel_virtaddr_to_phyaddr(pages[i]), arch::paging::frame_size::size_4kb,
+                          1, attr);
+    }
+}
+
+/// collect the frames of a window fully populated by unshared 4kb pages and write protect them, lock must be held
+bool protect_window(arch::paging::base_paging_t *base, u64 start, void **frames)
+{
+    const u64 pages = huge_page_size / page_size;
+    if (arch::paging::get_page_table_entries(base, (void *)start) != pages)
+        return false;
+    for (u64 i = 0; i < pages; i++)
+    {
+        void *phy = arch::paging::get_pte(base, (void *)(start + i * page_size))->get_phy_addr();
+        auto page = memory::phy_addr_to_page(phy);
+        // a frame shared with another address space after a fork can't be moved
+        if (page != nullptr && page->share_count.load(std::memory_order_relaxed) > 0)
+            return false;
+        frames[i] = memory::kernel_phyaddr_to_virtaddr(phy);
+    }
+    // a write while the pages are copied faults, copy_on_write makes the page writable again
+    for (u64 i = 0; i < pages; i++)
+        arch::paging::get_pte(base, (void *)(start + i * page_size))->clear_writable();
+    return true;
+}
+
+bool mmu_paging::collapse_huge_area(const vm_t *vm, u64 start)
+{
+    auto base = (arch::paging::base_paging_t *)base_paging_addr;
+    const u64 pages = huge_page_size / page_size;
+    byte *huge = (byte *)memory::KernelBuddyAllocatorV->allocate(huge_page_size, huge_page_size);
+    if (huge == nullptr)
+        return false;
+    // 512 pointers fill one page
+    void **frames = (void **)memory::malloc_page();
+    if (frames == nullptr)
+    {
+        memory::KernelBuddyAllocatorV->deallocate(huge);
+        return false;
+    }
+
+    bool collapsed = false;
+    {
+        uctx::RawSpinLockUninterruptibleContext ctx(lock);
+        collapsed = protect_window(base, start, frames);
+        if (collapsed)
+            flush_tlb_range(start, start + huge_page_size);
+    }
+    if (!collapsed)
+    {
+        memory::free_page(frames);
+        memory::KernelBuddyAllocatorV->deallocate(huge);
+        return false;
+    }
+
+    for (u64 i = 0; i < pages; i++)
+        util::memcopy(huge + i * page_size, frames[i], page_size);
+
+    {
+        uctx::RawSpinLockUninterruptibleContext ctx(lock);
+        // the window is only unmapped under the vma lock held by the caller
+        collapsed = true;
+        for (u64 i = 0; i < pages; i++)
+        {
+            auto pte = arch::paging::get_pte(base, (void *)(start + i * page_size));
+            void *phy = pte->get_phy_addr();
+            auto page = memory::phy_addr_to_page(phy);
+            if (memory::kernel_phyaddr_to_virtaddr(phy) != frames[i] || pte->is_writable() ||
+                (page != nullptr && page->share_count.load(std::memory_order_relaxed) > 0))
+            {
+                collapsed = false;
+                break;
+            }
+        }
+        if (collapsed)
+        {
+            arch::paging::unmap(base, (void *)start, arch::paging::frame_size::size_4kb, pages);
+            flush_tlb_range(start, start + huge_page_size);
+            arch::paging::map(base, (void *)start, memory::kernel_virtaddr_to_phyaddr(huge),
+                              arch::paging::frame_size::size_2mb, 1, page_attributes(vm));
+        }
+        else if (vm->flags & flags::writeable)
+        {
+            // give the write access back to the pages neither written nor shared meanwhile
+            for (u64 i = 0; i < pages; i++)
+            {
+                auto pte = arch::paging::get_pte(base, (void *)(start + i * page_size));
+                auto page = memory::phy_addr_to_page(pte->get_phy_addr());
+                if (page == nullptr || page->share_count.load(std::memory_order_relaxed) == 0)
+                    pte->set_writable();
+            }
+        }
+    }
+    if (collapsed)
+    {
+        memory::KernelBuddyAllocatorV->deallocate_pages(frames, pages);
+        memory::free_page(frames);
+        return true;
+    }
+    memory::free_page(frames);
+    memory::KernelBuddyAllocatorV->deallocate(huge);
+    return false;
+}
+
+void mmu_paging::copy_area(mmu_paging &parent, const vm_t *vm)
+{
+    auto parent_base = (arch::paging::base_paging_t *)parent.base_paging_addr;
+    if (vm->flags & flags::huge_page)
+    {
+        // share 4kb frames only, a write copies one page instead of a 2MB frame
+        for (u64 start = vm->start & ~(huge_page_size - 1); start < vm->end; start += huge_page_size)
+        {
+            if (arch::paging::get_map_frame_size(parent_base, (void *)start) == arch::paging::frame_size::size_2mb)
+                parent.split_huge_area(start);
+        }
+    }
+    bool write_protect = (vm->flags & (flags::writeable | flags::shared)) == flags::writeable;
+    arch::paging::copy_page_table((arch::paging::base_paging_t *)base_paging_addr, parent_base, vm->start, vm->end,
+                                  write_protect, share_frame);
+}
+
+bool mmu_paging::copy_on_write(const vm_t *vm, u64 page_addr)
+{
+    auto base = (arch::paging::base_paging_t *)base_paging_addr;
+    uctx::RawSpinLockUninterruptibleContext ctx(lock);
+    auto pte = arch::paging::get_pte(base, (void *)(page_addr & ~(page_size - 1)));
+    // unmapped or resolved by another thread, fault again
+    if (pte == nullptr || pte->is_writable())
+        return true;
+
+    void *phy = pte->get_phy_addr();
+    auto page = memory::phy_addr_to_page(phy);
+    if (page != nullptr && page->share_count.load(std::memory_order_acquire) > 0)
+    {
+        byte *ptr = (byte *)memory::malloc_page();
+        if (unlikely(ptr == nullptr))
+            return false;
+        util::memcopy(ptr, memory::kernel_phyaddr_to_virtaddr(phy), page_size);
+        pte->set_addr(ptr);
+        pte->set_writable();
+        // other threads of this address space may still read the old frame
+        flush_tlb_range(page_addr & ~(page_size - 1), (page_addr & ~(page_size - 1)) + page_size);
+        release_frame(phy);
+        return true;
+    }
+    // the other address spaces have dropped the frame, take it over
+    pte->set_writable();
+    return true;
 }
 
 void *mmu_paging::get_page_addr() { return base_paging_addr; }
@@ -259,30 +624,102 @@ void mmu_paging::sync_kernel()
         (arch::paging::base_paging_t *)memory::kernel_vm_info->mmu_paging.base_paging_addr);
 }
 
+void writeback_file_vm(info_t *info, const vm_t *vm);
+
+lock::spinlock_t huge_page_scan_lock;
+/// every info_t, walked by collapse_huge_pages
+info_t *huge_page_scan_list = nullptr;
+
 info_t::info_t()
     : vma(memory::user_mmap_top_address, memory::user_code_bottom_address)
     , head_vm(nullptr)
+    , major_faults(0)
+    , minor_faults(0)
     , current_head_ptr(0)
+    , scan_prev(nullptr)
+    , scan_refs(0)
 {
+    uctx::RawSpinLockUninterruptibleContext ctx(huge_page_scan_lock);
+    scan_next = huge_page_scan_list;
+    if (scan_next != nullptr)
+        scan_next->scan_prev = this;
+    huge_page_scan_list = this;
 }
 
 info_t::~info_t()
 {
+    for (;;)
+    {
+        {
+            uctx::RawSpinLockUninterruptibleContext ctx(huge_page_scan_lock);
+            if (scan_refs == 0)
+            {
+                if (scan_prev != nullptr)
+                    scan_prev->scan_next = scan_next;
+                else
+                    huge_page_scan_list = scan_next;
+                if (scan_next != nullptr)
+                    scan_next->scan_prev = scan_prev;
+                break;
+            }
+        }
+        // a collapse pass is copying a window of this info
+        cpu_pause();
+        SMP::answer_tlb_shootdown();
+    }
     uctx::RawWriteLockUninterruptibleContext ctx(vma.get_lock());
     auto &list = vma.get_list();
     for (auto it = list.begin(); it != list.end(); ++it)
     {
+        writeback_file_vm(this, &it);
         mmu_paging.unmap_area(&it);
     }
 }
 
+bool info_t::fork_from(info_t *parent)
+{
+    uctx::RawReadLockUninterruptibleContext vma_ctx(parent->vma.get_lock());
+    auto &list = parent->vma.get_list();
+    for (auto it = list.begin(); it != list.end(); ++it)
+    {
+        const vm_t *vm = &it;
+        u64 user_data = vm->user_data;
+        if (vm->flags & flags::file)
+        {
+            map_t *mt = (map_t *)user_data;
+            user_data = (u64)memory::New<map_t>(memory::KernelCommonAllocatorV, mt->file, mt->offset, mt->length, this);
+        }
+        auto new_vm = vma.add_map(vm->start, vm->end, vm->flags, vm->handle, user_data);
+        if (unlikely(new_vm == nullptr))
+            return false;
+        if (vm == parent->head_vm)
+        {
+            head_vm = new_vm;
+            current_head_ptr = parent->current_head_ptr;
+        }
+    }
+
+    {
+        // the page tables are copied after the vma, a collapse pass holds the vma lock of this info before its
+        // paging lock
+        uctx::RawSpinLockUninterruptibleContext ctx(parent->mmu_paging.get_lock());
+        uctx::RawSpinLockUninterruptibleContext child_ctx(mmu_paging.get_lock());
+        for (auto it = list.begin(); it != list.end(); ++it)
+        {
+            mmu_paging.copy_area(parent->mmu_paging, &it);
+        }
+    }
+    parent->mmu_paging.flush_tlb();
+    return true;
+}
+
 bool head_expand_vm(u64 page_addr, const vm_t *item);
 
 void info_t::init_brk(u64 start)
 {
     head_vm = vma.add_map(start, start + memory::user_head_size,
                           memory::vm::flags::readable | memory::vm::flags::writeable | memory::vm::flags::expand |
-                              memory::vm::flags::user_mode,
+                              memory::vm::flags::user_mode | memory::vm::flags::huge_page,
                           memory::vm::head_expand_vm, 0);
     if (likely(head_vm))
         current_head_ptr = head_vm->start;
@@ -319,14 +756,10 @@ u64 info_t::get_brk() { return current_head_ptr; }
 bool head_expand_vm(u64 page_addr, const vm_t *item)
 {
     auto info = (info_t *)task::current_process()->mm_info;
-    if (info->get_brk() > page_addr)
+    u64 brk = info->get_brk();
+    if (brk > page_addr)
     {
-        vm_t vm = *item;
-        vm.start = (page_addr) & ~(memory::page_size - 1);
-        vm.end = vm.start + memory::page_size;
-        byte *ptr = (byte *)memory::malloc_page();
-        info->mmu_paging.map_area_phy(&vm, memory::kernel_virtaddr_to_phyaddr(ptr));
-        return true;
+        return info->mmu_paging.map_anonymous_page(item, page_addr, brk);
     }
     return false;
 }
@@ -337,39 +770,212 @@ bool fill_expand_vm(u64 page_addr, const vm_t *item)
 
     if (item->flags & flags::expand)
     {
-        vm_t vm = *item;
-        vm.start = (page_addr) & ~(memory::page_size - 1);
-        vm.end = vm.start + memory::page_size;
-        byte *ptr = (byte *)memory::malloc_page();
-        info->mmu_paging.map_area_phy(&vm, memory::kernel_virtaddr_to_phyaddr(ptr));
-        return true;
+        return info->mmu_paging.map_anonymous_page(item, page_addr, item->end);
     }
     return false;
 }
 
+u64 collapse_huge_pages(u64 max_windows)
+{
+    u64 collapsed = 0;
+    info_t *info = nullptr;
+    if (max_windows > 0)
+    {
+        uctx::RawSpinLockUninterruptibleContext ctx(huge_page_scan_lock);
+        info = huge_page_scan_list;
+        if (info != nullptr)
+            info->scan_refs++;
+    }
+    while (info != nullptr)
+    {
+        {
+            // the scan lock is dropped while copying, the pin keeps info alive and linked
+            uctx::RawReadLockUninterruptibleContext vma_ctx(info->vma.get_lock());
+            auto &list = info->vma.get_list();
+            for (auto it = list.begin(); it != list.end() && collapsed < max_windows; ++it)
+            {
+                const vm_t *vm = &it;
+                if ((vm->flags & (flags::huge_page | flags::expand | flags::file)) !=
+                    (flags::huge_page | flags::expand))
+                    continue;
+                u64 end = vm == info->head_vm ? info->get_brk() : vm->end;
+                u64 start = (vm->start + huge_page_size - 1) & ~(huge_page_size - 1);
+                for (; start + huge_page_size <= end && collapsed < max_windows; start += huge_page_size)
+                {
+                    if (info->mmu_paging.collapse_huge_area(vm, start))
+                        collapsed++;
+                }
+            }
+        }
+        uctx::RawSpinLockUninterruptibleContext ctx(huge_page_scan_lock);
+        info_t *next = collapsed < max_windows ? info->scan_next : nullptr;
+        if (next != nullptr)
+            next->scan_refs++;
+        info->scan_refs--;
+        info = next;
+    }
+    return collapsed;
+}
+
+static_assert(file_fault_around_pages <= 64, "a read only mask covers a window");
+
+/// the page cache of the file of a file vm, nullptr if the file has none or the offset isn't page aligned
+fs::vfs::page_cache *file_vm_cache(const vm_t *vm)
+{
+    map_t *mt = (map_t *)vm->user_data;
+    if (mt->offset & (page_size - 1))
+        return nullptr;
+    return mt->file->get_entry()->get_inode()->get_page_cache();
+}
+
+/// map the pages of [start, end) of a file vm which are still unmapped
+///
+/// Pages of the file are the frames of its page cache, a private writeable vm maps them read only to copy them on
+/// write. The page holding the end of a private mapping is a copy zeroed after the end, a page after the end is
+/// zeroed. A file without page cache is read into private pages.
+///
+/// \param io set if a page has been read from the file
+/// \return count of pages got from start, less than the window if no page is free
+u64 map_file_window(const vm_t *vm, u64 start, u64 end, bool *io)
+{
+    map_t *mt = (map_t *)vm->user_data;
+    auto cache = file_vm_cache(vm);
+    bool shared = vm->flags & flags::shared;
+    void *pages[file_fault_around_pages];
+    u64 read_only = 0;
+    u64 count = (end - start) / page_size;
+    u64 data_end = vm->start + mt->length;
+    u64 file_size = mt->file->size();
+    if (cache == nullptr)
+    {
+        // one seek for the window, the pages are read one after another
+        mt->file->move(mt->offset + (start - vm->start));
+    }
+    u64 n = 0;
+    for (; n < count; n++)
+    {
+        u64 addr = start + n * page_size;
+        u64 offset = mt->offset + (addr - vm->start);
+        byte *cached = nullptr;
+        if (cache != nullptr && addr < data_end && offset < file_size)
+        {
+            cached = cache->get_page(offset / page_size, io);
+            if (unlikely(cached == nullptr))
+                break;
+            if (shared || addr + page_size <= data_end)
+            {
+                pages[n] = cached;
+                if (!shared)
+                    read_only |= 1ul << n;
+                continue;
+            }
+        }
+
+        byte *ptr = (byte *)memory::malloc_page();
+        if (unlikely(ptr == nullptr))
+        {
+            if (cached != nullptr)
+                cache->put_page(cached);
+            break;
+        }
+        i64 ksize = 0;
+        if (cached != nullptr)
+        {
+            ksize = data_end - addr;
+            util::memcopy(ptr, cached, ksize);
+            cache->put_page(cached);
+        }
+        else if (cache == nullptr && addr < data_end)
+        {
+            ksize = mt->file->read(ptr, data_end - addr > page_size ? page_size : data_end - addr, 0);
+            if (ksize < 0)
+                ksize = 0;
+            if (io != nullptr)
+                *io = true;
+        }
+        util::memzero(ptr + ksize, page_size - ksize);
+        pages[n] = ptr;
+    }
+    if (n > 0)
+    {
+        uctx::RawSpinLockUninterruptibleContext ctx(mt->vm_info->mmu_paging.get_lock());
+        mt->vm_info->mmu_paging.map_new_pages(vm, start, pages, n, read_only);
+    }
+    return n;
+}
+
+/// move the dirty bits of the ptes of a shared file vm to its page cache, then write the dirty pages back
+void writeback_file_vm(info_t *info, const vm_t *vm)
+{
+    if ((vm->flags & (flags::file | flags::shared | flags::writeable)) !=
+        (flags::file | flags::shared | flags::writeable))
+        return;
+    auto cache = file_vm_cache(vm);
+    if (cache == nullptr)
+        return;
+    map_t *mt = (map_t *)vm->user_data;
+    u64 first = mt->offset / page_size;
+    auto base = (arch::paging::base_paging_t *)info->mmu_paging.get_page_addr();
+    {
+        uctx::RawSpinLockUninterruptibleContext ctx(info->mmu_paging.get_lock());
+        bool cleared = false;
+        for (u64 addr = vm->start; addr < vm->end; addr += page_size)
+        {
+            auto pte = arch::paging::get_pte(base, (void *)addr);
+            if (pte == nullptr || !pte->is_dirty())
+                continue;
+            pte->clear_dirty();
+            cache->set_dirty(first + (addr - vm->start) / page_size,
+                             (byte *)memory::kernel_phyaddr_to_virtaddr(pte->get_phy_addr()));
+            cleared = true;
+        }
+        // the cpu sets the dirty bit again only after its tlb entry is gone
+        if (cleared)
+            info->mmu_paging.flush_tlb_range(vm->start, vm->end);
+    }
+    cache->writeback(first, first + (vm->end - vm->start) / page_size);
+}
+
 bool fill_file_vm(u64 page_addr, const vm_t *item)
 {
     map_t *mt = (map_t *)item->user_data;
-    u64 page_start = (page_addr) & ~(memory::page_size - 1);
-    u64 off = page_start - item->start;
-    mt->file->move(mt->offset + off);
-    byte *ptr = (byte *)memory::malloc_page();
-    u64 read_size = mt->length > memory::page_size ? memory::page_size : mt->length;
-    auto ksize = mt->file->read(ptr, read_size, 0);
-    util::memzero(ptr + ksize, memory::page_size - ksize);
-    vm_t vm = *item;
-    vm.start = page_start;
-    vm.end = vm.start + memory::page_size;
-    mt->vm_info->mmu_paging.map_area_phy(&vm, memory::kernel_virtaddr_to_phyaddr(ptr));
+    auto &paging = mt->vm_info->mmu_paging;
+    auto base = (arch::paging::base_paging_t *)paging.get_page_addr();
+    u64 page_start = page_addr & ~(page_size - 1);
+    u64 start = page_start & ~(file_fault_around_pages * page_size - 1);
+    u64 end = start + file_fault_around_pages * page_size;
+    if (start < item->start)
+        start = item->start;
+    if (end > item->end)
+        end = item->end;
 
-    if (mt->vm_info->mmu_paging.get_page_addr() != memory::kernel_vm_info->mmu_paging.get_page_addr())
     {
-        if (page_addr >= memory::kernel_mmap_bottom_address && page_addr <= memory::kernel_mmap_top_address)
+        uctx::RawSpinLockUninterruptibleContext ctx(paging.get_lock());
+        void *phy;
+        if (arch::paging::get_map_address(base, (void *)page_start, &phy))
         {
-            memory::kernel_vm_info->mmu_paging.map_area_phy(&vm, memory::kernel_virtaddr_to_phyaddr(ptr));
+            // mapped by another thread
+            mt->vm_info->minor_faults++;
+            return true;
         }
+        // shrink the window to the unmapped pages next to the fault
+        u64 addr = page_start;
+        while (addr > start && !arch::paging::get_map_address(base, (void *)(addr - page_size), &phy))
+            addr -= page_size;
+        start = addr;
+        addr = page_start + page_size;
+        while (addr < end && !arch::paging::get_map_address(base, (void *)addr, &phy))
+            addr += page_size;
+        end = addr;
     }
-    return true;
+
+    bool io = false;
+    u64 n = map_file_window(item, start, end, &io);
+    if (io)
+        mt->vm_info->major_faults++;
+    else
+        mt->vm_info->minor_faults++;
+    return n > (page_start - start) / page_size;
 }
 
 const vm_t *info_t::map_file(u64 start, fs::vfs::file *file, u64 file_map_offset, u64 map_length, flag_t page_ext_attr)
@@ -380,39 +986,69 @@ const vm_t *info_t::map_file(u64 start, fs::vfs::file *file, u64 file_map_offset
     }
 
     u64 alen = (map_length + memory::page_size - 1) & ~(memory::page_size - 1);
-    auto cflags = flags::lock | flags::user_mode | flags::expand;
+    u64 cflags = flags::lock | flags::user_mode | flags::expand | flags::huge_page;
     auto func = fill_expand_vm;
     u64 user_data = (u64)this;
 
     if (file)
     {
-        cflags |= flags::file;
+        cflags = (cflags & ~flags::huge_page) | flags::file;
         func = fill_file_vm;
         user_data = (u64)memory::New<map_t>(memory::KernelCommonAllocatorV, file, file_map_offset, map_length, this);
     }
 
+    const vm_t *vm;
     if (start == 0)
+        vm = vma.allocate_map(alen, cflags | page_ext_attr, func, user_data);
+    else
+        vm = vma.add_map(start, start + alen, cflags | page_ext_attr, func, user_data);
+
+    if (vm != nullptr && (page_ext_attr & flags::populate))
+        populate(vm);
+    return vm;
+}
+
+void info_t::populate(const vm_t *vm)
+{
+    if (vm->flags & flags::file)
+    {
+        const u64 window = file_fault_around_pages * page_size;
+        for (u64 start = vm->start; start < vm->end; start += window)
+        {
+            u64 end = start + window > vm->end ? vm->end : start + window;
+            if (map_file_window(vm, start, end, nullptr) < (end - start) / page_size)
+                return;
+        }
+        return;
+    }
+    for (u64 addr = vm->start; addr < vm->end; addr += page_size)
     {
-        return vma.allocate_map(alen, cflags | page_ext_attr, func, user_data);
+        // a page mapped already, or by a 2MB frame of an earlier page, is skipped
+        if (!mmu_paging.map_anonymous_page(vm, addr, vm->end))
+            return;
     }
-    return vma.add_map(start, start + alen, cflags | page_ext_attr, func, user_data);
 }
 
-void info_t::sync_map_file(u64 addr) {}
+void info_t::sync_map_file(u64 addr)
+{
+    auto vm = vma.get_vm_area(addr);
+    if (vm != nullptr)
+        writeback_file_vm(this, vm);
+}
 
 bool info_t::umap_file(u64 addr)
 {
     auto vm = vma.get_vm_area(addr);
     if (!vm)
         return false;
+    writeback_file_vm(this, vm);
+    mmu_paging.unmap_area(vm);
     if (vm->flags & flags::file)
     {
         map_t *mt = (map_t *)vm->user_data;
         memory::Delete<>(memory::KernelCommonAllocatorV, mt);
     }
     vma.deallocate_map(vm);
-    mmu_paging.unmap_area(vm);
-    arch::paging::reload();
     return true;
 }
 } // namespace memory::vm
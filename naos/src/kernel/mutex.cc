@@ -1,10 +1,138 @@
 #include "kernel/mutex.hpp"
+#include "kernel/cpu.hpp"
+#include "kernel/scheduler.hpp"
+#include "kernel/task.hpp"
+#include "kernel/ucontext.hpp"
 namespace lock
 {
+/// set in mutex_t::owner when the wait list isn't empty, the unlock must take the slow path
+constexpr u64 mutex_waiters = 1;
 
-bool mutex_func(u64 data)
+/// lives on the stack of the waiting thread
+struct mutex_waiter_t
 {
-    mutex_t *mtx = (mutex_t *)data;
-    return !mtx->lock_m._M_i;
+    mutex_waiter_t *next;
+    task::thread_t *thread;
+    /// the unlocker made this waiter the owner, set under wait_lock
+    bool handed;
+};
+
+task::thread_t *mutex_t::get_owner() const { return (task::thread_t *)(owner.load() & ~mutex_waiters); }
+
+bool mutex_t::try_lock()
+{
+    u64 expected = 0;
+    return owner.compare_exchange_strong(expected, (u64)task::current(), std::memory_order_acquire);
+}
+
+void mutex_t::lock()
+{
+    if (likely(try_lock()))
+        return;
+    lock_slow();
+}
+
+void mutex_t::unlock()
+{
+    u64 expected = (u64)task::current();
+    if (likely(owner.compare_exchange_strong(expected, 0, std::memory_order_release)))
+        return;
+    unlock_slow();
+}
+
+/// the owner read from the owner word v is running on another cpu and will unlock soon
+///
+/// The owner may have unlocked and exited meanwhile, so its fields are only trusted if the word still holds v after
+/// reading them. thread_t lives in slab memory of the linear mapping, reading a freed one doesn't fault.
+bool owner_on_cpu(const std::atomic_uint64_t &owner_word, u64 v)
+{
+    auto owner = (task::thread_t *)(v & ~mutex_waiters);
+    auto state = owner->state;
+    auto cpuid = owner->cpuid;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (owner_word.load(std::memory_order_relaxed) != v)
+        return false;
+    return state == task::thread_state::running && cpuid != cpu::current().id();
 }
+
+void mutex_t::lock_slow()
+{
+    task::thread_t *self = task::current();
+
+    // spin while the owner is running, a sleep and a wakeup cost more than the critical section
+    for (;;)
+    {
+        u64 v = owner.load(std::memory_order_relaxed);
+        auto o = (task::thread_t *)(v & ~mutex_waiters);
+        if (o == nullptr)
+        {
+            // waiters get the mutex handed off, the mutex is unlocked only with no waiters
+            if (owner.compare_exchange_weak(v, (u64)self, std::memory_order_acquire))
+                return;
+            continue;
+        }
+        if ((v & mutex_waiters) || !owner_on_cpu(owner, v) || (self->attributes & task::thread_attributes::need_schedule))
+            break;
+        cpu_pause();
+    }
+
+    mutex_waiter_t waiter;
+    waiter.next = nullptr;
+    waiter.thread = self;
+    waiter.handed = false;
+
+    uctx::UninterruptibleContext icu;
+    {
+        uctx::RawSpinLockContext ctx(wait_lock);
+        // publish the waiter bit, the unlock then takes wait_lock and sees this waiter
+        u64 v = owner.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            if ((v & ~mutex_waiters) == 0)
+            {
+                if (owner.compare_exchange_weak(v, (u64)self | (v & mutex_waiters), std::memory_order_acquire))
+                    return;
+            }
+            else if (owner.compare_exchange_weak(v, v | mutex_waiters, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        if (wait_tail != nullptr)
+            wait_tail->next = &waiter;
+        else
+            wait_head = &waiter;
+        wait_tail = &waiter;
+    }
+
+    for (;;)
+    {
+        self->attributes |= task::thread_attributes::need_schedule;
+        task::scheduler::update_state(self, task::thread_state::uninterruptible);
+        task::scheduler::schedule();
+        uctx::RawSpinLockContext ctx(wait_lock);
+        if (waiter.handed)
+            return;
+        // false wake up, try sleep.
+    }
+}
+
+void mutex_t::unlock_slow()
+{
+    uctx::RawSpinLockUninterruptibleContext ctx(wait_lock);
+    mutex_waiter_t *waiter = wait_head;
+    if (waiter == nullptr)
+    {
+        owner.store(0, std::memory_order_release);
+        return;
+    }
+    wait_head = waiter->next;
+    if (wait_head == nullptr)
+        wait_tail = nullptr;
+    // hand off, the first waiter owns the mutex before it runs
+    owner.store((u64)waiter->thread | (wait_head != nullptr ? mutex_waiters : 0), std::memory_order_release);
+    waiter->handed = true;
+    task::scheduler::update_state(waiter->thread, task::thread_state::ready);
+}
+
 } // namespace lock
@@ -1,4 +1,5 @@
 #include "kernel/scheduler.hpp"
+#include "kernel/arch/cpu_info.hpp"
 #include "kernel/irq.hpp"
 #include "kernel/schedulers/completely_fair.hpp"
 #include "kernel/schedulers/round_robin.hpp"
@@ -13,37 +14,142 @@ scheduler *real_time_schedulers;
 scheduler *normal_schedulers;
 
 void timer_tick(u64 pass, u64 user_data);
+void arm_tick(u64 interval);
+/// re-arm a stopped or slowed scheduler tick when a thread is queued on this cpu
+void restart_tick();
+
+/// the scheduler tick interval
+constexpr u64 sched_tick_us = 5000;
+/// the scheduler tick interval while a single thread is runnable, nothing to preempt it for
+constexpr u64 sched_tick_single_us = 20000;
 
 std::atomic_bool is_init = false;
 
-task::thread_t *thread_to_reschedule;
+/// max threads waiting in the migrate queue of a cpu
+constexpr u32 migrate_queue_size = 32;
+
+/// threads moving to a cpu, pushed by other cpus and drained by the owner in the reschedule IPI
+struct migrate_queue_t
+{
+    lock::spinlock_t lock;
+    thread_t *threads[migrate_queue_size];
+    u32 head = 0;
+    u32 count = 0;
+    /// bit mask of idle cpus asking this cpu for a thread
+    std::atomic_uint64_t steal_request = 0;
+};
+
+migrate_queue_t *get_migrate_queue(u32 cpuid) { return (migrate_queue_t *)cpu::get(cpuid).get_migrate_queue(); }
+
+/// cpus sharing a core, a last level cache, a package and all cpus
+constexpr u32 domain_level_count = 4;
+/// imbalance of runnable_avg (1024 is one thread) needed to move a thread inside each level.
+/// Siblings share every cache, so moves stay local and go to another package only if the imbalance is large.
+const u64 domain_imbalance[domain_level_count] = {1024, 1024, 2048, 3072};
+
+/// scheduling domains of a cpu
+struct sched_domain_t
+{
+    arch::cpu_info::topology_t topology;
+    /// mask of cpus in each level, a level includes the levels under it
+    u64 span[domain_level_count];
+    /// domain_generation the spans are built at
+    u64 generation = 0;
+};
 
-std::atomic_bool reschedule_ready;
+/// increased when a cpu joins, the spans are rebuilt lazily
+std::atomic_uint64_t domain_generation = 1;
+
+bool in_same_domain(const arch::cpu_info::topology_t &a, const arch::cpu_info::topology_t &b, u32 level)
+{
+    switch (level)
+    {
+        case 0:
+            return a.package_id == b.package_id && a.core_id == b.core_id;
+        case 1:
+            return a.package_id == b.package_id && a.llc_id == b.llc_id;
+        case 2:
+            return a.package_id == b.package_id;
+        default:
+            return true;
+    }
+}
+
+sched_domain_t *get_sched_domain()
+{
+    auto &cur = cpu::current();
+    auto domain = (sched_domain_t *)cur.get_sched_domain();
+    u64 generation = domain_generation;
+    if (likely(domain->generation == generation))
+        return domain;
+
+    for (u32 level = 0; level < domain_level_count; level++)
+        domain->span[level] = 0;
+    for (u32 i = 0; i < cpu::count(); i++)
+    {
+        auto other = (sched_domain_t *)cpu::get(i).get_sched_domain();
+        if (other == nullptr)
+            continue;
+        for (u32 level = 0; level < domain_level_count; level++)
+        {
+            if (in_same_domain(domain->topology, other->topology, level))
+                domain->span[level] |= 1ul << i;
+        }
+    }
+    domain->generation = generation;
+    return domain;
+}
 
 irq::request_result reschedule_func(const void *regs, u64 data, u64 user_data)
 {
-    task::thread_t *thd = thread_to_reschedule;
-    // trace::debug("reschedule task cpu ", thd->cpuid, " to cpu ", cpu::current().id());
+    auto queue = get_migrate_queue(cpu::current().id());
+    bool received = false;
+    {
+        uctx::RawSpinLockUninterruptibleContext ctx(queue->lock);
+        while (queue->count > 0)
+        {
+            thread_t *thd = queue->threads[queue->head];
+            queue->head = (queue->head + 1) % migrate_queue_size;
+            queue->count--;
+            thd->scheduler->on_migrate(thd);
+            received = true;
+        }
+    }
+    if (received)
+    {
+        if (current()->process->pid == 0)
+            current()->attributes |= thread_attributes::need_schedule;
+        restart_tick();
+    }
 
-    if (!reschedule_ready)
+    // hand a ready thread to each idle cpu asking for one
+    u64 request = queue->steal_request.exchange(0);
+    for (u32 id = 0; request != 0; id++, request >>= 1)
     {
-        thd->scheduler->on_migrate(thd);
+        if (!(request & 1))
+            continue;
+        auto task = real_time_schedulers->get_migratable_task(id);
+        if (task == nullptr)
+            task = normal_schedulers->get_migratable_task(id);
+        if (task != nullptr)
+            migrate_task(task, id);
     }
-    reschedule_ready = true;
     return irq::request_result::ok;
 }
 
-bool reschedule_task_push(thread_t *task, u32 cpuid)
+bool migrate_task(thread_t *task, u32 cpuid)
 {
-    if (reschedule_ready)
+    auto queue = get_migrate_queue(cpuid);
     {
-        if (!reschedule_ready.exchange(false))
+        uctx::RawSpinLockUninterruptibleContext ctx(queue->lock);
+        if (queue->count >= migrate_queue_size)
             return false;
-        thread_to_reschedule = task;
-        SMP::reschedule_cpu(cpuid);
-        return true;
+        task->scheduler->commit_migrate(task);
+        queue->threads[(queue->head + queue->count) % migrate_queue_size] = task;
+        queue->count++;
     }
-    return false;
+    SMP::reschedule_cpu(cpuid);
+    return true;
 }
 
 void init()
@@ -54,10 +160,9 @@ void init()
         normal_schedulers = memory::New<completely_fair_scheduler>(memory::KernelCommonAllocatorV);
 
         is_init = true;
-        reschedule_ready = true;
         irq::insert_request_func(irq::hard_vector::IPI_reschedule, reschedule_func, 0);
     }
-    timer::add_watcher(5000, timer_tick, 0);
+    arm_tick(sched_tick_us);
 }
 
 void init_cpu()
@@ -66,6 +171,13 @@ void init_cpu()
     {
         cpu_pause();
     }
+    cpu::current().set_migrate_queue(memory::New<migrate_queue_t>(memory::KernelCommonAllocatorV));
+    auto domain = memory::New<sched_domain_t>(memory::KernelCommonAllocatorV);
+    domain->topology = arch::cpu_info::get_topology();
+    cpu::current().set_sched_domain(domain);
+    domain_generation++;
+    trace::debug("cpu ", cpu::current().id(), " package ", domain->topology.package_id, " core ",
+                 domain->topology.core_id, " smt ", domain->topology.smt_id, " llc ", domain->topology.llc_id);
     real_time_schedulers->init_cpu();
     normal_schedulers->init_cpu();
 }
@@ -83,6 +195,7 @@ void add(thread_t *thread, scheduler_class scher)
     }
 
     thread->scheduler->add(thread);
+    restart_tick();
 }
 
 void remove(thread_t *thread) { thread->attributes |= thread_attributes::remove | thread_attributes::need_schedule; }
@@ -102,6 +215,8 @@ void update_state_ipi(u64 data)
 {
     update_state_ipi_param *p = (update_state_ipi_param *)data;
     p->thread->scheduler->update_state(p->thread, p->state);
+    if (p->state == thread_state::ready)
+        restart_tick();
 
     memory::Delete<>(memory::KernelCommonAllocatorV, p);
 }
@@ -111,6 +226,8 @@ void update_state(thread_t *thread, thread_state state)
     if (thread->cpuid == cpu::current().id())
     {
         thread->scheduler->update_state(thread, state);
+        if (state == thread_state::ready)
+            restart_tick();
     }
     else
     {
@@ -120,6 +237,11 @@ void update_state(thread_t *thread, thread_state state)
     }
 }
 
+void update_prop(thread_t *thread, u8 static_priority, u8 dyn_priority)
+{
+    thread->scheduler->update_prop(thread, static_priority, dyn_priority);
+}
+
 void schedule()
 {
     if (unlikely(!is_init))
@@ -142,13 +264,128 @@ u64 sctl(int operator_type, thread_t *target, u64 attr, u64 *value, u64 size)
     return target->scheduler->sctl(operator_type, target, attr, value, size);
 }
 
+u64 runnable_count()
+{
+    return real_time_schedulers->scheduleable_task_count() + normal_schedulers->scheduleable_task_count() +
+           (current()->process->pid != 0 ? 1 : 0);
+}
+
+/// arm the scheduler tick after interval, an interval of 0 stops it
+void arm_tick(u64 interval)
+{
+    auto &data = cpu::current().edit_load_data();
+    data.tick_interval = interval;
+    timer::remove_watcher(data.tick_watcher);
+    data.tick_watcher = timer::watcher_handle_t();
+    if (interval == 0)
+    {
+        data.next_tick = 0;
+        return;
+    }
+    // a watcher already running is stale once next_tick changes, timer_tick ignores it
+    data.next_tick = timer::get_high_resolution_time() + interval;
+    // on a hrtimer, so the time slice ends on time instead of at the next timer wheel unit
+    data.tick_watcher = timer::add_hrtimer(data.next_tick, timer_tick, 0);
+}
+
+void restart_tick()
+{
+    uctx::UninterruptibleContext icu;
+    auto &data = cpu::current().edit_load_data();
+    if (data.tick_interval == sched_tick_us)
+        return;
+    if (data.tick_interval == 0)
+    {
+        // the idle time isn't busy time
+        data.last_tick_time = timer::get_high_resolution_time();
+        arm_tick(sched_tick_us);
+    }
+    else if (runnable_count() > 1)
+    {
+        arm_tick(sched_tick_us);
+    }
+}
+
+void load_balance()
+{
+    auto &cpu = cpu::current();
+    auto &data = cpu.edit_load_data();
+    u32 cur_id = cpu.id();
+    auto domain = get_sched_domain();
+    // cpus of the levels under the current one, already looked at
+    u64 covered = 1ul << cur_id;
+
+    if (data.runnable_count == 0)
+    {
+        // idle, pull a thread from the busiest cpu which has one waiting, the closest level first
+        for (u32 level = 0; level < domain_level_count; level++)
+        {
+            u64 span = domain->span[level] & ~covered;
+            covered |= span;
+            cpu::cpu_data_t *busiest = nullptr;
+            for (; span != 0; span &= span - 1)
+            {
+                auto &other = cpu::get(__builtin_ctzll(span));
+                if (other.edit_load_data().runnable_count < 2)
+                    continue;
+                if (busiest == nullptr ||
+                    other.edit_load_data().runnable_avg > busiest->edit_load_data().runnable_avg)
+                    busiest = &other;
+            }
+            if (busiest != nullptr)
+            {
+                get_migrate_queue(busiest->id())->steal_request |= 1ul << cur_id;
+                SMP::reschedule_cpu(busiest->id());
+                return;
+            }
+        }
+        return;
+    }
+
+    if (data.runnable_count < 2)
+        return;
+
+    // push to the least loaded cpu, the closest level first
+    for (u32 level = 0; level < domain_level_count; level++)
+    {
+        u64 span = domain->span[level] & ~covered;
+        covered |= span;
+        cpu::cpu_data_t *target_cpu = nullptr;
+        for (; span != 0; span &= span - 1)
+        {
+            auto &other = cpu::get(__builtin_ctzll(span));
+            auto &other_data = other.edit_load_data();
+            if (target_cpu == nullptr || other_data.runnable_avg < target_cpu->edit_load_data().runnable_avg ||
+                (other_data.runnable_avg == target_cpu->edit_load_data().runnable_avg &&
+                 other_data.util_avg < target_cpu->edit_load_data().util_avg))
+                target_cpu = &other;
+        }
+
+        if (target_cpu != nullptr &&
+            data.runnable_avg > target_cpu->edit_load_data().runnable_avg + domain_imbalance[level])
+        {
+            auto task = real_time_schedulers->get_migratable_task(target_cpu->id());
+            if (task == nullptr)
+                task = normal_schedulers->get_migratable_task(target_cpu->id());
+            if (task != nullptr && migrate_task(task, target_cpu->id()))
+                return;
+        }
+    }
+}
+
 void timer_tick(u64 pass, u64 user_data)
 {
-    timer::add_watcher(5000, timer_tick, user_data);
+    auto &cpu = cpu::current();
+    auto &data = cpu.edit_load_data();
+    if (pass != data.next_tick)
+        return;
     thread_t *thd = current();
 
     uctx::UninterruptibleContext icu;
 
+    if (thd->process->pid != 0)
+        data.busy_time += timer::get_high_resolution_time() - data.last_tick_time;
+
     if (thd->attributes & thread_attributes::real_time)
         real_time_schedulers->schedule_tick();
     else
@@ -159,72 +396,65 @@ void timer_tick(u64 pass, u64 user_data)
         }
         normal_schedulers->schedule_tick();
     }
-    if (!reload_load_fac())
-        return; /// time too short. do it after
+    if (update_load_avg())
+        load_balance();
 
-    u64 cpu_count = cpu::count();
-    u64 min_fac = cpu::current().edit_load_data().recent_load_fac;
-    u64 cur_id = cpu::current().id();
-    cpu::cpu_data_t *targe_cpu = nullptr;
-    for (u64 i = 0; i < cpu_count; i++)
+    u64 runnable = runnable_count();
+    if (runnable == 0)
     {
-        if (cur_id == i)
-            continue;
-        auto &cpu = cpu::get(i);
-        if (min_fac >= cpu.edit_load_data().recent_load_fac)
-        {
-            min_fac = cpu.edit_load_data().recent_load_fac;
-            targe_cpu = &cpu;
-        }
+        // tickless idle, the load of this cpu is gone until a thread is queued here
+        data.runnable_count = 0;
+        data.runnable_avg = 0;
+        data.util_avg = 0;
+        arm_tick(0);
     }
-
-    if (targe_cpu != nullptr && (cpu::current().edit_load_data().recent_load_fac - min_fac) > 100)
+    else
     {
-        auto task = real_time_schedulers->get_migratable_task(targe_cpu->id());
-        if (task != nullptr)
-        {
-            if (reschedule_task_push(task, targe_cpu->id()))
-            {
-                real_time_schedulers->commit_migrate(task);
-                return;
-            }
-        }
-
-        task = normal_schedulers->get_migratable_task(targe_cpu->id());
-        if (task != nullptr)
-        {
-            if (reschedule_task_push(task, targe_cpu->id()))
-            {
-                normal_schedulers->commit_migrate(task);
-            }
-        }
+        arm_tick(runnable == 1 ? sched_tick_single_us : sched_tick_us);
     }
+}
+
+/// the load average is decayed at this interval
+constexpr u64 load_update_span = 10000;
+/// PELT period, the load decays by y per period with y^32 = 1/2
+constexpr u64 pelt_period = 1024;
+/// y^n scaled by 2^32
+const u32 pelt_decay[32] = {
+    0xffffffff, 0xfa83b2db, 0xf5257d15, 0xefe4b99b, 0xeac0c6e7, 0xe5b906e7, 0xe0ccdeec, 0xdbfbb797,
+    0xd744fcca, 0xd2a81d91, 0xce248c15, 0xc9b9bd86, 0xc5672a11, 0xc12c4cca, 0xbd08a39f, 0xb8fbaf47,
+    0xb504f333, 0xb123f581, 0xad583eea, 0xa9a15ab4, 0xa5fed6a9, 0xa2704303, 0x9ef53260, 0x9b8d39b9,
+    0x9837f051, 0x94f4efa8, 0x91c3d373, 0x8ea4398b, 0x8b95c1e3, 0x88980e80, 0x85aac367, 0x82cd8698,
+};
 
-    return;
+/// val * y^n
+u64 decay_load(u64 val, u64 n)
+{
+    if (n >= 64 * 32)
+        return 0;
+    val >>= n / 32;
+    return (val * pelt_decay[n % 32]) >> 32;
 }
-// 10ms allow to reschedule
-constexpr u64 load_calc_time_span = 10000;
-constexpr u64 load_calc_times = 5;
 
-bool reload_load_fac()
+bool update_load_avg()
 {
     auto &cpu = cpu::current();
     auto &data = cpu.edit_load_data();
     auto time = timer::get_high_resolution_time();
     auto dt = time - data.last_load_time;
-    if (dt < load_calc_time_span)
+    if (dt < load_update_span)
         return false;
-    data.last_load_time = time;
-
-    data.calcing_load_fac +=
-        (real_time_schedulers->scheduleable_task_count() + normal_schedulers->scheduleable_task_count()) * 100;
 
-    if (++data.load_calc_times >= load_calc_times)
-    {
-        data.recent_load_fac = data.calcing_load_fac / data.load_calc_times;
-        data.load_calc_times = 0;
-        return true;
-    }
-    return false;
+    u64 busy = data.busy_time - data.last_busy_time;
+    if (busy > dt)
+        busy = dt;
+    data.last_load_time = time;
+    data.last_busy_time = data.busy_time;
+    data.runnable_count = runnable_count();
+
+    // the window is taken as uniform: avg = avg * y^p + sample * (1 - y^p)
+    u64 keep = decay_load(1024, dt / pelt_period);
+    data.util_avg = (data.util_avg * keep + busy * 1024 / dt * (1024 - keep)) / 1024;
+    data.runnable_avg = (data.runnable_avg * keep + data.runnable_count * 1024 * (1024 - keep)) / 1024;
+    return true;
 }
 } // namespace task::scheduler
@@ -1,56 +1,145 @@
 #include "kernel/schedulers/completely_fair.hpp"
 #include "kernel/clock.hpp"
 #include "kernel/cpu.hpp"
-#include "kernel/mm/list_node_cache.hpp"
 #include "kernel/mm/memory.hpp"
 #include "kernel/task.hpp"
 #include "kernel/timer.hpp"
 #include "kernel/ucontext.hpp"
-#include "kernel/util/skip_list.hpp"
+#include "kernel/util/rb_tree.hpp"
 
 namespace task::scheduler
 {
-struct thread_time_cf_t
-{
-    i64 vtime;
-    u64 vtime_delta;
+/// weight of a nice 0 thread, vtime of such a thread advances at wall clock speed
+const u64 nice_0_weight = 1024;
+
+/// weight of nice -20 to 19. Each nice level is about 10% cpu time away from its neighbour
+const u64 nice_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15,
 };
 
-struct less_cmp
+/// static_priority 100 - 139 map to nice -20 - 19, kernel threads above that run as nice -20
+u64 priority_to_weight(u8 static_priority)
+{
+    if (static_priority < 100)
+        return nice_to_weight[0];
+    if (static_priority > 139)
+        return nice_to_weight[39];
+    return nice_to_weight[static_priority - 100];
+}
+
+enum class cfs_queue_t : u8
 {
+    none,
+    runable,
+    block,
 };
 
-struct cfs_thread_t
+/// per-thread CFS data, the runqueue and the block list are linked through it so queueing allocates nothing
+struct thread_time_cf_t
 {
+    /// virtual runtime, only changed while the thread isn't in the runable tree
+    i64 vtime;
+    u64 weight;
+    /// the last time vtime was updated while running
+    time::microsecond_t exec_start;
+
     thread_t *thread;
-    bool operator<(const cfs_thread_t &thd)
-    {
-        return ((thread_time_cf_t *)(thread->schedule_data))->vtime <
-               ((thread_time_cf_t *)(thd.thread->schedule_data))->vtime;
-    }
-    bool operator==(const cfs_thread_t &thd) { return thd.thread == thread; }
-    explicit cfs_thread_t(thread_t *thread)
-        : thread(thread)
+    cfs_queue_t queue;
+    util::rb_node run_node;
+    thread_time_cf_t *block_prev, *block_next;
+
+    explicit thread_time_cf_t(thread_t *thread)
+        : vtime(0)
+        , weight(nice_0_weight)
+        , exec_start(0)
+        , thread(thread)
+        , queue(cfs_queue_t::none)
+        , block_prev(nullptr)
+        , block_next(nullptr)
     {
     }
 };
 
-using thread_skip_list_t = util::skip_list<cfs_thread_t>;
-struct cpu_task_list_cf_t
+/// scale a wall clock span to the virtual span of a thread
+i64 calc_vtime_delta(u64 delta, thread_time_cf_t *dt) { return (i64)(delta * nice_0_weight / dt->weight); }
+
+thread_time_cf_t *get_run_node_data(util::rb_node *node)
 {
-    using thread_list_cache_allocator_t = memory::list_node_cache_allocator<thread_list_t>;
-    using thread_skip_list_cache_allocator_t = memory::list_node_cache_allocator<thread_skip_list_t>;
+    return util::container_of<thread_time_cf_t, &thread_time_cf_t::run_node>(node);
+}
 
-    thread_list_cache_allocator_t list_node_allocator;
-    thread_skip_list_cache_allocator_t allocator;
-    thread_skip_list_t runable_list;
-    thread_list_t block_list;
-    u64 min_vruntime;
+struct cpu_task_list_cf_t
+{
+    /// ready threads ordered by vtime
+    util::rb_tree runable_tree;
+    /// blocked threads, unordered
+    thread_time_cf_t *block_head;
+    u64 block_count;
+    /// monotonic floor of vtime on this cpu, new, woken and migrated threads are placed relative to it
+    i64 min_vruntime;
 
     cpu_task_list_cf_t()
-        : runable_list(&allocator)
-        , block_list(&list_node_allocator)
+        : block_head(nullptr)
+        , block_count(0)
+        , min_vruntime(0)
+    {
+    }
+
+    void enqueue(thread_time_cf_t *dt)
     {
+        kassert(dt->queue == cfs_queue_t::none, "CFS thread is queued already");
+        runable_tree.insert(&dt->run_node, [](util::rb_node *a, util::rb_node *b) {
+            return get_run_node_data(a)->vtime < get_run_node_data(b)->vtime;
+        });
+        dt->queue = cfs_queue_t::runable;
+    }
+
+    void dequeue(thread_time_cf_t *dt)
+    {
+        kassert(dt->queue == cfs_queue_t::runable, "CFS thread isn't in the runable tree");
+        runable_tree.remove(&dt->run_node);
+        dt->queue = cfs_queue_t::none;
+    }
+
+    /// the ready thread with the smallest vtime, nullptr if no thread is ready
+    thread_time_cf_t *front()
+    {
+        auto node = runable_tree.first();
+        return node == nullptr ? nullptr : get_run_node_data(node);
+    }
+
+    void block(thread_time_cf_t *dt)
+    {
+        kassert(dt->queue == cfs_queue_t::none, "CFS thread is queued already");
+        dt->block_prev = nullptr;
+        dt->block_next = block_head;
+        if (block_head != nullptr)
+            block_head->block_prev = dt;
+        block_head = dt;
+        block_count++;
+        dt->queue = cfs_queue_t::block;
+    }
+
+    void unblock(thread_time_cf_t *dt)
+    {
+        kassert(dt->queue == cfs_queue_t::block, "CFS thread isn't in the block list");
+        if (dt->block_prev != nullptr)
+            dt->block_prev->block_next = dt->block_next;
+        else
+            block_head = dt->block_next;
+        if (dt->block_next != nullptr)
+            dt->block_next->block_prev = dt->block_prev;
+        dt->block_prev = nullptr;
+        dt->block_next = nullptr;
+        block_count--;
+        dt->queue = cfs_queue_t::none;
     }
 };
 
@@ -61,13 +150,55 @@ cpu_task_list_cf_t *get_cpu_task_list()
 
 thread_time_cf_t *get_schedule_data(thread_t *thd) { return (thread_time_cf_t *)thd->schedule_data; }
 
+void update_min_vruntime(cpu_task_list_cf_t *task_list, thread_t *cur)
+{
+    i64 vtime;
+    bool has_vtime = false;
+    if (cur != nullptr && cur->process->pid != 0)
+    {
+        vtime = get_schedule_data(cur)->vtime;
+        has_vtime = true;
+    }
+    if (auto left_dt = task_list->front())
+    {
+        i64 left = left_dt->vtime;
+        if (!has_vtime || left < vtime)
+            vtime = left;
+        has_vtime = true;
+    }
+    if (has_vtime && vtime > task_list->min_vruntime)
+        task_list->min_vruntime = vtime;
+}
+
+/// charge the time the running thread has used since exec_start
+void update_current(cpu_task_list_cf_t *task_list, thread_t *cur)
+{
+    auto dt = get_schedule_data(cur);
+    auto now = timer::get_high_resolution_time();
+    if (now > dt->exec_start)
+    {
+        dt->vtime += calc_vtime_delta(now - dt->exec_start, dt);
+        dt->exec_start = now;
+    }
+    update_min_vruntime(task_list, cur);
+}
+
+/// a woken thread gets at most sleeper_credit_us of credit against min_vruntime,
+/// so a long sleep can't turn into a long monopoly of the cpu
+void place_woken_thread(cpu_task_list_cf_t *task_list, thread_time_cf_t *dt, time::microsecond_t sleeper_credit_us)
+{
+    i64 vtime = task_list->min_vruntime - (i64)sleeper_credit_us;
+    if (dt->vtime < vtime)
+        dt->vtime = vtime;
+}
+
 void completely_fair_scheduler::init_cpu()
 {
     auto task_list = memory::New<cpu_task_list_cf_t>(memory::KernelCommonAllocatorV);
     cpu::current().set_schedule_data((int)clazz, task_list);
-    auto dt = memory::New<thread_time_cf_t>(memory::KernelCommonAllocatorV);
-    dt->vtime_delta = 100;
-    dt->vtime = 0;
+    auto dt = memory::New<thread_time_cf_t>(memory::KernelCommonAllocatorV, cpu::current().get_idle_task());
+    dt->weight = nice_to_weight[39];
+    dt->exec_start = timer::get_high_resolution_time();
     task_list->min_vruntime = 0;
     auto &data = cpu::current().edit_load_data();
     data.last_sched_time = timer::get_high_resolution_time();
@@ -86,13 +217,14 @@ void completely_fair_scheduler::destroy_cpu()
 void completely_fair_scheduler::add(thread_t *thread)
 {
     auto task_list = get_cpu_task_list();
-    auto dt = memory::New<thread_time_cf_t>(memory::KernelCommonAllocatorV);
-    dt->vtime_delta = 100;
-    dt->vtime = 0;
+    auto dt = memory::New<thread_time_cf_t>(memory::KernelCommonAllocatorV, thread);
+    dt->weight = priority_to_weight(thread->static_priority);
     thread->cpuid = cpu::current().id();
     thread->schedule_data = dt;
     uctx::UninterruptibleContext icu;
-    task_list->runable_list.insert(cfs_thread_t(thread));
+    // start at the floor so that a new thread neither starves nor is starved by the others
+    dt->vtime = task_list->min_vruntime;
+    task_list->enqueue(dt);
 }
 
 void completely_fair_scheduler::remove(thread_t *thread)
@@ -100,21 +232,12 @@ void completely_fair_scheduler::remove(thread_t *thread)
     auto task_list = get_cpu_task_list();
 
     uctx::UninterruptibleContext icu;
-    auto node = task_list->block_list.find(thread);
-    if (node != task_list->block_list.end())
-    {
-        task_list->block_list.remove(node);
-    }
-    else
-    {
-        auto it = task_list->runable_list.find(cfs_thread_t(thread));
-        if (it != task_list->runable_list.end())
-        {
-            task_list->runable_list.remove(it);
-        }
-    }
-
     auto scher_data = get_schedule_data(thread);
+    if (scher_data->queue == cfs_queue_t::block)
+        task_list->unblock(scher_data);
+    else if (scher_data->queue == cfs_queue_t::runable)
+        task_list->dequeue(scher_data);
+
     thread->schedule_data = nullptr;
     memory::Delete<>(memory::KernelCommonAllocatorV, scher_data);
 } // namespace task::scheduler
@@ -133,13 +256,15 @@ void completely_fair_scheduler::update_state(thread_t *thread, thread_state stat
         }
         if (thread->state == thread_state::uninterruptible || thread->state == thread_state::interruptable)
         {
-            auto node = task_list->block_list.find(thread);
-            if (node != task_list->block_list.end())
+            auto dt = get_schedule_data(thread);
+            if (dt->queue == cfs_queue_t::block)
             {
                 thread->state = state;
-                task_list->block_list.remove(node);
+                task_list->unblock(dt);
                 thread->attributes &= ~(thread_attributes::block_unintr | thread_attributes::block_intr);
-                task_list->runable_list.insert(cfs_thread_t(thread));
+                place_woken_thread(task_list, dt, sched_min_granularity_us / 2);
+                task_list->enqueue(dt);
+                check_preempt_wakeup(thread);
                 return;
             }
         }
@@ -161,12 +286,12 @@ void completely_fair_scheduler::update_state(thread_t *thread, thread_state stat
         }
         else if (thread->state == thread_state::ready)
         {
-            auto it = task_list->runable_list.find(cfs_thread_t(thread));
-            if (it != task_list->runable_list.end())
+            auto dt = get_schedule_data(thread);
+            if (dt->queue == cfs_queue_t::runable)
             {
                 thread->state = state;
-                task_list->runable_list.remove(it);
-                task_list->block_list.push_back(thread);
+                task_list->dequeue(dt);
+                task_list->block(dt);
                 return;
             }
         }
@@ -183,23 +308,25 @@ void completely_fair_scheduler::update_state(thread_t *thread, thread_state stat
             thread->state = thread_state::ready;
             return;
         }
+        if (thread->state == thread_state::running)
+            update_current(task_list, thread);
 
         if (thread->attributes & thread_attributes::block_intr)
         {
             thread->state = thread_state::interruptable;
-            task_list->block_list.push_back(thread);
+            task_list->block(get_schedule_data(thread));
         }
         else if (thread->attributes & thread_attributes::block_unintr)
         {
             thread->state = thread_state::uninterruptible;
-            task_list->block_list.push_back(thread);
+            task_list->block(get_schedule_data(thread));
         }
         else
         {
             if (thread->state == thread_state::running)
             {
                 thread->state = thread_state::ready;
-                task_list->runable_list.insert(cfs_thread_t(thread));
+                task_list->enqueue(get_schedule_data(thread));
             }
         }
         return;
@@ -207,20 +334,49 @@ void completely_fair_scheduler::update_state(thread_t *thread, thread_state stat
     trace::panic("Unreachable control flow.", " CFS thread state:", (int)thread->state, ", to state: ", (int)state);
 }
 
-void completely_fair_scheduler::update_prop(thread_t *thread, u8 static_priority, u8 dyn_priority) {}
+void completely_fair_scheduler::check_preempt_wakeup(thread_t *thread)
+{
+    thread_t *cur = current();
+    if (cur == nullptr || cur->scheduler != this)
+        return;
+    if (cur->process->pid == 0)
+    {
+        cur->attributes |= thread_attributes::need_schedule;
+        return;
+    }
+    auto dt = get_schedule_data(thread);
+    auto cur_dt = get_schedule_data(cur);
+    // the woken thread must be ahead by a granularity in its own virtual time, or tasks would switch on each wakeup
+    if (dt->vtime + calc_vtime_delta(sched_wakeup_granularity_us, dt) < cur_dt->vtime)
+        cur->attributes |= thread_attributes::need_schedule;
+}
+
+void completely_fair_scheduler::update_prop(thread_t *thread, u8 static_priority, u8 dyn_priority)
+{
+    uctx::UninterruptibleContext icu;
+    thread->static_priority = static_priority;
+    thread->dynamic_priority = dyn_priority;
+    if (thread->schedule_data == nullptr || thread->process->pid == 0)
+        return;
+    auto dt = get_schedule_data(thread);
+    // charge the time run with the old weight first
+    if (thread->state == thread_state::running && thread->cpuid == cpu::current().id())
+        update_current(get_cpu_task_list(), thread);
+    dt->weight = priority_to_weight(static_priority);
+}
 
 void completely_fair_scheduler::on_migrate(thread_t *thread)
 {
     auto task_list = get_cpu_task_list();
     uctx::UninterruptibleContext icu;
     auto dt = (thread_time_cf_t *)thread->schedule_data;
-    dt->vtime_delta = 100;
-    dt->vtime = 0;
+    // vtime was made relative to min_vruntime of the source cpu by commit_migrate
+    dt->vtime += task_list->min_vruntime;
     thread->cpuid = cpu::current().id();
     if (thread->state == thread_state::ready)
-        task_list->runable_list.insert(cfs_thread_t(thread));
+        task_list->enqueue(dt);
     else if (thread->state == thread_state::interruptable || thread->state == thread_state::uninterruptible)
-        task_list->block_list.push_back(thread);
+        task_list->block(dt);
     else
         trace::panic("Unknown thread state when migrate(CFS). state: ", (u64)thread->state);
 }
@@ -229,19 +385,15 @@ thread_t *completely_fair_scheduler::pick_available_task()
 {
     auto task_list = get_cpu_task_list();
 
-    if (task_list->runable_list.empty())
+    auto dt = task_list->front();
+    if (dt == nullptr)
     {
         return cpu::current().get_idle_task();
     }
-    auto thd = task_list->runable_list.front();
-    task_list->runable_list.remove(thd);
-    if (!task_list->runable_list.empty())
-    {
-        kassert(get_schedule_data(thd.thread)->vtime <=
-                    get_schedule_data(task_list->runable_list.front().thread)->vtime,
-                "CFS running list check failed!");
-    }
-    return thd.thread;
+    task_list->dequeue(dt);
+    kassert(task_list->front() == nullptr || dt->vtime <= task_list->front()->vtime, "CFS running list check failed!");
+    dt->exec_start = timer::get_high_resolution_time();
+    return dt->thread;
 }
 
 bool completely_fair_scheduler::schedule()
@@ -293,34 +445,31 @@ void completely_fair_scheduler::schedule_tick()
     cpu.edit_load_data().running_task_time += ctime - cpu.edit_load_data().last_tick_time;
     cpu.edit_load_data().last_tick_time = ctime;
 
-    scher_data->vtime += scher_data->vtime_delta;
+    if (cur->process->pid != 0)
+        update_current(task_list, cur);
 
     u64 delta = timer::get_high_resolution_time() - cpu.edit_load_data().last_sched_time;
     if (delta >= sched_min_granularity_us)
     {
-        if (!task_list->runable_list.empty())
+        if (auto next = task_list->front())
         {
-            uctx::UninterruptibleContext icu;
-            auto next = task_list->runable_list.front();
-
-            if (cur->process->pid == 0 || get_schedule_data(next.thread)->vtime <= scher_data->vtime)
+            if (cur->process->pid == 0 || next->vtime <= scher_data->vtime)
                 cur->attributes |= thread_attributes::need_schedule;
         }
     }
 }
 
-u64 completely_fair_scheduler::scheduleable_task_count() { return get_cpu_task_list()->runable_list.size(); }
+u64 completely_fair_scheduler::scheduleable_task_count() { return get_cpu_task_list()->runable_tree.size(); }
 
 thread_t *completely_fair_scheduler::get_migratable_task(u32 cpuid)
 {
     auto list = get_cpu_task_list();
-    if (list->runable_list.empty())
-        return nullptr;
     uctx::UninterruptibleContext icu;
-    for (auto thd : list->runable_list)
+    for (auto node = list->runable_tree.first(); node != nullptr; node = util::rb_tree::next(node))
     {
-        if (thd.thread->cpumask.mask & (1ul << cpuid))
-            return thd.thread;
+        auto thd = get_run_node_data(node)->thread;
+        if (thd->cpumask.mask & (1ul << cpuid))
+            return thd;
     }
     return nullptr;
 }
@@ -330,17 +479,19 @@ void completely_fair_scheduler::commit_migrate(thread_t *thd)
     auto list = get_cpu_task_list();
     uctx::UninterruptibleContext icu;
 
-    auto it = list->runable_list.find(cfs_thread_t(thd));
-    kassert(it != list->runable_list.end(), "commit task failed!");
+    auto dt = get_schedule_data(thd);
+    kassert(dt->queue == cfs_queue_t::runable, "commit task failed!");
 
-    list->runable_list.remove(it);
+    list->dequeue(dt);
+    // carry the lag against this cpu over to the target cpu, see on_migrate
+    get_schedule_data(thd)->vtime -= list->min_vruntime;
 }
 
 u64 completely_fair_scheduler::sctl(int operator_type, thread_t *target, u64 attr, u64 *value, u64 size) { return 0; }
 
 completely_fair_scheduler::completely_fair_scheduler()
     : sched_min_granularity_us(2000)
-    , sched_wakeup_granularity_us(1)
+    , sched_wakeup_granularity_us(1000)
 {
 }
 
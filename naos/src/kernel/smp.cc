@@ -6,15 +6,96 @@
 #include "kernel/cpu.hpp"
 #include "kernel/irq.hpp"
 #include "kernel/lock.hpp"
+#include "kernel/mm/memory.hpp"
 #include "kernel/trace.hpp"
 #include "kernel/ucontext.hpp"
 
 namespace SMP
 {
 
+/// a shootdown waiting for the acknowledgement of its targets, lives on the stack of the initiator
+struct tlb_shootdown_t
+{
+    u64 context_id;
+    u64 start;
+    u64 end;
+    std::atomic_uint32_t pending;
+};
+
+/// shootdown posted to cpu i by cpu j, a cpu waits for its shootdown before it posts another one
+std::atomic<tlb_shootdown_t *> tlb_mailbox[arch::cpu::max_cpu_support][arch::cpu::max_cpu_support];
+/// shootdowns posted to each cpu
+std::atomic_uint32_t tlb_mailbox_count[arch::cpu::max_cpu_support];
+
+void flush_local_tlb(u64 context_id, u64 start, u64 end)
+{
+    if (context_id == 0)
+    {
+        // kernel entries are cached under every PCID
+        arch::paging::flush_all_context();
+        return;
+    }
+    if (arch::paging::get_loaded_context(arch::cpu::id()) != context_id)
+        return;
+    if ((end - start) / memory::page_size > tlb_flush_page_threshold)
+    {
+        arch::paging::reload();
+        return;
+    }
+    for (u64 v = start; v < end; v += memory::page_size)
+        arch::paging::invalidate_page((void *)v);
+}
+
+void answer_tlb_shootdown()
+{
+    u32 self = arch::cpu::id();
+    if (tlb_mailbox_count[self].load(std::memory_order_relaxed) == 0)
+        return;
+    uctx::UninterruptibleContext icu;
+    u64 n = arch::cpu::count();
+    for (u32 i = 0; i < n; i++)
+    {
+        auto *request = tlb_mailbox[self][i].exchange(nullptr);
+        if (request == nullptr)
+            continue;
+        tlb_mailbox_count[self]--;
+        flush_local_tlb(request->context_id, request->start, request->end);
+        request->pending--;
+    }
+}
+
+void flush_tlb_range(u64 context_id, u64 start, u64 end)
+{
+    uctx::UninterruptibleContext icu;
+    tlb_shootdown_t request;
+    request.context_id = context_id;
+    request.start = start & ~(memory::page_size - 1);
+    request.end = end;
+    request.pending = 0;
+
+    u32 self = arch::cpu::id();
+    u64 n = arch::cpu::count();
+    for (u32 i = 0; i < n; i++)
+    {
+        if (i == self || (context_id != 0 && arch::paging::get_loaded_context(i) != context_id))
+            continue;
+        request.pending++;
+        tlb_mailbox[i][self] = &request;
+        tlb_mailbox_count[i]++;
+        arch::APIC::local_post_IPI_mask(irq::hard_vector::IPI_tlb, arch::cpu::get(i).get_apic_id());
+    }
+    flush_local_tlb(context_id, request.start, request.end);
+    // a target may spin on a lock held by our caller, it answers while spinning. Answer the targets spinning here
+    while (request.pending > 0)
+    {
+        answer_tlb_shootdown();
+        cpu_pause();
+    }
+}
+
 irq::request_result flush_tlb_irq(const void *regs, u64 data, u64 user_data)
 {
-    arch::paging::reload();
+    answer_tlb_shootdown();
     return irq::request_result::ok;
 }
 
@@ -37,7 +118,7 @@ void init()
     }
 }
 
-void flush_all_tlb() { arch::APIC::local_post_IPI_all_notself(irq::hard_vector::IPI_tlb); }
+void flush_all_tlb() { flush_tlb_range(0, 0, 0); }
 
 void reschedule_cpu(u32 cpuid)
 {
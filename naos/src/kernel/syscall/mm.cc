@@ -35,7 +35,7 @@ u64 sbrk(i64 offset)
 }
 /// map memory/file
 ///
-/// \param flags 1:read;2:write;4:exec;8:file;16:share
+/// \param flags 1:read;2:write;4:exec;8:file;16:share;32:populate
 u64 map(u64 map_address, file_desc fd, u64 offset, u64 length, flag_t flags)
 {
     if (!is_user_space_pointer(map_address) || !is_user_space_pointer(map_address + length))
@@ -47,11 +47,17 @@ u64 map(u64 map_address, file_desc fd, u64 offset, u64 length, flag_t flags)
     fs::vfs::file *file = nullptr;
     if (flags & 8)
     {
-        auto file = res.get_file(fd);
+        file = res.get_file(fd);
         if (!file)
             return ENOEXIST;
     }
-    auto vm = vm_info->map_file(map_address, file, offset, length, flags);
+    flag_t vm_flags =
+        flags & (memory::vm::flags::readable | memory::vm::flags::writeable | memory::vm::flags::executeable);
+    if (flags & 16)
+        vm_flags |= memory::vm::flags::shared;
+    if (flags & 32)
+        vm_flags |= memory::vm::flags::populate;
+    auto vm = vm_info->map_file(map_address, file, offset, length, vm_flags);
 
     if (vm)
         return vm->start;
@@ -72,6 +78,32 @@ u64 umap(u64 address)
     return EFAILED;
 }
 
+/// write the pages written through the shared file mapping at address back to the file
+u64 sync_map(u64 address)
+{
+    if (!is_user_space_pointer(address))
+    {
+        return EPARAM;
+    }
+    auto vm_info = ((memory::vm::info_t *)(task::current_process()->mm_info));
+    vm_info->sync_map_file(address);
+    return OK;
+}
+
+/// get the page faults of the current process
+///
+/// \param major faults which have read a file
+/// \param minor faults resolved without I/O
+u64 page_faults(u64 *major, u64 *minor)
+{
+    if (!is_user_space_pointer(major) || !is_user_space_pointer(minor))
+        return EBUFFER;
+    auto vm_info = ((memory::vm::info_t *)(task::current_process()->mm_info));
+    *major = vm_info->major_faults;
+    *minor = vm_info->minor_faults;
+    return OK;
+}
+
 unsigned long create_msg_queue(unsigned long msg_count, unsigned long msg_bytes)
 {
     auto q = memory::create_msg_queue(msg_count, msg_bytes);
@@ -127,6 +159,8 @@ SYSCALL(54, create_msg_queue)
 SYSCALL(55, write_msg_queue)
 SYSCALL(56, read_msg_queue)
 SYSCALL(57, close_msg_queue)
+SYSCALL(59, page_faults)
+SYSCALL(60, sync_map)
 
 END_SYSCALL
 } // namespace syscall
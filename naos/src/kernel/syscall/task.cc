@@ -2,7 +2,9 @@
 #include "kernel/arch/klib.hpp"
 #include "kernel/fs/vfs/file.hpp"
 #include "kernel/fs/vfs/vfs.hpp"
+#include "kernel/futex.hpp"
 #include "kernel/syscall.hpp"
+#include "kernel/timer.hpp"
 
 namespace syscall
 {
@@ -44,6 +46,17 @@ process_id create_process(const char *filename, const char *args, flag_t flags)
     return EFAILED;
 }
 
+/// the new process returns 0 from the same syscall
+process_id fork(flag_t flags)
+{
+    auto p = task::fork_process(flags);
+    if (p)
+    {
+        return p->pid;
+    }
+    return EFAILED;
+}
+
 void user_thread(u64 arg0, u64 arg1, u64 arg2, u64 arg3)
 {
     arch::task::enter_userland(task::current(), (void *)arg1, arg0);
@@ -103,6 +116,60 @@ long wait_process(process_id pid, i64 *ret)
 /// sleep current thread
 void sleep(time::millisecond_t milliseconds) { task::do_sleep(milliseconds); }
 
+/// sleep current thread with a microsecond precision
+u64 nanosleep(time::nanosecond_t nanoseconds)
+{
+    task::do_nanosleep(nanoseconds);
+    return OK;
+}
+
+/// get the microseconds counted by the high resolution clock
+time::microsecond_t get_time() { return timer::get_high_resolution_time(); }
+
+enum futex_op : u64
+{
+    futex_wait = 0,
+    futex_wake = 1,
+    futex_requeue = 2,
+};
+
+/// wait, wake or requeue on a 32 bit word in user space
+///
+/// futex_wait: block while *addr == val, val2 is the timeout microseconds, 0 waits forever
+/// futex_wake: wake up at most val waiters
+/// futex_requeue: wake up at most val waiters, move at most val2 of the rest to addr2
+i64 futex(u32 *addr, u64 op, u64 val, u64 val2, u32 *addr2)
+{
+    if (addr == nullptr || !is_user_space_pointer(addr) || ((u64)addr & (sizeof(u32) - 1)) != 0)
+        return EPARAM;
+    switch (op)
+    {
+        case futex_wait:
+            switch (task::futex_wait(addr, val, val2))
+            {
+                case task::futex_wait_result::ok:
+                    return OK;
+                case task::futex_wait_result::again:
+                    return EAGAIN;
+                case task::futex_wait_result::timeout:
+                    return ETIMEOUT;
+                case task::futex_wait_result::interrupted:
+                    return EINTR;
+            }
+            return EFAILED;
+        case futex_wake:
+            return task::futex_wake(addr, val);
+        case futex_requeue:
+            // a waiter requeued to its own address would be walked again
+            if (addr2 == nullptr || addr2 == addr || !is_user_space_pointer(addr2) ||
+                ((u64)addr2 & (sizeof(u32) - 1)) != 0)
+                return EPARAM;
+            return task::futex_requeue(addr, val, val2, addr2);
+        default:
+            return EPARAM;
+    }
+}
+
 u64 sigaction(task::signal_num_t num, task::signal_func_t handler, u64 mask, flag_t flags)
 {
     if (handler == nullptr || !is_user_space_pointer(handler))
@@ -201,6 +268,10 @@ SYSCALL(44, sigreturn)
 SYSCALL(45, getcpu_running)
 SYSCALL(46, setcpu_mask)
 SYSCALL(47, getcpu_mask)
+SYSCALL(48, nanosleep)
+SYSCALL(49, futex)
+SYSCALL(58, fork)
+SYSCALL(61, get_time)
 END_SYSCALL
 
 } // namespace syscall
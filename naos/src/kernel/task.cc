@@ -6,6 +6,7 @@
 #include "kernel/mm/memory.hpp"
 #include "kernel/mm/new.hpp"
 #include "kernel/mm/slab.hpp"
+#include "kernel/mm/stat.hpp"
 #include "kernel/mm/vm.hpp"
 
 #include "kernel/util/array.hpp"
@@ -18,6 +19,7 @@
 #include "kernel/fs/vfs/pseudo.hpp"
 #include "kernel/fs/vfs/vfs.hpp"
 
+#include "kernel/futex.hpp"
 #include "kernel/scheduler.hpp"
 
 #include "kernel/timer.hpp"
@@ -78,6 +80,7 @@ using thread_map_t = util::hash_map<process_id, process_t *, process_hash>;
 process_map_t *global_process_map;
 // process_list_t *global_process_list;
 lock::spinlock_t process_list_lock;
+lock::lock_stat_t process_list_lock_stat("process_list");
 
 inline void *new_kernel_stack() { return memory::KernelBuddyAllocatorV->allocate(memory::kernel_stack_size, 0); }
 
@@ -145,7 +148,13 @@ inline thread_t *new_thread(process_t *p)
         return nullptr;
     }
 
-    thread_t *thd = memory::New<thread_t>(thread_t_allocator);
+    // the slab group keeps thread_t constructed, only reset the per thread state
+    thread_t *thd = (thread_t *)thread_t_allocator->allocate(sizeof(thread_t), alignof(thread_t));
+    thd->wait_counter = 0;
+    thd->preempt_data.reset();
+    thd->signal_pack.reset();
+    thd->futex_waiter = nullptr;
+    thd->futex_bucket = nullptr;
     thd->process = p;
     ((thread_list_t *)p->thread_list)->push_back(thd);
     register_info_t *register_info = memory::New<register_info_t>(register_info_t_allocator);
@@ -168,9 +177,13 @@ void delete_thread(thread_t *thd)
 
     ((thread_id_generator_t *)thd->process->thread_id_gen)->collect(thd->tid);
     memory::Delete<>(register_info_t_allocator, thd->register_info);
-    memory::Delete<>(thread_t_allocator, thd);
+    thread_t_allocator->deallocate(thd);
 }
 
+void thread_t_ctor(void *obj) { new (obj) thread_t(); }
+
+void thread_t_dtor(void *obj) { ((thread_t *)obj)->~thread_t(); }
+
 process_t::process_t()
     : wait_que(memory::KernelCommonAllocatorV)
     , wait_counter(0)
@@ -210,6 +223,23 @@ void create_devs()
     f->close();
 }
 
+void create_proc_file(const char *name, fs::vfs::pseudo_text_func func)
+{
+    fs::vfs::create(name, fs::vfs::global_root, fs::vfs::global_root, fs::create_flags::chr);
+    auto *f = fs::vfs::open(name, fs::vfs::global_root, fs::vfs::global_root, fs::mode::read, 0);
+    auto ps = memory::New<fs::vfs::pseudo_text_t>(memory::KernelCommonAllocatorV, func);
+    fs::vfs::fcntl(f, fs::fcntl_type::set, 0, fs::fcntl_attr::pseudo_func, (u64 *)&ps, 8);
+    f->close();
+}
+
+void create_procs()
+{
+    fs::vfs::create("/proc", fs::vfs::global_root, fs::vfs::global_root, fs::create_flags::directory);
+    create_proc_file("/proc/slabinfo", memory::slab_info);
+    create_proc_file("/proc/buddyinfo", memory::buddy_info);
+    create_proc_file("/proc/lockstat", lock::lock_stat_info);
+}
+
 std::atomic_bool is_init = false;
 void init()
 {
@@ -217,11 +247,13 @@ void init()
     if (cpu::current().is_bsp())
     {
         uctx::UninterruptibleContext icu;
+        process_list_lock.set_stat(&process_list_lock_stat);
         thread_list_cache_allocator = memory::New<thread_list_node_allocator_t>(memory::KernelCommonAllocatorV);
         global_process_map = memory::New<process_map_t>(memory::KernelCommonAllocatorV, memory::KernelMemoryAllocatorV);
 
         thread_t_allocator = memory::New<memory::SlabObjectAllocator>(
-            memory::KernelCommonAllocatorV, NewSlabGroup(memory::global_object_slab_domain, thread_t, 8, 0));
+            memory::KernelCommonAllocatorV, NewSlabGroupWithCtor(memory::global_object_slab_domain, thread_t, 8, 0,
+                                                                 thread_t_ctor, thread_t_dtor));
 
         process_t_allocator = memory::New<memory::SlabObjectAllocator>(
             memory::KernelCommonAllocatorV, NewSlabGroup(memory::global_object_slab_domain, process_t, 8, 0));
@@ -267,6 +299,7 @@ void init()
     {
         auto ft = current_process()->res_table.get_file_table();
         create_devs();
+        create_procs();
         ft->id_gen.tag(0);
         ft->id_gen.tag(1);
         ft->id_gen.tag(2);
@@ -312,15 +345,11 @@ thread_t *create_thread(process_t *process, thread_start_func start_func, u64 ar
     return thd;
 }
 
-process_t *create_process(fs::vfs::file *file, thread_start_func start_func, u64 arg0, const char *args,
-                          const char *env, flag_t flags)
+/// set up the file table of a new user process from the current process
+///
+/// \param work_dir the work directory unless create_process_flags::shared_work_dir is set
+void inherit_file_table(process_t *process, fs::vfs::dentry *work_dir, flag_t flags)
 {
-    auto process = new_process();
-    if (!process)
-        return nullptr;
-
-    process->parent_pid = current_process()->pid;
-
     auto old_ft = current_process()->res_table.get_file_table();
     auto new_ft = process->res_table.get_file_table();
 
@@ -332,7 +361,7 @@ process_t *create_process(fs::vfs::file *file, thread_start_func start_func, u64
     if (unlikely(flags & create_process_flags::shared_work_dir))
         new_ft->current = old_ft->current;
     else
-        new_ft->current = file->get_entry()->get_parent();
+        new_ft->current = work_dir;
 
     if (!(flags & create_process_flags::no_shared_stdin))
     {
@@ -364,6 +393,17 @@ process_t *create_process(fs::vfs::file *file, thread_start_func start_func, u64
     new_ft->id_gen.tag(0);
     new_ft->id_gen.tag(1);
     new_ft->id_gen.tag(2);
+}
+
+process_t *create_process(fs::vfs::file *file, thread_start_func start_func, u64 arg0, const char *args,
+                          const char *env, flag_t flags)
+{
+    auto process = new_process();
+    if (!process)
+        return nullptr;
+
+    process->parent_pid = current_process()->pid;
+    inherit_file_table(process, file->get_entry()->get_parent(), flags);
 
     auto mm_info = (mm_info_t *)process->mm_info;
     auto &vm_paging = mm_info->mmu_paging;
@@ -413,6 +453,70 @@ process_t *create_process(fs::vfs::file *file, thread_start_func start_func, u64
     return process;
 }
 
+/// close the files and free a process which has never run
+void discard_process(process_t *process)
+{
+    process->res_table.clear();
+    delete_process(process);
+}
+
+process_t *fork_process(flag_t flags)
+{
+    auto parent = current_process();
+    if (parent->mm_info == memory::kernel_vm_info)
+        return nullptr;
+    auto process = new_process();
+    if (!process)
+        return nullptr;
+
+    process->parent_pid = parent->pid;
+    inherit_file_table(process, parent->res_table.get_file_table()->current, flags);
+
+    auto mm_info = (mm_info_t *)process->mm_info;
+    if (!mm_info->fork_from((mm_info_t *)parent->mm_info))
+    {
+        trace::info("Can't copy the address space of process ", parent->pid);
+        discard_process(process);
+        return nullptr;
+    }
+
+    /// create thread
+    thread_t *thd = new_thread(process);
+    if (!thd)
+    {
+        discard_process(process);
+        return nullptr;
+    }
+    void *stack = new_kernel_stack();
+    if (!stack)
+    {
+        thd->kernel_stack_top = nullptr;
+        delete_thread(thd);
+        discard_process(process);
+        return nullptr;
+    }
+    process->main_thread = thd;
+    thd->attributes |= thread_attributes::main;
+    thd->state = thread_state::ready;
+    thd->cpumask.mask = cpumask_none;
+    void *stack_top = (char *)stack + memory::kernel_stack_size;
+    thd->kernel_stack_top = stack_top;
+
+    arch::task::create_fork_thread(thd);
+
+    // the stack vm is at the same address in the copy
+    thd->user_stack_top = current()->user_stack_top;
+    thd->user_stack_bottom = current()->user_stack_bottom;
+    mm_info->mmu_paging.sync_kernel();
+
+    if (flags & create_process_flags::real_time_rr)
+        scheduler::add(thd, scheduler::scheduler_class::round_robin);
+    else
+        scheduler::add(thd, scheduler::scheduler_class::cfs);
+
+    return process;
+}
+
 process_t *create_kernel_process(thread_start_func start_func, u64 arg0, flag_t flags)
 {
     auto process = new_kernel_process();
@@ -474,6 +578,9 @@ process_t *create_kernel_process(thread_start_func start_func, u64 arg0, flag_t
     return process;
 }
 
+/// a sleep may end up to 1/64 later, so sleepers share timer wakeups
+const u64 sleep_slack_per_ms = 1000 / 64;
+
 void sleep_callback_func(u64 pass, u64 data)
 {
     thread_t *thd = (thread_t *)data;
@@ -492,7 +599,20 @@ void do_sleep(u64 milliseconds)
 
     if (milliseconds != 0)
     {
-        timer::add_watcher(milliseconds * 1000, sleep_callback_func, (u64)current());
+        timer::add_watcher(milliseconds * 1000, sleep_callback_func, (u64)current(), milliseconds * sleep_slack_per_ms);
+        scheduler::update_state(current(), thread_state::interruptable);
+    }
+}
+
+void do_nanosleep(u64 nanoseconds)
+{
+    uctx::UninterruptibleContext icu;
+    current()->attributes |= task::thread_attributes::need_schedule;
+
+    u64 microseconds = (nanoseconds + 999) / 1000;
+    if (microseconds != 0)
+    {
+        timer::add_hrtimer(timer::get_high_resolution_time() + microseconds, sleep_callback_func, (u64)current());
         scheduler::update_state(current(), thread_state::interruptable);
     }
 }
@@ -512,6 +632,7 @@ void exit_process(process_t *process, i64 ret)
         else
         {
             scheduler::remove(thd);
+            futex_cancel(thd);
         }
     }
     process->res_table.clear();
@@ -586,7 +707,7 @@ void check_process(process_t *process)
                 memory::Delete<>(register_info_t_allocator, sub_thd->register_info);
                 if (likely((u64)sub_thd->kernel_stack_top > memory::kernel_stack_size))
                     delete_kernel_stack((void *)((u64)sub_thd->kernel_stack_top - memory::kernel_stack_size));
-                memory::Delete<>(thread_t_allocator, sub_thd);
+                thread_t_allocator->deallocate(sub_thd);
                 it = list->remove(it);
             }
             else
@@ -619,6 +740,7 @@ void exit_thread(thread_t *thd, i64 ret)
     thd->user_stack_top = (void *)ret;
     thd->state = thread_state::stop;
     scheduler::remove(thd);
+    futex_cancel(thd);
     if (thd->attributes & thread_attributes::detached)
     {
         thd->state = thread_state::destroy;
@@ -0,0 +1,18 @@
+#include "kernel/task/builtin/huge_page_task.hpp"
+#include "kernel/mm/vm.hpp"
+#include "kernel/task.hpp"
+
+namespace task::builtin::huge_page
+{
+/// fully populated windows are collapsed to 2MB frames at this interval
+const u64 collapse_interval_ms = 1000;
+
+void main(u64 arg0, u64 arg1, u64 arg2, u64 arg3)
+{
+    while (1)
+    {
+        memory::vm::collapse_huge_pages(memory::vm::huge_page_collapse_batch);
+        task::do_sleep(collapse_interval_ms);
+    }
+}
+} // namespace task::builtin::huge_page
@@ -5,8 +5,10 @@
 #include "kernel/scheduler.hpp"
 #include "kernel/smp.hpp"
 #include "kernel/task.hpp"
+#include "kernel/task/builtin/huge_page_task.hpp"
 #include "kernel/task/builtin/init_task.hpp"
 #include "kernel/task/builtin/input_task.hpp"
+#include "kernel/task/builtin/reclaim_task.hpp"
 #include "kernel/task/builtin/soft_irq_task.hpp"
 #include "kernel/trace.hpp"
 
@@ -22,6 +24,8 @@ void main()
         trace::debug("softirqd created tid=", p->main_thread->tid);
         is_init = true;
         task::create_kernel_process(builtin::input::main, 0, create_thread_flags::real_time_rr);
+        task::create_kernel_process(builtin::reclaim::main, 0, 0);
+        task::create_kernel_process(builtin::huge_page::main, 0, 0);
 
         auto file = fs::vfs::open("/bin/init", fs::vfs::global_root, fs::vfs::global_root,
                                   fs::mode::read | fs::mode::bin, fs::path_walk_flags::file);
@@ -47,7 +51,8 @@ void main()
     while (1)
     {
         kassert(arch::idt::is_enable(), "Bug check failed. interrupt disable");
-        __asm__ __volatile__("pause\n\t" : : : "memory");
+        // sleep until the next interrupt, the tick of an idle cpu is stopped
+        __asm__ __volatile__("hlt\n\t" : : : "memory");
     }
 }
 } // namespace task::builtin::idle
@@ -0,0 +1,14 @@
+#include "kernel/task/builtin/reclaim_task.hpp"
+#include "kernel/mm/shrinker.hpp"
+
+namespace task::builtin::reclaim
+{
+void main(u64 arg0, u64 arg1, u64 arg2, u64 arg3)
+{
+    while (1)
+    {
+        memory::balance_zones();
+        memory::wait_reclaim();
+    }
+}
+} // namespace task::builtin::reclaim
@@ -7,99 +7,324 @@
 #include "kernel/cpu.hpp"
 #include "kernel/irq.hpp"
 #include "kernel/lock.hpp"
-#include "kernel/mm/list_node_cache.hpp"
+#include "kernel/mm/memory.hpp"
 #include "kernel/trace.hpp"
 #include "kernel/ucontext.hpp"
 #include "kernel/util/array.hpp"
-#include "kernel/util/circular_buffer.hpp"
-#include "kernel/util/linked_list.hpp"
-#include "kernel/util/skip_list.hpp"
+#include "kernel/util/rb_tree.hpp"
 
 namespace timer
 {
 
 using clock_source_array_t = util::array<clock::clock_source *>;
 
+/// resolution of the timer wheel, a watcher runs within one unit after it expires
+constexpr u64 wheel_unit_us = 1000;
+constexpr u32 wheel_bits = 6;
+constexpr u64 wheel_slots = 1ul << wheel_bits;
+constexpr u64 wheel_mask = wheel_slots - 1;
+/// slots of level n span 64^n units, 4 levels cover about 4.6 hours.
+/// Watchers beyond wait in the last slot and are cascaded again.
+constexpr u32 wheel_levels = 4;
+/// level value of watchers taken out of the wheel by on_tick
+constexpr u8 expired_level = wheel_levels;
+/// level value of high resolution watchers, they are kept in a tree ordered by expiry instead
+constexpr u8 hrtimer_level = wheel_levels + 1;
+
+struct cpu_timer_t;
+
 struct watcher_t
 {
+    watcher_t *prev;
+    watcher_t *next;
+    /// the timer this watcher belongs to, watchers are never given back to the allocator
+    cpu_timer_t *owner;
+    /// identify one arming, 0 when the watcher is free
+    u64 id;
     /// target time microsecond
     u64 expires;
+    /// wheel unit the watcher is queued for, slack applied
+    u64 expires_unit;
     watcher_func function;
     u64 data;
+    u8 level;
+    u8 slot;
+    util::rb_node node;
+};
 
-    /// HACK: save bit 1 to function
+struct wheel_level_t
+{
+    watcher_t *slots[wheel_slots];
+    /// bit n is set if slots[n] isn't empty
+    u64 bitmap;
+};
 
-    void set_enable() { function = (watcher_func)((u64)function | (1ul << 63)); }
+struct cpu_timer_t
+{
+    lock::spinlock_t lock;
+    wheel_level_t levels[wheel_levels];
+    /// watchers run by on_tick
+    watcher_t *expired;
+    util::rb_tree hrtimers;
+    /// the next unit the wheel hasn't run
+    u64 wheel_time;
+    watcher_t *free_list;
+    u64 next_id;
+    /// the clock event is one-shot and programmed for the next expiry instead of ticking
+    bool nohz;
+    /// time point the clock event is programmed for
+    u64 next_event;
 
-    void clear_enable() { function = (watcher_func)((u64)function & ~(1ul << 63)); }
+    cpu_timer_t()
+        : expired(nullptr)
+        , wheel_time(0)
+        , free_list(nullptr)
+        , next_id(1)
+        , nohz(false)
+        , next_event(0)
+    {
+        for (auto &level : levels)
+        {
+            for (auto &slot : level.slots)
+                slot = nullptr;
+            level.bitmap = 0;
+        }
+    }
+};
 
-    bool is_enable() { return (u64)function >> 63; }
+watcher_t **list_head(cpu_timer_t &cpu_timer, u8 level, u8 slot)
+{
+    if (level == expired_level)
+        return &cpu_timer.expired;
+    return &cpu_timer.levels[level].slots[slot];
+}
 
-    watcher_t(u64 expires, watcher_func func, u64 data)
-        : expires(expires)
-        , function(func)
-        , data(data){};
+void link(cpu_timer_t &cpu_timer, watcher_t *w, u8 level, u8 slot)
+{
+    watcher_t **head = list_head(cpu_timer, level, slot);
+    w->level = level;
+    w->slot = slot;
+    w->prev = nullptr;
+    w->next = *head;
+    if (*head != nullptr)
+        (*head)->prev = w;
+    *head = w;
+    if (level != expired_level)
+        cpu_timer.levels[level].bitmap |= 1ul << slot;
+}
 
-    bool operator==(const watcher_t &w) { return expires == w.expires && function == w.function && data == w.data; }
-    bool operator<(const watcher_t &w) { return expires < w.expires; }
-};
+void unlink(cpu_timer_t &cpu_timer, watcher_t *w)
+{
+    watcher_t **head = list_head(cpu_timer, w->level, w->slot);
+    if (w->prev != nullptr)
+        w->prev->next = w->next;
+    else
+        *head = w->next;
+    if (w->next != nullptr)
+        w->next->prev = w->prev;
+    if (w->level != expired_level && *head == nullptr)
+        cpu_timer.levels[w->level].bitmap &= ~(1ul << w->slot);
+    w->prev = nullptr;
+    w->next = nullptr;
+}
 
-using watcher_list_t = util::array<watcher_t>;
-using tick_list_t = util::skip_list<watcher_t>;
-using recent_list_t = util::circular_buffer<watcher_t>;
+watcher_t *alloc_watcher(cpu_timer_t &cpu_timer)
+{
+    watcher_t *w = cpu_timer.free_list;
+    if (w != nullptr)
+        cpu_timer.free_list = w->next;
+    else
+    {
+        w = memory::New<watcher_t>(memory::KernelCommonAllocatorV);
+        w->owner = &cpu_timer;
+    }
+    w->id = cpu_timer.next_id++;
+    return w;
+}
 
-struct cpu_timer_t
+void free_watcher(cpu_timer_t &cpu_timer, watcher_t *w)
 {
-    watcher_list_t watcher_list;
-    tick_list_t tick_list;
+    w->id = 0;
+    w->next = cpu_timer.free_list;
+    cpu_timer.free_list = w;
+}
 
-    cpu_timer_t()
-        : watcher_list(memory::KernelCommonAllocatorV)
-        , tick_list(memory::KernelCommonAllocatorV, 2, 16)
+/// queue a watcher in the level whose span covers its distance from the wheel time
+void enqueue(cpu_timer_t &cpu_timer, watcher_t *w)
+{
+    u64 unit = w->expires_unit;
+    if (unit < cpu_timer.wheel_time)
+        unit = cpu_timer.wheel_time;
+    u64 delta = unit - cpu_timer.wheel_time;
+    if (delta >= 1ul << (wheel_bits * wheel_levels))
+        unit = cpu_timer.wheel_time + (1ul << (wheel_bits * wheel_levels)) - 1;
+    u32 level = 0;
+    while (level + 1 < wheel_levels && delta >= 1ul << (wheel_bits * (level + 1)))
+        level++;
+    link(cpu_timer, w, level, (unit >> (wheel_bits * level)) & wheel_mask);
+}
+
+void enqueue_hrtimer(cpu_timer_t &cpu_timer, watcher_t *w)
+{
+    w->level = hrtimer_level;
+    cpu_timer.hrtimers.insert(&w->node, [](util::rb_node *a, util::rb_node *b) {
+        return util::container_of<watcher_t, &watcher_t::node>(a)->expires <
+               util::container_of<watcher_t, &watcher_t::node>(b)->expires;
+    });
+}
+
+watcher_t *first_hrtimer(cpu_timer_t &cpu_timer)
+{
+    auto node = cpu_timer.hrtimers.first();
+    return node != nullptr ? util::container_of<watcher_t, &watcher_t::node>(node) : nullptr;
+}
+
+/// take a queued watcher out of the wheel or the hrtimer tree
+void dequeue(cpu_timer_t &cpu_timer, watcher_t *w)
+{
+    if (w->level == hrtimer_level)
+        cpu_timer.hrtimers.remove(&w->node);
+    else
+        unlink(cpu_timer, w);
+}
+
+/// move the current slot of a level to the levels below, called when the level below wraps
+void cascade(cpu_timer_t &cpu_timer, u32 level)
+{
+    u64 idx = (cpu_timer.wheel_time >> (wheel_bits * level)) & wheel_mask;
+    if (idx == 0 && level + 1 < wheel_levels)
+        cascade(cpu_timer, level + 1);
+    auto &l = cpu_timer.levels[level];
+    watcher_t *w = l.slots[idx];
+    l.slots[idx] = nullptr;
+    l.bitmap &= ~(1ul << idx);
+    while (w != nullptr)
     {
+        watcher_t *next = w->next;
+        enqueue(cpu_timer, w);
+        w = next;
     }
-};
+}
+
+/// run the wheel up to unit now, the watchers expired are moved to the expired list
+void advance(cpu_timer_t &cpu_timer, u64 now)
+{
+    auto &l0 = cpu_timer.levels[0];
+    while (cpu_timer.wheel_time <= now)
+    {
+        u64 idx = cpu_timer.wheel_time & wheel_mask;
+        if (idx == 0)
+            cascade(cpu_timer, 1);
+        watcher_t *w = l0.slots[idx];
+        l0.slots[idx] = nullptr;
+        l0.bitmap &= ~(1ul << idx);
+        while (w != nullptr)
+        {
+            watcher_t *next = w->next;
+            link(cpu_timer, w, expired_level, 0);
+            w = next;
+        }
+        // skip empty slots, but stop at the next cascade
+        u64 rest = l0.bitmap & ~((2ul << idx) - 1);
+        u64 next = cpu_timer.wheel_time - idx + (rest != 0 ? __builtin_ctzl(rest) : wheel_slots);
+        cpu_timer.wheel_time = next < now + 1 ? next : now + 1;
+    }
+}
+
+/// get the earliest unit a watcher may expire at. The slot start of a higher level is a lower bound,
+/// the slot is cascaded then.
+u64 next_expiry(cpu_timer_t &cpu_timer)
+{
+    u64 next = (u64)-1;
+    for (u32 level = 0; level < wheel_levels; level++)
+    {
+        u64 bitmap = cpu_timer.levels[level].bitmap;
+        if (bitmap == 0)
+            continue;
+        u32 shift = wheel_bits * level;
+        u64 base = cpu_timer.wheel_time >> shift;
+        u64 idx = base & wheel_mask;
+        u64 rotated = (bitmap >> idx) | (idx != 0 ? bitmap << (wheel_slots - idx) : 0);
+        // the current slot of a higher level is cascaded at its start, later on what is left there
+        // belongs to the next round
+        if ((cpu_timer.wheel_time & ((1ul << shift) - 1)) != 0)
+            rotated &= ~1ul;
+        u64 distance = rotated != 0 ? __builtin_ctzl(rotated) : wheel_slots;
+        u64 unit = (base + distance) << shift;
+        if (unit < next)
+            next = unit;
+    }
+    return next;
+}
+
+/// round the expiry up inside the slack, so nearby watchers share a slot and a wakeup
+u64 apply_slack(u64 unit, u64 slack_units)
+{
+    if (slack_units == 0)
+        return unit;
+    u64 limit = unit + slack_units;
+    u32 bit = 63 - __builtin_clzl(unit ^ limit);
+    return limit & ~((1ul << bit) - 1);
+}
 
 clock::clock_source *get_clock_source() { return cpu::current().get_clock_source(); }
 
 clock::clock_event *get_clock_event() { return cpu::current().get_clock_event(); }
 
-constexpr u64 tick_us = 1000;
+/// the longest sleep of a tickless cpu, the clock event clamps it further to its counter range
+constexpr u64 nohz_max_delta_us = 10000000;
+/// events closer than this are programmed this far, so the interrupt isn't missed
+constexpr u64 nohz_min_delta_us = 20;
+
+/// program the clock event for the earliest watcher, the timer lock must be held
+void program_next_event(cpu_timer_t &cpu_timer)
+{
+    u64 now = get_clock_source()->current();
+    u64 next = now + nohz_max_delta_us;
+    u64 unit = next_expiry(cpu_timer);
+    if (unit < next / wheel_unit_us)
+        next = unit * wheel_unit_us;
+    watcher_t *hr = first_hrtimer(cpu_timer);
+    if (hr != nullptr && hr->expires < next)
+        next = hr->expires;
+    u64 delta = next > now + nohz_min_delta_us ? next - now : nohz_min_delta_us;
+    cpu_timer.next_event = now + delta;
+    get_clock_event()->set_next_event(delta);
+}
 
 void on_tick(u64 vector, u64 data)
 {
     auto &cpu_timer = *(cpu_timer_t *)cpu::current().get_timer_queue();
-    u64 us = get_clock_source()->current();
-
+    uctx::RawSpinLockUninterruptibleController ctx(cpu_timer.lock);
+    ctx.begin();
+    u64 now = get_clock_source()->current();
+    for (watcher_t *w = first_hrtimer(cpu_timer); w != nullptr && w->expires <= now; w = first_hrtimer(cpu_timer))
     {
-        // add to tick list
-        uctx::UninterruptibleContext icu;
-        for (auto &ws : cpu_timer.watcher_list)
-        {
-            if (likely(ws.is_enable()))
-            {
-                cpu_timer.tick_list.insert(ws);
-            }
-        }
-        cpu_timer.watcher_list.clean();
+        cpu_timer.hrtimers.remove(&w->node);
+        auto f = w->function;
+        auto exp = w->expires;
+        auto d = w->data;
+        free_watcher(cpu_timer, w);
+        ctx.end();
+        f(exp, d);
+        ctx.begin();
     }
-    uctx::UninterruptibleController icc;
-    icc.begin();
-    auto it = cpu_timer.tick_list.begin();
-    for (; it != cpu_timer.tick_list.end() && it->expires <= us + tick_us / 2;)
+    advance(cpu_timer, now / wheel_unit_us);
+    while (cpu_timer.expired != nullptr)
     {
-        if (likely(it->is_enable()))
-        {
-            auto f = it->function;
-            auto exp = it->expires;
-            auto d = it->data;
-            icc.end();
-            f(exp, d);
-            icc.begin();
-        }
-        it = cpu_timer.tick_list.remove(it);
+        watcher_t *w = cpu_timer.expired;
+        unlink(cpu_timer, w);
+        auto f = w->function;
+        auto exp = w->expires;
+        auto d = w->data;
+        free_watcher(cpu_timer, w);
+        ctx.end();
+        f(exp, d);
+        ctx.begin();
     }
-    icc.end();
+    if (cpu_timer.nohz)
+        program_next_event(cpu_timer);
+    ctx.end();
 }
 lock::spinlock_t timer_spinlock;
 void init()
@@ -132,6 +357,17 @@ void init()
     cev->wait_next_tick();
     get_clock_source()->reinit();
 
+    {
+        auto &cpu_timer = *(cpu_timer_t *)cpu::current().get_timer_queue();
+        uctx::RawSpinLockUninterruptibleContext ctx(cpu_timer.lock);
+        cpu_timer.wheel_time = get_clock_source()->current() / wheel_unit_us;
+        if (cev->support_oneshot())
+        {
+            cpu_timer.nohz = true;
+            program_next_event(cpu_timer);
+        }
+    }
+
     if (cpu::current().is_bsp())
     {
         clock::init();
@@ -144,50 +380,60 @@ void init()
 
 time::microsecond_t get_high_resolution_time() { return get_clock_source()->current(); }
 
-void add_watcher(u64 expires_delta_time, watcher_func func, u64 user_data)
+watcher_handle_t arm_watcher(u64 expires, watcher_func func, u64 user_data, u64 slack)
 {
     auto &cpu_timer = *(cpu_timer_t *)cpu::current().get_timer_queue();
-    cpu_timer.watcher_list.push_back(watcher_t(expires_delta_time + get_high_resolution_time(), func, user_data));
+    uctx::RawSpinLockUninterruptibleContext ctx(cpu_timer.lock);
+    watcher_t *w = alloc_watcher(cpu_timer);
+    w->expires = expires;
+    w->expires_unit = apply_slack((expires + wheel_unit_us - 1) / wheel_unit_us, slack / wheel_unit_us);
+    w->function = func;
+    w->data = user_data;
+    enqueue(cpu_timer, w);
+    // a tickless cpu may sleep past the new watcher, bring the event forward
+    if (cpu_timer.nohz && w->expires_unit * wheel_unit_us < cpu_timer.next_event)
+        program_next_event(cpu_timer);
+    return watcher_handle_t(w, w->id);
 }
 
-bool add_time_point_watcher(u64 expires_time_point, watcher_func func, u64 user_data)
+watcher_handle_t add_hrtimer(u64 expires_time_point, watcher_func func, u64 user_data)
 {
     auto &cpu_timer = *(cpu_timer_t *)cpu::current().get_timer_queue();
+    uctx::RawSpinLockUninterruptibleContext ctx(cpu_timer.lock);
+    watcher_t *w = alloc_watcher(cpu_timer);
+    w->expires = expires_time_point;
+    w->function = func;
+    w->data = user_data;
+    enqueue_hrtimer(cpu_timer, w);
+    if (cpu_timer.nohz && w->expires < cpu_timer.next_event)
+        program_next_event(cpu_timer);
+    return watcher_handle_t(w, w->id);
+}
 
-    if (get_high_resolution_time() < expires_time_point)
-    {
-        cpu_timer.watcher_list.push_back(watcher_t(expires_time_point, func, user_data));
-        return true;
-    }
-    return false;
+watcher_handle_t add_watcher(u64 expires_delta_time, watcher_func func, u64 user_data, u64 slack)
+{
+    return arm_watcher(expires_delta_time + get_high_resolution_time(), func, user_data, slack);
 }
 
-///< don't remove timer in soft irq context
-void remove_watcher(watcher_func func)
+watcher_handle_t add_time_point_watcher(u64 expires_time_point, watcher_func func, u64 user_data, u64 slack)
 {
-    auto &cpu_timer = *(cpu_timer_t *)cpu::current().get_timer_queue();
+    if (get_high_resolution_time() >= expires_time_point)
+        return watcher_handle_t();
+    return arm_watcher(expires_time_point, func, user_data, slack);
+}
 
-    for (auto it = cpu_timer.watcher_list.begin(); it != cpu_timer.watcher_list.end(); ++it)
-    {
-        if (it->function == func)
-        {
-            cpu_timer.watcher_list.remove(it);
-            return;
-        }
-    }
-    uctx::UninterruptibleContext icu;
-    for (auto it = cpu_timer.tick_list.begin(); it != cpu_timer.tick_list.end();)
-    {
-        if (it->function <= func)
-        {
-            it->clear_enable();
-            return;
-        }
-        else
-        {
-            ++it;
-        }
-    }
+bool remove_watcher(watcher_handle_t handle)
+{
+    if (handle.watcher == nullptr)
+        return false;
+    watcher_t *w = handle.watcher;
+    auto &cpu_timer = *w->owner;
+    uctx::RawSpinLockUninterruptibleContext ctx(cpu_timer.lock);
+    if (w->id != handle.id)
+        return false;
+    dequeue(cpu_timer, w);
+    free_watcher(cpu_timer, w);
+    return true;
 }
 
 } // namespace timer
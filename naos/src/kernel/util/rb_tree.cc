@@ -0,0 +1,255 @@
+#include "kernel/util/rb_tree.hpp"
+
+namespace util
+{
+void rb_tree::rotate_left(rb_node *node)
+{
+    rb_node *r = node->right;
+    node->right = r->left;
+    if (r->left != nullptr)
+        r->left->parent = node;
+    r->parent = node->parent;
+    if (node->parent == nullptr)
+        root = r;
+    else if (node == node->parent->left)
+        node->parent->left = r;
+    else
+        node->parent->right = r;
+    r->left = node;
+    node->parent = r;
+}
+
+void rb_tree::rotate_right(rb_node *node)
+{
+    rb_node *l = node->left;
+    node->left = l->right;
+    if (l->right != nullptr)
+        l->right->parent = node;
+    l->parent = node->parent;
+    if (node->parent == nullptr)
+        root = l;
+    else if (node == node->parent->right)
+        node->parent->right = l;
+    else
+        node->parent->left = l;
+    l->right = node;
+    node->parent = l;
+}
+
+void rb_tree::link(rb_node *node, rb_node *parent, rb_node **place, bool is_leftmost)
+{
+    node->parent = parent;
+    node->left = nullptr;
+    node->right = nullptr;
+    node->red = true;
+    *place = node;
+    if (is_leftmost)
+        leftmost = node;
+    count++;
+    insert_fixup(node);
+}
+
+void rb_tree::insert_fixup(rb_node *node)
+{
+    while (node->parent != nullptr && node->parent->red)
+    {
+        rb_node *parent = node->parent;
+        rb_node *grand = parent->parent;
+        if (parent == grand->left)
+        {
+            rb_node *uncle = grand->right;
+            if (uncle != nullptr && uncle->red)
+            {
+                parent->red = false;
+                uncle->red = false;
+                grand->red = true;
+                node = grand;
+                continue;
+            }
+            if (node == parent->right)
+            {
+                rotate_left(parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            grand->red = true;
+            rotate_right(grand);
+        }
+        else
+        {
+            rb_node *uncle = grand->left;
+            if (uncle != nullptr && uncle->red)
+            {
+                parent->red = false;
+                uncle->red = false;
+                grand->red = true;
+                node = grand;
+                continue;
+            }
+            if (node == parent->left)
+            {
+                rotate_right(parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            grand->red = true;
+            rotate_left(grand);
+        }
+    }
+    root->red = false;
+}
+
+rb_node *rb_tree::next(rb_node *node)
+{
+    if (node->right != nullptr)
+    {
+        node = node->right;
+        while (node->left != nullptr)
+            node = node->left;
+        return node;
+    }
+    rb_node *parent = node->parent;
+    while (parent != nullptr && node == parent->right)
+    {
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
+}
+
+void rb_tree::remove(rb_node *node)
+{
+    if (node == leftmost)
+        leftmost = next(node);
+    count--;
+
+    rb_node *child, *parent;
+    bool removed_red;
+    if (node->left == nullptr || node->right == nullptr)
+    {
+        // at most one child, it takes the place of node
+        child = node->left != nullptr ? node->left : node->right;
+        parent = node->parent;
+        removed_red = node->red;
+        if (child != nullptr)
+            child->parent = parent;
+        if (parent == nullptr)
+            root = child;
+        else if (parent->left == node)
+            parent->left = child;
+        else
+            parent->right = child;
+    }
+    else
+    {
+        // two children, the successor (without left child) takes the place and the color of node
+        rb_node *succ = node->right;
+        while (succ->left != nullptr)
+            succ = succ->left;
+        child = succ->right;
+        removed_red = succ->red;
+        if (succ->parent == node)
+        {
+            parent = succ;
+        }
+        else
+        {
+            parent = succ->parent;
+            parent->left = child;
+            if (child != nullptr)
+                child->parent = parent;
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->parent = node->parent;
+        succ->red = node->red;
+        if (node->parent == nullptr)
+            root = succ;
+        else if (node->parent->left == node)
+            node->parent->left = succ;
+        else
+            node->parent->right = succ;
+    }
+    node->parent = node->left = node->right = nullptr;
+    if (!removed_red)
+        erase_fixup(child, parent);
+}
+
+void rb_tree::erase_fixup(rb_node *node, rb_node *parent)
+{
+    while (node != root && (node == nullptr || !node->red))
+    {
+        if (node == parent->left)
+        {
+            rb_node *sibling = parent->right;
+            if (sibling->red)
+            {
+                sibling->red = false;
+                parent->red = true;
+                rotate_left(parent);
+                sibling = parent->right;
+            }
+            if ((sibling->left == nullptr || !sibling->left->red) &&
+                (sibling->right == nullptr || !sibling->right->red))
+            {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (sibling->right == nullptr || !sibling->right->red)
+            {
+                sibling->left->red = false;
+                sibling->red = true;
+                rotate_right(sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rotate_left(parent);
+            node = root;
+            break;
+        }
+        else
+        {
+            rb_node *sibling = parent->left;
+            if (sibling->red)
+            {
+                sibling->red = false;
+                parent->red = true;
+                rotate_right(parent);
+                sibling = parent->left;
+            }
+            if ((sibling->left == nullptr || !sibling->left->red) &&
+                (sibling->right == nullptr || !sibling->right->red))
+            {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (sibling->left == nullptr || !sibling->left->red)
+            {
+                sibling->right->red = false;
+                sibling->red = true;
+                rotate_left(sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rotate_right(parent);
+            node = root;
+            break;
+        }
+    }
+    if (node != nullptr)
+        node->red = false;
+}
+
+} // namespace util
@@ -125,6 +125,14 @@ SYS_CALL(44, void, sigreturn, int code)
 SYS_CALL(45, int, getcpucorerunning)
 SYS_CALL(46, void, setcpumask, unsigned long mask0, unsigned long mask1)
 SYS_CALL(47, void, getcpumask, unsigned long *mask0, unsigned long *mask1)
+SYS_CALL(48, long, nanosleep, unsigned long ns)
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 2
+
+SYS_CALL(49, long, futex, unsigned int *addr, unsigned long op, unsigned long val, unsigned long val2,
+         unsigned int *addr2)
 
 SYS_CALL(50, bool, brk, unsigned long ptr)
 SYS_CALL(51, unsigned long, sbrk, long offset)
@@ -134,6 +142,7 @@ SYS_CALL(51, unsigned long, sbrk, long offset)
 #define MMAP_EXEC 4
 #define MMAP_FILE 8
 #define MMAP_SHARED 16
+#define MMAP_POPULATE 32
 
 SYS_CALL(52, void *, mmap, unsigned long start, int fd, unsigned long offset, unsigned long len, unsigned long flags)
 SYS_CALL(53, unsigned long, mumap, void *addr)
@@ -142,6 +151,11 @@ SYS_CALL(55, long, write_msg_queue, long key, unsigned long type, const void *bu
          unsigned long flags)
 SYS_CALL(56, long, read_msg_queue, long key, unsigned long type, void *buffer, unsigned long size, unsigned long flags)
 SYS_CALL(57, void, close_msg_queue, long key)
+SYS_CALL(58, long, fork, unsigned long flags)
+SYS_CALL(59, long, page_faults, unsigned long *major, unsigned long *minor)
+SYS_CALL(60, long, msync, void *addr)
+/// microseconds of the high resolution clock
+SYS_CALL(61, unsigned long, get_time)
 
 #define MSGQUEUE_FLAGS_NOBLOCK 1
 #define MSGQUEUE_FLAGS_NOBLOCKOTHER 2
@@ -159,3 +173,4 @@ SYS_CALL(57, void, close_msg_queue, long key)
 #define EINNER -10
 #define EFAILED -11
 #define ECONTI -12
+#define EAGAIN -13
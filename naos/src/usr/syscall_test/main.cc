@@ -333,6 +333,236 @@ void test_memory()
     print("memory tested.\n");
 }
 
+int fork_value = 1;
+
+void test_fork()
+{
+    print("fork testing\n");
+    char *p = (char *)mmap(0, 0, 0, 4096, MMAP_READ | MMAP_WRITE);
+    *p = 'A';
+    long pid = fork(0);
+    if (pid == 0)
+    {
+        // the child writes its own copy
+        bool same = fork_value == 1 && *p == 'A';
+        fork_value = 2;
+        *p = 'B';
+        exit(same ? 3 : -1);
+    }
+    long ret = -1;
+    if (pid < 0 || wait_process(pid, &ret) != 0 || ret != 3 || fork_value != 1 || *p != 'A')
+    {
+        print("fork test failed.\n");
+        exit_thread(-1);
+    }
+    mumap(p);
+    print("fork tested\n");
+}
+
+void test_nanosleep()
+{
+    print("nanosleep testing\n");
+    // 0 returns at once, a part of a microsecond is rounded up
+    if (nanosleep(0) != OK || nanosleep(500) != OK)
+    {
+        print("nanosleep test failed.\n");
+        exit_thread(-1);
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        unsigned long start = get_time();
+        if (nanosleep(100000) != OK)
+        {
+            print("nanosleep test failed.\n");
+            exit_thread(-1);
+        }
+        unsigned long elapsed = get_time() - start;
+        // woken no earlier than asked, and within a few ticks after
+        if (elapsed < 100 || elapsed > 100 + 50000)
+        {
+            print("nanosleep test failed. elapsed time out of range\n");
+            exit_thread(-1);
+        }
+    }
+    print("nanosleep tested\n");
+}
+
+unsigned int futex_word = 0;
+unsigned int futex_word2 = 0;
+
+void futex_thread(long requeued)
+{
+    if (requeued)
+    {
+        // woken on futex_word2 after the main thread has requeued it
+        exit_thread(futex(&futex_word, FUTEX_WAIT, 0, 0, nullptr));
+    }
+    while (futex_word == 0)
+    {
+        long ret = futex(&futex_word, FUTEX_WAIT, 0, 0, nullptr);
+        if (ret != OK && ret != EAGAIN)
+            exit_thread(ret);
+    }
+    exit_thread(0);
+}
+
+void futex_exit_thread()
+{
+    futex(&futex_word2, FUTEX_WAIT, 0, 10000000, nullptr);
+    exit(-1);
+}
+
+void test_futex()
+{
+    print("futex testing\n");
+    if (futex(&futex_word, FUTEX_WAIT, 1, 0, nullptr) != EAGAIN)
+    {
+        print("futex test failed. wait on a changed value\n");
+        exit_thread(-1);
+    }
+    if (futex(&futex_word, FUTEX_WAIT, 0, 1000, nullptr) != ETIMEOUT)
+    {
+        print("futex test failed. wait timeout\n");
+        exit_thread(-1);
+    }
+
+    long ret = -1;
+    auto tid = create_thread((void *)futex_thread, 0, 0);
+    sleep(10);
+    futex_word = 1;
+    futex(&futex_word, FUTEX_WAKE, 1, 0, nullptr);
+    join(tid, &ret);
+    if (ret != 0)
+    {
+        print("futex test failed. wait/wake\n");
+        exit_thread(-1);
+    }
+
+    if (futex(&futex_word, FUTEX_REQUEUE, 0, 2, &futex_word) != EPARAM)
+    {
+        print("futex test failed. requeue to the same address\n");
+        exit_thread(-1);
+    }
+
+    futex_word = 0;
+    auto tid1 = create_thread((void *)futex_thread, 1, 0);
+    auto tid2 = create_thread((void *)futex_thread, 1, 0);
+    long moved = 0;
+    while (moved < 2)
+    {
+        moved += futex(&futex_word, FUTEX_REQUEUE, 0, 2 - moved, &futex_word2);
+        sleep(1);
+    }
+    long ret2 = -1;
+    if (futex(&futex_word, FUTEX_WAKE, 2, 0, nullptr) != 0 || futex(&futex_word2, FUTEX_WAKE, 2, 0, nullptr) != 2)
+    {
+        print("futex test failed. requeue\n");
+        exit(-1);
+    }
+    join(tid1, &ret);
+    join(tid2, &ret2);
+    if (ret != OK || ret2 != OK)
+    {
+        print("futex test failed. requeue\n");
+        exit_thread(-1);
+    }
+
+    // exit while a thread waits with a timeout, the waiter must be unlinked with its thread
+    futex_word2 = 0;
+    long pid = fork(0);
+    if (pid == 0)
+    {
+        create_thread((void *)futex_exit_thread, 0, 0);
+        sleep(10);
+        exit(3);
+    }
+    if (pid < 0 || wait_process(pid, &ret) != 0 || ret != 3)
+    {
+        print("futex test failed. exit while waiting\n");
+        exit_thread(-1);
+    }
+    print("futex tested\n");
+}
+
+void test_page_faults()
+{
+    print("page faults testing\n");
+    const unsigned long pages = 4;
+    unsigned long major, minor, major2, minor2;
+    char *p = (char *)mmap(0, 0, 0, pages * 4096, MMAP_READ | MMAP_WRITE);
+    page_faults(&major, &minor);
+    for (unsigned long i = 0; i < pages; i++)
+        p[i * 4096] = 'A';
+    page_faults(&major2, &minor2);
+    mumap(p);
+    if (minor2 == minor || major2 != major)
+    {
+        print("page faults test failed. anonymous memory\n");
+        exit_thread(-1);
+    }
+
+    // a populated mapping doesn't fault
+    p = (char *)mmap(0, 0, 0, pages * 4096, MMAP_READ | MMAP_WRITE | MMAP_POPULATE);
+    page_faults(&major, &minor);
+    for (unsigned long i = 0; i < pages; i++)
+        p[i * 4096] = 'A';
+    page_faults(&major2, &minor2);
+    mumap(p);
+    if (minor2 != minor || major2 != major)
+    {
+        print("page faults test failed. populated memory\n");
+        exit_thread(-1);
+    }
+    unsigned long *kernel_addr = (unsigned long *)0xFFFF800000000000UL;
+    if (page_faults(kernel_addr, kernel_addr) != EBUFFER)
+    {
+        print("page faults test failed. invalid buffer\n");
+        exit_thread(-1);
+    }
+    print("page faults tested\n");
+}
+
+void test_sync_map()
+{
+    print("sync map testing\n");
+    mkdir("/tmp/");
+    mount("", "/tmp/", "ramfs", 0, nullptr, 0x10000);
+    create("/tmp/sync_map");
+    write_file("/tmp/sync_map");
+
+    int fd = open("/tmp/sync_map", OPEN_MODE_READ | OPEN_MODE_WRITE | OPEN_MODE_BIN, 0);
+    char *p = (char *)mmap(0, fd, 0, sizeof(file_content), MMAP_READ | MMAP_WRITE | MMAP_FILE | MMAP_SHARED);
+    p[0] = 'X';
+    if (msync(p) != OK || msync((void *)0xFFFF800000000000UL) != EPARAM)
+    {
+        print("sync map test failed.\n");
+        exit_thread(-1);
+    }
+    mumap(p);
+    close(fd);
+
+    // written back to the file
+    char fc[sizeof(file_content)];
+    fd = open("/tmp/sync_map", OPEN_MODE_READ | OPEN_MODE_BIN, 0);
+    if (pread(fd, 0, fc, sizeof(file_content), 0) != (long)sizeof(file_content) || fc[0] != 'X')
+    {
+        print("sync map test failed. data isn't written back\n");
+        exit_thread(-1);
+    }
+    for (unsigned int i = 1; i < sizeof(file_content); i++)
+    {
+        if (file_content[i] != fc[i])
+        {
+            print("sync map test failed. data isn't written back\n");
+            exit_thread(-1);
+        }
+    }
+    close(fd);
+    unlink("/tmp/sync_map");
+    umount("/tmp");
+    print("sync map tested\n");
+}
+
 void sighandler(int sig, long error, long code, long status)
 {
     print("signal SIGINT handled\n");
@@ -350,6 +580,11 @@ extern "C" void _start(char *args)
     test_message_queue();
     test_pipe();
     test_fifo();
+    test_fork();
+    test_nanosleep();
+    test_futex();
+    test_page_faults();
+    test_sync_map();
     long ret;
     print("join thread2\n");
     join(tid, &ret);